@@ -0,0 +1,92 @@
+// Sends eval requests to an atlis --serve daemon and prints the responses.
+//
+//   atlis_client socket-path [expr...]
+//
+// Each expr is one request; with none, all of stdin is sent as one. Requests
+// are pipelined, the responses printed in order. Exits with 1 if any request
+// raised an error.
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static bool read_all(int fd, char* p, size_t n)
+{
+	while( n )
+	{
+		ssize_t r = ::read(fd, p, n);
+		if( r <= 0 ) return false;
+		p += r;
+		n -= r;
+	}
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	if( argc < 2 )
+	{
+		fprintf(stderr, "usage: atlis_client socket-path [expr...]\n");
+		return 2;
+	}
+
+	std::vector<std::string> reqs(argv+2, argv+argc);
+	if( reqs.empty() ) reqs.push_back(std::string(std::istreambuf_iterator<char>(std::cin), std::istreambuf_iterator<char>()));
+
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path)-1);
+
+	int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if( fd < 0 || ::connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0 )
+	{
+		perror(argv[1]);
+		return 2;
+	}
+
+	std::string out;
+	for(const std::string& r : reqs)
+	{
+		uint32_t len = htonl(r.size());
+		out.append((const char*)&len, 4);
+		out += r;
+	}
+	for(size_t done = 0; done < out.size(); )
+	{
+		ssize_t n = ::write(fd, out.data()+done, out.size()-done);
+		if( n <= 0 )
+		{
+			perror("write");
+			return 2;
+		}
+		done += n;
+	}
+	::shutdown(fd, SHUT_WR);
+
+	int status = 0;
+	for(size_t i = 0; i < reqs.size(); ++i)
+	{
+		uint32_t len;
+		if( !read_all(fd, (char*)&len, 4) )
+		{
+			fprintf(stderr, "connection closed\n");
+			return 2;
+		}
+		std::string body(ntohl(len), 0);
+		if( body.empty() || !read_all(fd, &body[0], body.size()) ) return 2;
+
+		if( body[0] == 'e' ) status = 1;
+		fprintf(body[0] == 'e' ? stderr : stdout, "%s\n", body.c_str()+1);
+	}
+
+	::close(fd);
+	return status;
+}
@@ -0,0 +1,162 @@
+// Summarizes a heap snapshot written by (heap-snapshot "file"): totals, then
+// the types, the roots retaining the most and, if sites were tracked, the
+// funcs that allocated the most, largest first. Given an older snapshot too,
+// each line also says how much it grew since then, and the lists go by growth.
+//
+//   atlis_heap [--top n] snapshot [older-snapshot]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+struct counts
+{
+	long long objects = 0;
+	long long bytes = 0;
+};
+
+struct snapshot
+{
+	long long heap = 0;
+	counts reachable;
+	counts symbols;
+	// keyed by the name, for types and roots, or "type func" for sites
+	std::map<std::string, counts> types, roots, sites;
+};
+
+static bool load(const char* path, snapshot& S)
+{
+	std::ifstream f(path);
+	std::string line;
+	if( !f || !std::getline(f, line) || line.compare(0, 19, "atlis-heap-snapshot") )
+	{
+		fprintf(stderr, "atlis_heap: %s isn't a heap snapshot\n", path);
+		return false;
+	}
+
+	while( std::getline(f, line) )
+	{
+		std::istringstream in(line);
+		std::string kind, name;
+		counts c;
+		in >> kind >> c.objects;
+		if( kind == "heap" )
+		{
+			S.heap = c.objects;
+			continue;
+		}
+		in >> c.bytes;
+		std::getline(in >> std::ws, name);
+		if( kind == "reachable" ) S.reachable = c;
+		else if( kind == "symbols" ) S.symbols = c;
+		else if( kind == "type" ) S.types[name] = c;
+		else if( kind == "root" ) S.roots[name] = c;
+		else if( kind == "site" ) S.sites[name] = c;
+	}
+	return true;
+}
+
+static std::string size(long long bytes)
+{
+	char buf[32];
+	long long a = llabs(bytes);
+	if( a >= 10ll<<30 ) snprintf(buf, sizeof(buf), "%lldG", bytes >> 30);
+	else if( a >= 10ll<<20 ) snprintf(buf, sizeof(buf), "%lldM", bytes >> 20);
+	else if( a >= 10ll<<10 ) snprintf(buf, sizeof(buf), "%lldK", bytes >> 10);
+	else snprintf(buf, sizeof(buf), "%lld", bytes);
+	return buf;
+}
+
+static void table(const char* title, const std::map<std::string, counts>& now, const std::map<std::string, counts>* then, size_t top)
+{
+	if( now.empty() ) return;
+
+	struct row { std::string name; counts c, grew; };
+	std::vector<row> rows;
+	for(auto& e : now)
+	{
+		row r{e.first, e.second, e.second};
+		if( then )
+		{
+			auto it = then->find(e.first);
+			if( it != then->end() )
+			{
+				r.grew.objects -= it->second.objects;
+				r.grew.bytes -= it->second.bytes;
+			}
+		}
+		rows.push_back(r);
+	}
+	// what's gone since is growth too, the negative kind
+	if( then )
+	{
+		for(auto& e : *then)
+		{
+			if( !now.count(e.first) ) rows.push_back({e.first, counts(), {-e.second.objects, -e.second.bytes}});
+		}
+	}
+	std::sort(rows.begin(), rows.end(), [&](const row& a, const row& b) {
+		return then ? a.grew.bytes > b.grew.bytes : a.c.bytes > b.c.bytes;
+	});
+
+	printf("\n%s\n", title);
+	if( then )
+		printf("  %10s %8s %10s %8s  %s\n", "objects", "bytes", "+objects", "+bytes", "name");
+	else
+		printf("  %10s %8s  %s\n", "objects", "bytes", "name");
+	for(size_t i = 0; i < rows.size() && i < top; ++i)
+	{
+		const row& r = rows[i];
+		if( then )
+			printf("  %10lld %8s %+10lld %8s  %s\n", r.c.objects, size(r.c.bytes).c_str(), r.grew.objects,
+				((r.grew.bytes > 0 ? "+" : "") + size(r.grew.bytes)).c_str(), r.name.c_str());
+		else
+			printf("  %10lld %8s  %s\n", r.c.objects, size(r.c.bytes).c_str(), r.name.c_str());
+	}
+	if( rows.size() > top ) printf("  (%zu more)\n", rows.size() - top);
+	return;
+}
+
+static int usage()
+{
+	fprintf(stderr, "usage: atlis_heap [--top n] snapshot [older-snapshot]\n");
+	return 2;
+}
+
+int main(int argc, char** argv)
+{
+	size_t top = 20;
+	std::vector<const char*> files;
+	for(int i = 1; i < argc; ++i)
+	{
+		if( !strcmp(argv[i], "--top") && i+1 < argc )
+			top = atoi(argv[++i]);
+		else if( argv[i][0] == '-' )
+			return usage();
+		else
+			files.push_back(argv[i]);
+	}
+	if( files.empty() || files.size() > 2 ) return usage();
+
+	snapshot now, then;
+	if( !load(files[0], now) ) return 1;
+	if( files.size() > 1 && !load(files[1], then) ) return 1;
+	const snapshot* old = files.size() > 1 ? &then : nullptr;
+
+	printf("reachable  %lld objects, %s bytes", now.reachable.objects, size(now.reachable.bytes).c_str());
+	if( old ) printf(" (%+lld objects, %s bytes)", now.reachable.objects - old->reachable.objects,
+		((now.reachable.bytes > old->reachable.bytes ? "+" : "") + size(now.reachable.bytes - old->reachable.bytes)).c_str());
+	printf("\nheap       %lld objects, garbage not yet swept included\n", now.heap);
+	printf("symbols    %lld, %s bytes, shared by every isolate\n", now.symbols.objects, size(now.symbols.bytes).c_str());
+
+	table("by type", now.types, old ? &old->types : nullptr, top);
+	table("retained by root", now.roots, old ? &old->roots : nullptr, top);
+	table("by allocation site (type func)", now.sites, old ? &old->sites : nullptr, top);
+	return 0;
+}
@@ -0,0 +1,235 @@
+// The standard benchmark set, run through the interpreter: each program in
+// bench/suite defines (run), which is called once to check its result and
+// then timed over a number of runs, in an isolate of its own. A table goes
+// to stderr and the results as JSON to stdout (or --json file), so runs can
+// be compared across revisions. Exits with 1 if any result was wrong. With
+// --trace the whole run is traced (see trace.cpp) and the trace written to
+// the file, to see what tracing costs.
+//
+//   atlis_bench [--dir suite-dir] [--runs n] [--json file] [--no-jit] [--trace file] [name...]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include "../types.h"
+#include "../funcs.h"
+#include "../isolate.h"
+
+#ifndef ATLIS_BENCH_DIR
+#define ATLIS_BENCH_DIR "bench/suite"
+#endif
+#ifndef ATLIS_REVISION
+#define ATLIS_REVISION "unknown"
+#endif
+
+struct benchmark
+{
+	const char* name;
+	const char* expected;
+};
+
+static const benchmark suite[] = {
+	{"tak", "9"},
+	{"fib", "196418"},
+	{"ctak", "7"},
+	{"nqueens", "92"},
+	{"deriv", "(+ (* (* 3 X X) (+ (/ 0 3) (/ 1 X) (/ 1 X))) (* (* A X X) (+ (/ 0 A) (/ 1 X) (/ 1 X))) (* (* B X) (+ (/ 0 B) (/ 1 X))) 0)"},
+	{"browse", "13"},
+	{"destructive", "(3 3 4 4 5 5 5 5 5 21)"},
+	{"readwrite", "T"},
+};
+
+struct result
+{
+	std::string name;
+	std::string value;
+	std::string error;
+	bool ok = false;
+	std::vector<double> ms;
+	u64 collections = 0;
+	u64 gc_pause_us = 0;
+};
+
+static bool read_file(const std::string& path, std::string& out)
+{
+	std::ifstream f(path);
+	if( !f ) return false;
+	std::stringstream ss;
+	ss << f.rdbuf();
+	out = ss.str();
+	return true;
+}
+
+// a fresh string port for readwrite, so runs don't pile up in one
+static void new_port(Isolate* I)
+{
+	isolate_scope S(I);
+	lptr port = lnew<lstream>(new std::stringstream);
+	for(auto& p : I->first_fscope.symbols)
+	{
+		if( p.first == intern_c("bench-port").sym() ) p.second = port;
+	}
+	return;
+}
+
+static result run_one(const benchmark& b, const std::string& dir, int runs)
+{
+	result r;
+	r.name = b.name;
+
+	std::string src;
+	if( !read_file(dir + "/" + b.name + ".lisp", src) )
+	{
+		r.error = "can't read " + dir + "/" + b.name + ".lisp";
+		return r;
+	}
+
+	Isolate* I = isolate_create();
+try {
+	isolate_eval(I, "(define bench-port ())");
+	isolate_eval(I, src);
+
+	new_port(I);
+	r.value = isolate_eval_string(I, "(run)");
+	r.ok = r.value == b.expected;
+
+	u64 collections = I->gc.collections;
+	u64 pause = I->gc.total_pause_us;
+	for(int i = 0; i < runs; ++i)
+	{
+		new_port(I);
+		auto start = std::chrono::steady_clock::now();
+		isolate_eval(I, "(run)");
+		r.ms.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+	}
+	r.collections = I->gc.collections - collections;
+	r.gc_pause_us = I->gc.total_pause_us - pause;
+} catch(const char* e) {
+	r.error = e;
+	r.ok = false;
+}
+	isolate_destroy(I);
+	return r;
+}
+
+static std::string json_string(const std::string& s)
+{
+	std::string out = "\"";
+	for(char c : s)
+	{
+		if( c == '"' || c == '\\' ) { out += '\\'; out += c; }
+		else if( c == '\n' ) out += "\\n";
+		else if( (unsigned char)c < 0x20 ) { char buf[8]; snprintf(buf, sizeof(buf), "\\u%04x", c); out += buf; }
+		else out += c;
+	}
+	return out + "\"";
+}
+
+static void write_json(FILE* f, const std::vector<result>& results, int runs)
+{
+	fprintf(f, "{\n  \"suite\": \"atlis\",\n  \"revision\": %s,\n  \"jit\": %s,\n  \"runs\": %d,\n  \"benchmarks\": [",
+		json_string(ATLIS_REVISION).c_str(), jit_enabled ? "true" : "false", runs);
+
+	for(size_t i = 0; i < results.size(); ++i)
+	{
+		const result& r = results[i];
+		std::vector<double> sorted = r.ms;
+		std::sort(sorted.begin(), sorted.end());
+		double total = 0;
+		for(double ms : sorted) total += ms;
+
+		fprintf(f, "%s\n    {\"name\": %s, \"ok\": %s, \"result\": %s",
+			i ? "," : "", json_string(r.name).c_str(), r.ok ? "true" : "false", json_string(r.value).c_str());
+		if( !r.error.empty() ) fprintf(f, ", \"error\": %s", json_string(r.error).c_str());
+		if( !sorted.empty() )
+		{
+			fprintf(f, ", \"min_ms\": %.3f, \"median_ms\": %.3f, \"mean_ms\": %.3f, \"max_ms\": %.3f",
+				sorted.front(), sorted[sorted.size()/2], total / sorted.size(), sorted.back());
+		}
+		fprintf(f, ", \"gc_collections\": %llu, \"gc_pause_us\": %llu, \"times_ms\": [",
+			(unsigned long long)r.collections, (unsigned long long)r.gc_pause_us);
+		for(size_t j = 0; j < r.ms.size(); ++j) fprintf(f, "%s%.3f", j ? ", " : "", r.ms[j]);
+		fprintf(f, "]}");
+	}
+	fprintf(f, "\n  ]\n}\n");
+	return;
+}
+
+static int usage()
+{
+	fprintf(stderr, "usage: atlis_bench [--dir suite-dir] [--runs n] [--json file] [--no-jit] [--trace file] [name...]\n");
+	return 2;
+}
+
+int main(int argc, char** argv)
+{
+	std::string dir = ATLIS_BENCH_DIR;
+	std::string json;
+	std::string trace;
+	int runs = 5;
+	std::vector<std::string> only;
+
+	for(int i = 1; i < argc; ++i)
+	{
+		if( !strcmp(argv[i], "--dir") && i+1 < argc )
+			dir = argv[++i];
+		else if( !strcmp(argv[i], "--runs") && i+1 < argc )
+			runs = atoi(argv[++i]);
+		else if( !strcmp(argv[i], "--json") && i+1 < argc )
+			json = argv[++i];
+		else if( !strcmp(argv[i], "--no-jit") )
+			jit_enabled = false;
+		else if( !strcmp(argv[i], "--trace") && i+1 < argc )
+			trace = argv[++i];
+		else if( argv[i][0] == '-' )
+			return usage();
+		else
+			only.push_back(argv[i]);
+	}
+
+	if( !trace.empty() ) trace_start({});
+
+	std::vector<result> results;
+	bool all_ok = true;
+	for(const benchmark& b : suite)
+	{
+		if( !only.empty() && std::find(only.begin(), only.end(), b.name) == only.end() ) continue;
+
+		result r = run_one(b, dir, runs);
+		std::vector<double> sorted = r.ms;
+		std::sort(sorted.begin(), sorted.end());
+		if( r.ok )
+			fprintf(stderr, "%-12s %10.2f ms median %10.2f ms min  %4llu gcs\n", b.name,
+				sorted.empty() ? 0.0 : sorted[sorted.size()/2], sorted.empty() ? 0.0 : sorted.front(), (unsigned long long)r.collections);
+		else
+			fprintf(stderr, "%-12s FAILED: %s\n", b.name, r.error.empty() ? ("got " + r.value).c_str() : r.error.c_str());
+		all_ok = all_ok && r.ok;
+		results.push_back(r);
+	}
+
+	if( !trace.empty() )
+	{
+		try {
+			trace_finish(trace.c_str());
+		} catch(const char* e) {
+			fprintf(stderr, "atlis_bench: %s\n", e);
+			return 1;
+		}
+	}
+
+	FILE* f = json.empty() ? stdout : fopen(json.c_str(), "w");
+	if( !f )
+	{
+		fprintf(stderr, "atlis_bench: can't write %s\n", json.c_str());
+		return 1;
+	}
+	write_json(f, results, runs);
+	if( f != stdout ) fclose(f);
+
+	return all_ok ? 0 : 1;
+}
@@ -0,0 +1,141 @@
+// Load generator for an echo server (bench/echo_server.lisp): opens a number
+// of loopback connections, keeps one message in flight on each, and reports
+// round trips per second and latency percentiles.
+//
+//   atlis < bench/echo_server.lisp &
+//   echo_bench [port] [connections] [seconds] [message-bytes]
+//
+// Thousands of connections need a raised fd limit (ulimit -n) on both ends.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+typedef std::chrono::steady_clock bench_clock;
+
+struct conn
+{
+	int fd;
+	size_t received; // bytes of the current echo seen so far
+	bench_clock::time_point sent;
+};
+
+static double us_since(bench_clock::time_point t)
+{
+	return std::chrono::duration<double, std::micro>(bench_clock::now() - t).count();
+}
+
+static bool send_all(int fd, const std::string& msg)
+{
+	size_t done = 0;
+	while( done < msg.size() )
+	{
+		ssize_t n = ::send(fd, msg.data()+done, msg.size()-done, MSG_NOSIGNAL);
+		if( n < 0 && errno == EINTR ) continue;
+		if( n <= 0 ) return false;
+		done += n;
+	}
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	int port = argc > 1 ? atoi(argv[1]) : 7070;
+	int nconn = argc > 2 ? atoi(argv[2]) : 100;
+	double seconds = argc > 3 ? atof(argv[3]) : 5;
+	size_t size = argc > 4 ? atol(argv[4]) : 64;
+
+	std::string msg(size, 'x');
+	std::vector<conn> conns(nconn);
+	int ep = epoll_create1(0);
+
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	for(int i = 0; i < nconn; ++i)
+	{
+		int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+		if( fd < 0 || ::connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0 )
+		{
+			fprintf(stderr, "connection %d: %s\n", i, strerror(errno));
+			return 1;
+		}
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		conns[i].fd = fd;
+
+		epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.u32 = i;
+		epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+	}
+
+	std::vector<double> latencies;
+	latencies.reserve(1<<20);
+	auto start = bench_clock::now();
+	for(conn& c : conns)
+	{
+		c.received = 0;
+		c.sent = bench_clock::now();
+		send_all(c.fd, msg);
+	}
+
+	char buf[65536];
+	epoll_event events[256];
+	while( us_since(start) < seconds * 1e6 )
+	{
+		int n = epoll_wait(ep, events, 256, 100);
+		for(int i = 0; i < n; ++i)
+		{
+			conn& c = conns[events[i].data.u32];
+			ssize_t got = ::recv(c.fd, buf, sizeof(buf), 0);
+			if( got <= 0 )
+			{
+				fprintf(stderr, "server closed a connection\n");
+				return 1;
+			}
+
+			c.received += got;
+			if( c.received < size ) continue;
+
+			latencies.push_back(us_since(c.sent));
+			c.received = 0;
+			c.sent = bench_clock::now();
+			send_all(c.fd, msg);
+		}
+	}
+	double elapsed = us_since(start) / 1e6;
+
+	for(conn& c : conns) ::close(c.fd);
+	::close(ep);
+
+	if( latencies.empty() )
+	{
+		fprintf(stderr, "no round trips completed\n");
+		return 1;
+	}
+
+	std::sort(latencies.begin(), latencies.end());
+	auto pct = [&](double p) { return latencies[std::min(latencies.size()-1, (size_t)(p * latencies.size()))]; };
+
+	printf("connections:  %d\n", nconn);
+	printf("message:      %zu bytes\n", size);
+	printf("round trips:  %zu in %.2f s\n", latencies.size(), elapsed);
+	printf("requests/s:   %.0f\n", latencies.size() / elapsed);
+	printf("latency us:   p50 %.0f  p90 %.0f  p99 %.0f  p99.9 %.0f  max %.0f\n",
+		pct(0.5), pct(0.9), pct(0.99), pct(0.999), latencies.back());
+	return 0;
+}
@@ -0,0 +1,20 @@
+; echo server for bench/echo_bench.cpp
+;   atlis < bench/echo_server.lisp
+; every connection echoes back whatever it receives, all of them multiplexed
+; by the event loop on one interpreter thread.
+
+(define echo
+  (lambda (conn)
+    ((lambda (data)
+       (if (null? data) (close conn) (socket-write conn data)))
+     (socket-read conn))))
+
+(define server (tcp-listen 7070))
+
+(on-readable server
+  (lambda (l)
+    ((lambda (conn)
+       (if (null? conn) () (on-readable conn echo)))
+     (socket-accept l))))
+
+(run-event-loop)
@@ -0,0 +1,21 @@
+; echo server for bench/echo_bench.cpp written with green threads
+;   atlis < bench/echo_server_green.lisp
+; each connection gets a green thread running straight-line code; reads and
+; writes that would block park it until the event loop sees its socket ready.
+
+(define serve
+  (lambda (conn)
+    ((lambda (data)
+       (while data
+         (socket-write conn data)
+         (set! data (socket-read conn)))
+       (close conn))
+     (socket-read conn))))
+
+(define accept-loop
+  (lambda (server)
+    (while T
+      (spawn serve (socket-accept server)))))
+
+(spawn accept-loop (tcp-listen 7070))
+(run-event-loop)
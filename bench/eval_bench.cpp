@@ -0,0 +1,156 @@
+// Load generator for atlis --serve: keeps a number of requests in flight on
+// each of several connections and reports requests per second and latency
+// percentiles.
+//
+//   atlis --serve /tmp/atlis.sock &
+//   eval_bench socket-path [connections] [pipeline-depth] [seconds] [expr]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <chrono>
+#include <deque>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+typedef std::chrono::steady_clock bench_clock;
+
+struct conn
+{
+	int fd;
+	std::string in;
+	std::deque<bench_clock::time_point> sent; // one per request in flight
+};
+
+static double us_since(bench_clock::time_point t)
+{
+	return std::chrono::duration<double, std::micro>(bench_clock::now() - t).count();
+}
+
+static void send_request(conn& c, const std::string& frame)
+{
+	c.sent.push_back(bench_clock::now());
+	size_t done = 0;
+	while( done < frame.size() )
+	{
+		ssize_t n = ::send(c.fd, frame.data()+done, frame.size()-done, MSG_NOSIGNAL);
+		if( n < 0 && errno == EINTR ) continue;
+		if( n <= 0 )
+		{
+			perror("send");
+			exit(1);
+		}
+		done += n;
+	}
+	return;
+}
+
+int main(int argc, char** argv)
+{
+	if( argc < 2 )
+	{
+		fprintf(stderr, "usage: eval_bench socket-path [connections] [pipeline-depth] [seconds] [expr]\n");
+		return 1;
+	}
+	int nconn = argc > 2 ? atoi(argv[2]) : 8;
+	int depth = argc > 3 ? atoi(argv[3]) : 4;
+	double seconds = argc > 4 ? atof(argv[4]) : 5;
+	std::string expr = argc > 5 ? argv[5] : "(+ 1 2)";
+
+	std::string frame;
+	uint32_t len = htonl(expr.size());
+	frame.append((const char*)&len, 4);
+	frame += expr;
+
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path)-1);
+
+	int ep = epoll_create1(0);
+	std::vector<conn> conns(nconn);
+	for(int i = 0; i < nconn; ++i)
+	{
+		conns[i].fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+		if( conns[i].fd < 0 || ::connect(conns[i].fd, (sockaddr*)&addr, sizeof(addr)) < 0 )
+		{
+			perror(argv[1]);
+			return 1;
+		}
+		epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.u32 = i;
+		epoll_ctl(ep, EPOLL_CTL_ADD, conns[i].fd, &ev);
+	}
+
+	std::vector<double> latencies;
+	latencies.reserve(1<<20);
+	size_t errors = 0;
+	auto start = bench_clock::now();
+	for(conn& c : conns)
+	{
+		for(int d = 0; d < depth; ++d) send_request(c, frame);
+	}
+
+	char buf[65536];
+	epoll_event events[64];
+	while( us_since(start) < seconds * 1e6 )
+	{
+		int n = epoll_wait(ep, events, 64, 100);
+		for(int i = 0; i < n; ++i)
+		{
+			conn& c = conns[events[i].data.u32];
+			ssize_t got = ::recv(c.fd, buf, sizeof(buf), 0);
+			if( got <= 0 )
+			{
+				fprintf(stderr, "server closed a connection\n");
+				return 1;
+			}
+			c.in.append(buf, got);
+
+			size_t pos = 0;
+			while( c.in.size() - pos >= 4 )
+			{
+				uint32_t l;
+				memcpy(&l, c.in.data()+pos, 4);
+				l = ntohl(l);
+				if( c.in.size() - pos - 4 < l ) break;
+				if( l == 0 || c.in[pos+4] != 'o' ) errors++;
+				pos += 4 + l;
+
+				latencies.push_back(us_since(c.sent.front()));
+				c.sent.pop_front();
+				send_request(c, frame);
+			}
+			c.in.erase(0, pos);
+		}
+	}
+	double elapsed = us_since(start) / 1e6;
+
+	for(conn& c : conns) ::close(c.fd);
+	::close(ep);
+
+	if( latencies.empty() )
+	{
+		fprintf(stderr, "no requests completed\n");
+		return 1;
+	}
+
+	std::sort(latencies.begin(), latencies.end());
+	auto pct = [&](double p) { return latencies[std::min(latencies.size()-1, (size_t)(p * latencies.size()))]; };
+
+	printf("connections:  %d, pipeline depth %d\n", nconn, depth);
+	printf("expr:         %s\n", expr.c_str());
+	printf("requests:     %zu in %.2f s, %zu errors\n", latencies.size(), elapsed, errors);
+	printf("requests/s:   %.0f\n", latencies.size() / elapsed);
+	printf("latency us:   p50 %.0f  p90 %.0f  p99 %.0f  p99.9 %.0f  max %.0f\n",
+		pct(0.5), pct(0.9), pct(0.99), pct(0.999), latencies.back());
+	return 0;
+}
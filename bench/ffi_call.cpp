@@ -0,0 +1,61 @@
+// Per-call overhead of a foreign function against a native builtin, both
+// called straight through funcall and from interpreted code.
+//
+//   ffi_call [calls]
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <string>
+#include "../types.h"
+#include "../funcs.h"
+#include "../isolate.h"
+
+static double ns_per_call(std::chrono::steady_clock::time_point start, long calls)
+{
+	return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / calls;
+}
+
+static double time_funcall(Isolate* I, const char* name, long calls)
+{
+	isolate_scope S(I);
+	lptr f = symbol_value(&I->first_fscope, intern_c(name));
+	auto start = std::chrono::steady_clock::now();
+	for(long i = 0; i < calls; ++i) funcall(f, {lptr((u64)-i)});
+	return ns_per_call(start, calls);
+}
+
+static double time_eval(Isolate* I, const char* name, long calls)
+{
+	// a list with one element per call to walk with while
+	isolate_eval(I, "(define bench-list ())");
+	{
+		isolate_scope S(I);
+		lptr l;
+		for(long i = 0; i < calls; ++i) l = lnew<cons>(lptr((u64)i), l);
+		for(auto& p : I->first_fscope.symbols)
+		{
+			if( p.first == intern_c("bench-list").sym() ) p.second = l;
+		}
+	}
+
+	std::string src = std::string("(define l bench-list) (while (pair? l) (") + name + " (car l)) (set! l (cdr l)))";
+	auto start = std::chrono::steady_clock::now();
+	isolate_eval(I, src);
+	return ns_per_call(start, calls);
+}
+
+int main(int argc, char** argv)
+{
+	long calls = argc > 1 ? atol(argv[1]) : 1000000;
+
+	Isolate* I = isolate_create();
+	isolate_eval(I, "(define c-labs (foreign-function \"\" \"labs\" 'long 'long))");
+
+	printf("funcall, native -:      %6.1f ns/call\n", time_funcall(I, "-", calls));
+	printf("funcall, foreign labs:  %6.1f ns/call\n", time_funcall(I, "c-labs", calls));
+	printf("eval, native -:         %6.1f ns/call\n", time_eval(I, "-", calls));
+	printf("eval, foreign labs:     %6.1f ns/call\n", time_eval(I, "c-labs", calls));
+
+	isolate_destroy(I);
+	return 0;
+}
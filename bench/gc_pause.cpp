@@ -0,0 +1,61 @@
+// Synthetic cons-heavy workload for the collector: keeps a large live set of
+// lists reachable from a global, churns garbage through it, and prints the
+// pause histogram.
+//
+//   gc_pause [heap-MB] [collections]
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include "../types.h"
+#include "../funcs.h"
+#include "../isolate.h"
+
+int main(int argc, char** argv)
+{
+	size_t mb = argc > 1 ? atol(argv[1]) : 256;
+	int rounds = argc > 2 ? atoi(argv[2]) : 8;
+
+	// roughly 40 bytes per cons once allocator and heap list overhead is counted
+	size_t conses = mb * (1<<20) / 40;
+	size_t list_len = 1000;
+
+	Isolate* I = isolate_create();
+	{
+		isolate_scope S(I);
+		fscope& top = I->first_fscope;
+		top.symbols.push_back(std::make_pair(intern_c("bench-live").sym(), lptr()));
+
+		// live set: a list of lists, about half the heap
+		lptr live;
+		for(size_t i = 0; i < conses/2/list_len; ++i)
+		{
+			lptr l;
+			for(size_t j = 0; j < list_len; ++j) l = lnew<cons>(lptr((u64)j), l);
+			live = lnew<cons>(l, live);
+		}
+		top.symbols.back().second = live;
+	}
+
+	for(int r = 0; r < rounds; ++r)
+	{
+		{
+			// garbage: the other half, dropped straight away
+			isolate_scope S(I);
+			for(size_t i = 0; i < conses/2; ++i) lnew<cons>(lptr((u64)i), lptr());
+		}
+		isolate_eval(I, "(gc)");
+		isolate_eval(I, "nil"); // safepoint
+	}
+
+	gc_state& G = I->gc;
+	printf("heap %zu MB, %zu objects, %d workers\n", mb, I->heap.size(), pool_size(I));
+	printf("collections %llu, total pause %llu us, max pause %llu us\n",
+		(unsigned long long)G.collections, (unsigned long long)G.total_pause_us, (unsigned long long)G.max_pause_us);
+	for(int i = 0; i < 32; ++i)
+	{
+		if( G.pause_hist[i] ) printf("  %8llu-%llu us: %llu\n", 1ull<<i, (2ull<<i)-1, (unsigned long long)G.pause_hist[i]);
+	}
+
+	isolate_destroy(I);
+	return 0;
+}
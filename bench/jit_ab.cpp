@@ -0,0 +1,73 @@
+// A/B comparison of the interpreter with the JIT off and on, over fixnum
+// heavy functions. Each side gets a fresh isolate, so the JIT side pays for
+// warming up and compiling like any script would. Both results are printed
+// and must match.
+//
+//   jit_ab [repeats]
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <string>
+#include <algorithm>
+#include "../types.h"
+#include "../funcs.h"
+#include "../isolate.h"
+
+struct ab_case
+{
+	const char* name;
+	const char* defs;
+	const char* expr;
+};
+
+static const ab_case cases[] = {
+	{ "fib 25",
+	  "(define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))",
+	  "(fib 25)" },
+	{ "tak 18 12 6",
+	  "(define tak (lambda (x y z) (if (< y x) (tak (tak (- x 1) y z) (tak (- y 1) z x) (tak (- z 1) x y)) z)))",
+	  "(tak 18 12 6)" },
+	{ "ack 3 6",
+	  "(define ack (lambda (m n) (if (= m 0) (+ n 1) (if (= n 0) (ack (- m 1) 1) (ack (- m 1) (ack m (- n 1)))))))",
+	  "(ack 3 6)" },
+	{ "poly calls",
+	  "(define sq (lambda (x) (* x x)))"
+	  "(define poly (lambda (x) (+ (* 3 (sq x)) (* -2 x) 7)))"
+	  "(define sum-poly (lambda (i n acc) (if (< i n) (sum-poly (+ i 1) n (+ acc (poly i))) acc)))",
+	  "(sum-poly 0 2000 0)" },
+};
+
+static double run(const ab_case& c, bool jit, int repeats, std::string& result)
+{
+	jit_enabled = jit;
+	Isolate* I = isolate_create();
+	isolate_eval(I, c.defs);
+
+	double best = 1e30;
+	for(int r = 0; r < repeats; ++r)
+	{
+		auto start = std::chrono::steady_clock::now();
+		result = isolate_eval_string(I, c.expr);
+		best = std::min(best, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+	}
+
+	isolate_destroy(I);
+	return best;
+}
+
+int main(int argc, char** argv)
+{
+	int repeats = argc > 1 ? atoi(argv[1]) : 5;
+	int failed = 0;
+
+	printf("%-14s %12s %12s %9s  %s\n", "benchmark", "interp ms", "jit ms", "speedup", "result");
+	for(const ab_case& c : cases)
+	{
+		std::string a, b;
+		double off = run(c, false, repeats, a);
+		double on = run(c, true, repeats, b);
+		printf("%-14s %12.2f %12.2f %8.1fx  %s%s\n", c.name, off, on, off / on, b.c_str(), a == b ? "" : "  MISMATCH");
+		if( a != b ) failed = 1;
+	}
+	return failed;
+}
@@ -0,0 +1,101 @@
+// The native list library over long lists, and for some of it the same
+// operation written in Lisp (with while, since recursion wouldn't get through
+// a long list) for comparison. Times are per element.
+//
+//   list_ops [elements] [lisp-elements]
+//
+// Defaults are 10M elements for the builtins and 1M for the Lisp versions,
+// which are slow enough that 10M makes a long wait.
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <string>
+#include "../types.h"
+#include "../funcs.h"
+#include "../isolate.h"
+
+static const char* lisp_defs =
+	"(define lisp-length (lambda (l n) (while (pair? l) (set! n (+ n 1)) (set! l (cdr l))) n))"
+	"(define lisp-reverse (lambda (l acc) (while (pair? l) (set! acc (cons (car l) acc)) (set! l (cdr l))) acc))"
+	"(define lisp-map (lambda (f l acc) (while (pair? l) (set! acc (cons (f (car l)) acc)) (set! l (cdr l))) (lisp-reverse acc nil)))"
+	"(define lisp-filter (lambda (f l acc) (while (pair? l) (if (f (car l)) (set! acc (cons (car l) acc))) (set! l (cdr l))) (lisp-reverse acc nil)))"
+	"(define lisp-fold (lambda (f acc l) (while (pair? l) (set! acc (f (car l) acc)) (set! l (cdr l))) acc))"
+	"(define inc (lambda (x) (+ x 1)))"
+	"(define small? (lambda (x) (< x 1000)))";
+
+static void bind(Isolate* I, const char* name, lptr v)
+{
+	for(auto& p : I->first_fscope.symbols)
+	{
+		if( p.first == intern_c(name).sym() ) p.second = v;
+	}
+	return;
+}
+
+// 0..n-1 in order, and the same numbers shuffled for sorting. the names are
+// defined first, evaluating may collect and the lists are only bound at the end
+static void make_lists(Isolate* I, long n, const char* seq, const char* rnd)
+{
+	isolate_eval(I, std::string("(define ") + seq + " ()) (define " + rnd + " ())");
+	isolate_scope S(I);
+	lptr a, b;
+	u64 x = 88172645463325252ull;
+	for(long i = n; i > 0; --i)
+	{
+		a = lnew<cons>(lptr((u64)(i-1)), a);
+		x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+		b = lnew<cons>(lptr((u64)(x % n)), b);
+	}
+	bind(I, seq, a);
+	bind(I, rnd, b);
+	return;
+}
+
+static void run(Isolate* I, const char* what, const char* src, long n)
+{
+	auto start = std::chrono::steady_clock::now();
+	std::string res = isolate_eval_string(I, src);
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	if( res.size() > 24 ) res = res.substr(0, 21) + "...";
+	printf("%-34s %9.1f ms %8.1f ns/elt  %s\n", what, ms, ms * 1e6 / n, res.c_str());
+	return;
+}
+
+int main(int argc, char** argv)
+{
+	long n = argc > 1 ? atol(argv[1]) : 10000000;
+	long ln = argc > 2 ? atol(argv[2]) : 1000000;
+
+	Isolate* I = isolate_create();
+	isolate_eval(I, lisp_defs);
+	make_lists(I, n, "big", "big-rnd");
+	printf("%ld elements\n", n);
+
+	run(I, "length", "(length big)", n);
+	run(I, "list-tail", "(car (list-tail big (- (length big) 1)))", n);
+	run(I, "memq (miss)", "(memq -1 big)", n);
+	run(I, "reverse", "(car (reverse big))", n);
+	run(I, "reverse! (twice)", "(car (set! big (reverse! (reverse! big))))", 2*n);
+	run(I, "append (copies the first)", "(car (append big (list 1)))", n);
+	run(I, "map builtin -", "(car (map - big))", n);
+	run(I, "map lambda", "(car (map inc big))", n);
+	run(I, "filter lambda", "(length (filter small? big))", n);
+	run(I, "fold +", "(fold + 0 big)", n);
+	run(I, "sort < (shuffled)", "(car (sort big-rnd <))", n);
+	run(I, "sort < (already sorted)", "(car (sort big <))", n);
+	run(I, "sort lambda (shuffled)", "(car (sort big-rnd (lambda (a b) (< a b))))", n);
+	isolate_destroy(I);
+
+	I = isolate_create();
+	isolate_eval(I, lisp_defs);
+	make_lists(I, ln, "big", "big-rnd");
+	printf("\n%ld elements, written in Lisp\n", ln);
+
+	run(I, "lisp-length", "(lisp-length big 0)", ln);
+	run(I, "lisp-reverse", "(car (lisp-reverse big nil))", ln);
+	run(I, "lisp-map lambda", "(car (lisp-map inc big nil))", ln);
+	run(I, "lisp-filter lambda", "(length (lisp-filter small? big nil))", ln);
+	run(I, "lisp-fold +", "(lisp-fold + 0 big)", ln);
+	isolate_destroy(I);
+	return 0;
+}
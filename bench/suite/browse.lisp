@@ -0,0 +1,60 @@
+; after Gabriel's browse: a database of random nested lists searched with
+; patterns, where ? matches any one element and * any run of them. The
+; variable bindings of the original are left out, they need string and
+; character builtins we don't have
+(define seed 0)
+
+; a small linear congruential generator, 0..250
+(define rand (lambda (x)
+	(set! x (* seed 17))
+	(set! seed (+ 1 (- x (* (/ x 251) 251))))
+	seed))
+
+(define atoms '(a b c d e f g h i j))
+
+(define pick (lambda (n) (list-ref atoms (- n (* (/ n 10) 10)))))
+
+(define make-items (lambda (depth n l)
+	(while (< 0 n)
+		(set! l (cons (make-item depth) l))
+		(set! n (- n 1)))
+	l))
+
+(define make-item (lambda (depth)
+	(if (< depth 1)
+		(pick (rand))
+		(if (< (rand) 170)
+			(pick (rand))
+			(make-items (- depth 1) (+ 2 (/ (rand) 64)) nil)))))
+
+(define match (lambda (pat dat)
+	(if (null? pat)
+		(null? dat)
+		(if (null? dat)
+			nil
+			(if (eq? (car pat) '*)
+				(if (match (cdr pat) dat)
+					T
+					(if (match (cdr pat) (cdr dat))
+						T
+						(match pat (cdr dat))))
+				(if (if (eq? (car pat) '?) T (eq? (car pat) (car dat)))
+					(match (cdr pat) (cdr dat))
+					(if (pair? (car pat))
+						(if (pair? (car dat))
+							(if (match (car pat) (car dat)) (match (cdr pat) (cdr dat)) nil)
+							nil)
+						nil)))))))
+
+(define patterns '((* a ?) (? ? * b *) (* (a *) *) (c * d) (* * e f *) ((? *) * (* j)) (* g * h * i *)))
+
+(define count-matches (lambda (db pats n)
+	(while (pair? pats)
+		(set! n (+ n (length (filter (lambda (d) (match (car pats) d)) db))))
+		(set! pats (cdr pats)))
+	n))
+
+(define run (lambda (db)
+	(set! seed 21)
+	(set! db (make-items 3 300 nil))
+	(count-matches db patterns 0)))
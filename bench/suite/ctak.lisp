@@ -0,0 +1,16 @@
+; tak returning through escape procedures instead of normally, every call
+; sets up a call/ec and leaves it by escaping. The original uses call/cc, the
+; continuations are only ever used to escape so call/ec does the same
+(define ctak (lambda (x y z)
+	(call/ec (lambda (k) (ctak-aux k x y z)))))
+
+(define ctak-aux (lambda (k x y z)
+	(if (< y x)
+		(call/ec (lambda (k)
+			(ctak-aux k
+				(call/ec (lambda (k) (ctak-aux k (- x 1) y z)))
+				(call/ec (lambda (k) (ctak-aux k (- y 1) z x)))
+				(call/ec (lambda (k) (ctak-aux k (- z 1) x y))))))
+		(k z))))
+
+(define run (lambda () (ctak 18 12 6)))
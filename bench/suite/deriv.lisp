@@ -0,0 +1,25 @@
+; symbolic differentiation of a polynomial, a lot of consing of short lists
+; and dispatching on symbols
+(define deriv (lambda (a)
+	(if (pair? a)
+		(if (eq? (car a) '+)
+			(cons '+ (map deriv (cdr a)))
+			(if (eq? (car a) '-)
+				(cons '- (map deriv (cdr a)))
+				(if (eq? (car a) '*)
+					(list '* a (cons '+ (map deriv-aux (cdr a))))
+					(if (eq? (car a) '/)
+						(list '-
+							(list '/ (deriv (car (cdr a))) (car (cdr (cdr a))))
+							(list '/ (car (cdr a)) (list '* (car (cdr (cdr a))) (car (cdr (cdr a))) (deriv (car (cdr (cdr a)))))))
+						(error "deriv: no method for" (car a))))))
+		(if (eq? a 'x) 1 0))))
+
+(define deriv-aux (lambda (a) (list '/ (deriv a) a)))
+
+(define run (lambda (i r)
+	(set! i 2000)
+	(while (< 0 i)
+		(set! r (deriv '(+ (* 3 x x) (* a x x) (* b x) 5)))
+		(set! i (- i 1)))
+	r))
@@ -0,0 +1,50 @@
+; Gabriel's destructive: cuts lists in half and splices the halves onto
+; their neighbours with set-car! and set-cdr!, refilling them when they
+; run out
+(define make-nils (lambda (n l)
+	(while (< 0 n) (set! l (cons nil l)) (set! n (- n 1)))
+	l))
+
+(define last-pair (lambda (l)
+	(while (pair? (cdr l)) (set! l (cdr l)))
+	l))
+
+(define append! (lambda (x y)
+	(if (null? x) y (begin (set-cdr! (last-pair x) y) x))))
+
+(define refill (lambda (l m)
+	(while (pair? l)
+		(if (null? (car l)) (set-car! l (cons nil nil)))
+		(append! (car l) (make-nils m nil))
+		(set! l (cdr l)))))
+
+; marks the first j cells of a with i, gives the one after them
+(define mark-half (lambda (a i j)
+	(while (< 0 j) (set-car! a i) (set! a (cdr a)) (set! j (- j 1)))
+	a))
+
+; marks the first j cells of l1's list with i and cuts it off after them,
+; gives what was cut off
+(define cut-half (lambda (l1 i j a)
+	(if (= j 0)
+		(begin (set-car! l1 nil) nil)
+		(begin
+			(while (< 1 j) (set-car! a i) (set! a (cdr a)) (set! j (- j 1)))
+			(set! j (cdr a))
+			(set-cdr! a nil)
+			j))))
+
+(define splice (lambda (i l1 l2)
+	(while (pair? l2)
+		(set-cdr! (mark-half (car l2) i (/ (length (car l2)) 2))
+			(cut-half l1 i (/ (length (car l1)) 2) (car l1)))
+		(set! l1 (cdr l1))
+		(set! l2 (cdr l2)))))
+
+(define destructive (lambda (n m l)
+	(while (< 0 n)
+		(if (null? (car l)) (refill l m) (splice n l (cdr l)))
+		(set! n (- n 1)))
+	l))
+
+(define run (lambda () (map length (destructive 600 50 (make-nils 10 nil)))))
@@ -0,0 +1,7 @@
+; doubly recursive fibonacci, 635621 calls
+(define fib (lambda (n)
+	(if (< n 2)
+		n
+		(+ (fib (- n 1)) (fib (- n 2))))))
+
+(define run (lambda () (fib 27)))
@@ -0,0 +1,23 @@
+; counts the ways to place n queens, trying each remaining row in turn
+(define iota1 (lambda (n l)
+	(while (< 0 n) (set! l (cons n l)) (set! n (- n 1)))
+	l))
+
+(define ok? (lambda (row dist placed)
+	(if (null? placed)
+		T
+		(if (= (car placed) (+ row dist))
+			nil
+			(if (= (car placed) (- row dist))
+				nil
+				(ok? row (+ dist 1) (cdr placed)))))))
+
+(define try-queens (lambda (x y z)
+	(if (null? x)
+		(if (null? y) 1 0)
+		(+ (if (ok? (car x) 1 z) (try-queens (append (cdr x) y) nil (cons (car x) z)) 0)
+		   (try-queens (cdr x) (cons (car x) y) z)))))
+
+(define queens (lambda (n) (try-queens (iota1 n nil) nil nil)))
+
+(define run (lambda () (queens 8)))
@@ -0,0 +1,22 @@
+; reader and printer throughput: writes a tree of numbers, symbols, strings
+; and characters to a string port and reads it back, a few hundred KB each
+; way. bench-port is a fresh string port for every run
+(define make-tree (lambda (depth n l)
+	(while (< 0 n)
+		(set! l (cons (if (< depth 1) (make-leaf n) (make-tree (- depth 1) 6 nil)) l))
+		(set! n (- n 1)))
+	l))
+
+(define leaves (list 12345 -678 2.5 'symbol 'another-symbol "a string" #\c '(quoted . pair)))
+
+(define make-leaf (lambda (n) (list-ref leaves (- n 1))))
+
+(define tree (make-tree 5 6 nil))
+
+(define run (lambda (n back)
+	(set! n 4)
+	(while (< 0 n)
+		(write tree bench-port)
+		(set! back (read bench-port))
+		(set! n (- n 1)))
+	(equal? back tree)))
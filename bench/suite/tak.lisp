@@ -0,0 +1,8 @@
+; Takeuchi's function, (tak 22 16 8) is 905685 calls doing nothing but
+; fixnum compares and subtraction
+(define tak (lambda (x y z)
+	(if (< y x)
+		(tak (tak (- x 1) y z) (tak (- y 1) z x) (tak (- z 1) x y))
+		z)))
+
+(define run (lambda () (tak 22 16 8)))
@@ -0,0 +1,205 @@
+#include <string>
+#include <cstring>
+#include "types.h"
+#include "funcs.h"
+#include "isolate.h"
+
+// Bytevectors: raw memory C code can work on in place.
+//
+// (make-bytes n [fill]) allocates n bytes. (bytes-ref b i [type]) and
+// (bytes-set! b i v [type]) read and write element i, where type is one of
+//   u8 s8 u16 s16 u32 s32 s64 f32 f64
+// (u8 if left out) and i counts elements of that type, so the same bytes can
+// be used as an array of any of them.
+//
+// A bytevector passed for a pointer argument of a foreign function hands C
+// its data pointer, no copy. The collector never moves anything, so that
+// pointer is good for the bytevector's whole life; if C keeps it past the
+// call, (bytes-pin b) sets LGC_NO_FREE so the memory stays around even after
+// Lisp drops b, until (bytes-unpin b).
+//
+// (bytes-wrap address length [finalizer]) makes a bytevector over memory that
+// was allocated elsewhere, eg. by mmap. finalizer is the address of a C
+// function (see foreign-symbol) called as f(address, length) when the
+// bytevector is collected, which suits munmap as it is.
+
+extern lptr global_T;
+
+enum bytes_elem { ELEM_U8, ELEM_S8, ELEM_U16, ELEM_S16, ELEM_U32, ELEM_S32, ELEM_S64, ELEM_F32, ELEM_F64 };
+
+static const size_t elem_size[] = { 1, 1, 2, 2, 4, 4, 8, 4, 8 };
+
+static int bytes_elem_type(const MultiArg& args, size_t i)
+{
+	if( args.size() <= i || args[i].nilp() ) return ELEM_U8;
+	if( args[i].type() != LTYPE_SYM ) throw "bytes: element type must be a symbol";
+
+	std::string_view n = args[i].sym()->str();
+	if( n == "U8" ) return ELEM_U8;
+	if( n == "S8" ) return ELEM_S8;
+	if( n == "U16" ) return ELEM_U16;
+	if( n == "S16" ) return ELEM_S16;
+	if( n == "U32" ) return ELEM_U32;
+	if( n == "S32" ) return ELEM_S32;
+	if( n == "S64" ) return ELEM_S64;
+	if( n == "F32" ) return ELEM_F32;
+	if( n == "F64" ) return ELEM_F64;
+	throw "bytes: unknown element type";
+}
+
+// address of element i of the given type, after checking it lies inside b
+static u8* bytes_elem(lptr b, lptr i, int type)
+{
+	if( b.type() != LTYPE_BYTES ) throw "bytes: not a bytevector";
+	if( i.type() != LTYPE_INT ) throw "bytes: index must be an integer";
+
+	lbytes* B = b.bytes();
+	u64 off = i.as_int() * elem_size[type];
+	if( (s64) i.as_int() < 0 || off + elem_size[type] > B->len ) throw "bytes: index out of range";
+	return B->data + off;
+}
+
+template<typename T>
+static T load(const u8* p)
+{
+	T v;
+	memcpy(&v, p, sizeof(T));
+	return v;
+}
+
+template<typename T>
+static void store(u8* p, T v)
+{
+	memcpy(p, &v, sizeof(T));
+	return;
+}
+
+lptr bytes_wrap(u8* data, size_t len, bytes_finalizer* fin, void* ctx)
+{
+	return lnew<lbytes>(data, len, fin, ctx);
+}
+
+lptr make_bytes(const MultiArg& args)
+{
+	if( args.size() == 0 || args[0].type() != LTYPE_INT || (s64) args[0].as_int() < 0 ) return lptr();
+
+	lbytes* B = lnew<lbytes>(args[0].as_int());
+	if( args.size() > 1 && args[1].type() == LTYPE_INT ) memset(B->data, (int) args[1].as_int(), B->len);
+	return B;
+}
+
+lptr bytes_length(lptr b)
+{
+	if( b.type() != LTYPE_BYTES ) return lptr();
+	return (u64) b.bytes()->len;
+}
+
+lptr bytes_ref(const MultiArg& args)
+{
+	if( args.size() < 2 ) return lptr();
+
+	int type = bytes_elem_type(args, 2);
+	const u8* p = bytes_elem(args[0], args[1], type);
+
+	switch( type )
+	{
+	case ELEM_U8: return (u64) *p;
+	case ELEM_S8: return (u64)(s64)(s8) *p;
+	case ELEM_U16: return (u64) load<u16>(p);
+	case ELEM_S16: return (u64)(s64) load<s16>(p);
+	case ELEM_U32: return (u64) load<u32>(p);
+	case ELEM_S32: return (u64)(s64) load<s32>(p);
+	case ELEM_S64: return (u64) load<s64>(p);
+	case ELEM_F32: return load<float>(p);
+	case ELEM_F64: return (float) load<double>(p);
+	}
+	return lptr();
+}
+
+// (bytes-set! b i v [type])
+lptr bytes_set(const MultiArg& args)
+{
+	if( args.size() < 3 ) return lptr();
+
+	int type = bytes_elem_type(args, 3);
+	u8* p = bytes_elem(args[0], args[1], type);
+	lptr v = args[2];
+
+	if( type == ELEM_F32 || type == ELEM_F64 )
+	{
+		double d;
+		if( v.type() == LTYPE_FLOAT ) d = v.as_float();
+		else if( v.type() == LTYPE_INT ) d = (double)(s64) v.as_int();
+		else throw "bytes-set!: value must be a number";
+
+		if( type == ELEM_F32 ) store<float>(p, d); else store<double>(p, d);
+		return v;
+	}
+
+	s64 n;
+	if( v.type() == LTYPE_INT ) n = (s64) v.as_int();
+	else if( v.type() == LTYPE_CHAR ) n = (u8) v.as_char();
+	else throw "bytes-set!: value must be an integer";
+
+	switch( type )
+	{
+	case ELEM_U8: case ELEM_S8: *p = (u8) n; break;
+	case ELEM_U16: case ELEM_S16: store<u16>(p, n); break;
+	case ELEM_U32: case ELEM_S32: store<u32>(p, n); break;
+	case ELEM_S64: store<s64>(p, n); break;
+	}
+	return v;
+}
+
+lptr bytes_pointer(lptr b)
+{
+	if( b.type() != LTYPE_BYTES ) return lptr();
+	return (u64) b.bytes()->data;
+}
+
+lptr bytes_pin(lptr b)
+{
+	if( b.type() != LTYPE_BYTES ) return lptr();
+	b.bytes()->type |= LGC_NO_FREE;
+	return b;
+}
+
+lptr bytes_unpin(lptr b)
+{
+	if( b.type() != LTYPE_BYTES ) return lptr();
+	b.bytes()->type &= ~LGC_NO_FREE;
+	return b;
+}
+
+extern "C" typedef void wrap_finalizer_fn(void* data, size_t len);
+
+static void call_wrap_finalizer(u8* data, size_t len, void* fn)
+{
+	((wrap_finalizer_fn*) fn)(data, len);
+	return;
+}
+
+// (bytes-wrap address length [finalizer])
+lptr lbytes_wrap(const MultiArg& args)
+{
+	if( args.size() < 2 || args[0].type() != LTYPE_INT || args[1].type() != LTYPE_INT ) return lptr();
+
+	void* fin = args.size() > 2 && args[2].type() == LTYPE_INT ? (void*) args[2].as_int() : nullptr;
+	return bytes_wrap((u8*) args[0].as_int(), args[1].as_int(), fin ? &call_wrap_finalizer : nullptr, fin);
+}
+
+lptr string_to_bytes(lptr s)
+{
+	if( s.type() != LTYPE_STR ) return lptr();
+
+	std::string_view txt = s.string()->str();
+	lbytes* B = lnew<lbytes>(txt.size());
+	memcpy(B->data, txt.data(), txt.size());
+	return B;
+}
+
+lptr bytes_to_string(lptr b)
+{
+	if( b.type() != LTYPE_BYTES ) return lptr();
+	return lnew<lstr>(std::string((const char*) b.bytes()->data, b.bytes()->len));
+}
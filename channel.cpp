@@ -0,0 +1,282 @@
+#include <vector>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <new>
+#include <atomic>
+#include <cstring>
+#include "types.h"
+#include "funcs.h"
+#include "isolate.h"
+
+// Channels carry values between isolates.
+//
+// Deeply immutable data lives in the frozen region, which is shared by every
+// isolate and never collected: (freeze x) copies x there once, and from then
+// on sending it just passes the pointer. Anything else is deep copied by the
+// sender in a single pass into a message that owns the copies, and the
+// receiver adopts those objects into its own heap. Symbols are shared by all
+// isolates anyway, so they're never copied.
+
+struct message
+{
+	lptr root;
+	std::vector<lobj*> objects; // copies the receiver takes ownership of
+};
+
+struct channel
+{
+	channel() : refs(0) {}
+	~channel()
+	{
+		for(message& M : queue)
+		{
+			for(lobj* o : M.objects) lobj_free(o);
+		}
+	}
+
+	std::atomic<int> refs;
+	std::mutex lock;
+	std::condition_variable ready;
+	std::deque<message> queue;
+};
+
+lchannel::lchannel(channel* c) : type(LTYPE_CHANNEL), ch(c)
+{
+	ch->refs++;
+}
+
+lchannel::~lchannel()
+{
+	if( --ch->refs == 0 ) delete ch;
+}
+
+extern lptr global_T;
+
+// named channels are found by every isolate through this registry, which keeps
+// them alive for good
+static std::mutex channels_lock;
+static std::unordered_map<std::string, channel*> channels_by_name;
+
+// the frozen region is a bump allocator; nothing in it is ever freed
+static std::mutex frozen_lock;
+static char* frozen_cur = nullptr;
+static char* frozen_end = nullptr;
+const size_t FROZEN_CHUNK = 1<<20;
+
+static void* frozen_alloc(size_t sz)
+{
+	sz = (sz + 15) & ~15;
+	std::lock_guard<std::mutex> guard(frozen_lock);
+	if( frozen_cur + sz > frozen_end )
+	{
+		size_t n = std::max(sz, FROZEN_CHUNK);
+		frozen_cur = (char*) ::operator new(n, std::align_val_t(16));
+		frozen_end = frozen_cur + n;
+	}
+	void* p = frozen_cur;
+	frozen_cur += sz;
+	return p;
+}
+
+static bool frozen_c(lptr p)
+{
+	switch( p.val & 7 )
+	{
+	case LTYPE_CONS:
+	case LTYPE_FUNC:
+		return ((lobj*)(p.val&~7))->type & LGC_FROZEN;
+	case LTYPE_OBJ:
+		return p.nilp() || (((lobj*)(p.val&~7))->type & LGC_FROZEN);
+	}
+	return true; // immediates and symbols
+}
+
+// Copies the graph under root in one pass: each object is copied the first
+// time it's reached and its fields are patched from a worklist afterwards, so
+// shared structure and cycles come out the same shape. 'freezing' copies into
+// the frozen region instead of a message.
+class graph_copier
+{
+public:
+	graph_copier(bool f, std::vector<lobj*>* o) : freezing(f), objects(o) {}
+
+	lptr copy(lptr root)
+	{
+		lptr res = visit(root);
+		while( !work.empty() )
+		{
+			lobj* o = work.back();
+			work.pop_back();
+			if( (o->type & ~LOBJ_FLAGS) == LTYPE_CONS )
+			{
+				cons* c = (cons*)o;
+				c->a = visit(c->a);
+				c->b = visit(c->b);
+			} else if( (o->type & ~LOBJ_FLAGS) == LTYPE_RECORD ) {
+				lrecord* R = (lrecord*)o;
+				R->rtd = visit(R->rtd);
+				for(u32 i = 0; i < R->n; ++i) R->slots[i] = visit(R->slots[i]);
+			}
+		}
+		return res;
+	}
+
+private:
+	template<typename T, typename... Args>
+	T* make(Args&&... args)
+	{
+		T* o;
+		if( freezing )
+		{
+			o = new(frozen_alloc(sizeof(T))) T(std::forward<Args>(args)...);
+			o->type |= LGC_FROZEN;
+		} else {
+			o = new T(std::forward<Args>(args)...);
+			objects->push_back((lobj*)o);
+		}
+		return o;
+	}
+
+	// for objects with their contents inline, like records
+	template<typename T, typename... Args>
+	T* make_sized(size_t sz, Args&&... args)
+	{
+		T* o = new(freezing ? frozen_alloc(sz) : ::operator new(sz)) T(std::forward<Args>(args)...);
+		if( freezing )
+			o->type |= LGC_FROZEN;
+		else
+			objects->push_back((lobj*)o);
+		return o;
+	}
+
+	lptr visit(lptr p)
+	{
+		if( frozen_c(p) ) return p;
+
+		lobj* o = (lobj*)(p.val&~7);
+		auto iter = copied.find(o);
+		if( iter != copied.end() ) return iter->second;
+
+		lptr res;
+		switch( p.type() )
+		{
+		case LTYPE_CONS:
+			{
+				// fields still point into the original until the worklist gets to it
+				cons* c = make<cons>(p.as_cons()->a, p.as_cons()->b);
+				work.push_back((lobj*)c);
+				res = c;
+				break;
+			}
+		case LTYPE_STR:
+			res = make<lstr>(p.string()->str());
+			break;
+		case LTYPE_RECORD:
+			{
+				// the type is frozen, so the copy is of the same type
+				lrecord* from = p.record();
+				lrecord* R = make_sized<lrecord>(lrecord::size(from->n), from->rtd, from->n);
+				for(u32 i = 0; i < from->n; ++i) R->slots[i] = from->slots[i];
+				work.push_back((lobj*)R);
+				res = R;
+				break;
+			}
+		case LTYPE_BYTES:
+			{
+				// bytevectors are mutable, and wrapped memory can't be shared
+				if( freezing ) throw "freeze: bytevectors can't be frozen";
+				lbytes* B = make<lbytes>(p.bytes()->len);
+				memcpy(B->data, p.bytes()->data, B->len);
+				res = B;
+				break;
+			}
+		case LTYPE_CHANNEL:
+			if( freezing ) throw "freeze: channels can't be frozen";
+			res = make<lchannel>(p.channel()->ch);
+			break;
+		default:
+			throw freezing ? "freeze: object can't be frozen" : "channel-send: object can't be sent";
+		}
+
+		copied[o] = res;
+		return res;
+	}
+
+	bool freezing;
+	std::vector<lobj*>* objects;
+	std::vector<lobj*> work;
+	std::unordered_map<lobj*, lptr> copied;
+};
+
+lptr freeze(lptr obj)
+{
+	if( frozen_c(obj) ) return obj;
+	return graph_copier(true, nullptr).copy(obj);
+}
+
+lptr frozenp(lptr obj)
+{
+	return frozen_c(obj) ? global_T : lptr();
+}
+
+// (make-channel) makes a fresh channel; (make-channel "name") finds or makes
+// the channel of that name, which any isolate can open
+lptr make_channel(const MultiArg& args)
+{
+	if( args.size() == 0 || args[0].type() != LTYPE_STR )
+	{
+		return lnew<lchannel>(new channel);
+	}
+
+	std::lock_guard<std::mutex> guard(channels_lock);
+	channel*& ch = channels_by_name[args[0].string()->text()];
+	if( !ch )
+	{
+		ch = new channel;
+		ch->refs++;
+	}
+	return lnew<lchannel>(ch);
+}
+
+lptr channel_send(const MultiArg& args)
+{
+	if( args.size() < 2 || args[0].type() != LTYPE_CHANNEL ) return lptr();
+
+	message M;
+	if( frozen_c(args[1]) )
+		M.root = args[1];
+	else
+		M.root = graph_copier(false, &M.objects).copy(args[1]);
+
+	channel* ch = args[0].channel()->ch;
+	{
+		std::lock_guard<std::mutex> guard(ch->lock);
+		ch->queue.push_back(std::move(M));
+	}
+	ch->ready.notify_one();
+	return args[1];
+}
+
+lptr channel_receive(lptr port)
+{
+	if( port.type() != LTYPE_CHANNEL ) return lptr();
+
+	channel* ch = port.channel()->ch;
+	message M;
+	{
+		std::unique_lock<std::mutex> lk(ch->lock);
+		if( ch->queue.empty() )
+		{
+			trace_span span(TRACE_WAIT, "channel-wait");
+			ch->ready.wait(lk, [&]() { return !ch->queue.empty(); });
+		}
+		M = std::move(ch->queue.front());
+		ch->queue.pop_front();
+	}
+
+	for(lobj* o : M.objects) heap_track(o);
+	return M.root;
+}
@@ -0,0 +1,198 @@
+#include <string>
+#include <sstream>
+#include "types.h"
+#include "funcs.h"
+#include "isolate.h"
+
+// Non-local exits:
+//   (return v)                    leaves the innermost function being run
+//   (catch tag body...)           (throw tag v) ends the innermost catch for tag
+//                                 as eq, with v as its value
+//   (block name body...)          (return-from name v) ends the innermost block
+//                                 with that name; name isn't evaluated
+//   (call/ec f)                   calls f with an escape procedure k; (k v) ends
+//                                 the call/ec with v, for as long as it runs
+//   (guard (var handler...) body...)
+//                                 if body raises, handler runs with var bound to
+//                                 what was raised, and its value is the guard's
+//
+// (error msg irritants...) raises an error object, a list that starts with the
+// symbol error-object; (raise obj) raises anything. A builtin's error is raised
+// as an error object with its message.
+//
+// They're all C++ exceptions, so they go straight to the frame they're for,
+// with the destructors on the way putting scopes and roots back, and code that
+// doesn't escape runs no differently. Every place an escape can land pushes an
+// escape_frame while its body runs, so throwing to a tag nobody is waiting for
+// is an ordinary error and the exception names the exact frame that catches
+// it. return needs no frame, since call_func catches it.
+
+extern lptr global_T;
+
+static lptr error_object_sym()
+{
+	static lptr sym = intern_c("error-object");
+	return sym;
+}
+
+static escape_frame* escape_find(escape_kind kind, lptr tag)
+{
+	for(escape_frame* f = escape_top; f; f = f->up)
+	{
+		if( f->kind == kind && (kind == ESCAPE_HANDLER || f->tag == tag) ) return f;
+	}
+	return nullptr;
+}
+
+// runs body with frame pushed. an escape to the frame becomes the result
+template<typename Body>
+static lptr escape_land(escape_frame& frame, Body body)
+{
+	fscope* scope = global_scope;
+	try {
+		return body();
+	} catch(const lisp_escape& e) {
+		if( e.to != &frame ) throw;
+		global_scope = scope;
+		return e.value;
+	}
+}
+
+static lptr eval_from(const MultiArg& args, size_t from)
+{
+	lptr res;
+	for(size_t i = from; i < args.size(); ++i) res = eval({args[i]});
+	return res;
+}
+
+lptr lreturn(lptr v)
+{
+	fscope* e = global_scope;
+	while( e && !e->F ) e = e->parent;
+	if( !e ) throw "return: not inside a function";
+	throw lisp_return{v};
+}
+
+lptr lcatch(const MultiArg& args)
+{
+	if( args.size() < 1 ) return lptr();
+
+	escape_frame frame(ESCAPE_CATCH, eval({args[0]}));
+	return escape_land(frame, [&]() { return eval_from(args, 1); });
+}
+
+lptr lthrow(const MultiArg& args)
+{
+	if( args.size() < 1 ) throw "throw: expected a tag";
+
+	escape_frame* f = escape_find(ESCAPE_CATCH, args[0]);
+	if( !f ) throw "throw: no catch for tag";
+	throw lisp_escape{f, args.size() > 1 ? args[1] : lptr()};
+}
+
+lptr lblock(const MultiArg& args)
+{
+	if( args.size() < 1 ) return lptr();
+
+	escape_frame frame(ESCAPE_BLOCK, args[0]);
+	return escape_land(frame, [&]() { return eval_from(args, 1); });
+}
+
+lptr return_from(const MultiArg& args)
+{
+	if( args.size() < 1 ) throw "return-from: expected a block name";
+
+	escape_frame* f = escape_find(ESCAPE_BLOCK, args[0]);
+	if( !f ) throw "return-from: no block by that name";
+	throw lisp_escape{f, args.size() > 1 ? eval({args[1]}) : lptr()};
+}
+
+lptr call_ec(lptr f)
+{
+	// k is its own tag, nobody else has it
+	func* k = lnew<func>(nullptr, LFUNC_ESCAPE, 1);
+	escape_frame frame(ESCAPE_CATCH, k);
+	return escape_land(frame, [&]() { return funcall(f, {lptr(k)}); });
+}
+
+lptr escape_call(func* k, const MultiArg& args)
+{
+	escape_frame* f = escape_find(ESCAPE_CATCH, k);
+	if( !f ) throw "call/ec: escape used after call/ec returned";
+	throw lisp_escape{f, args.size() ? args[0] : lptr()};
+}
+
+static std::string written(lptr v)
+{
+	std::stringstream* ss = new std::stringstream;
+	lstream out(ss);
+	lwrite({v, &out});
+	return ss->str();
+}
+
+lptr lerror(const MultiArg& args)
+{
+	lptr irritants;
+	for(size_t i = args.size(); i > 1; --i) irritants = lnew<cons>(args[i-1], irritants);
+	return lraise(lnew<cons>(error_object_sym(), lnew<cons>(args[0], irritants)));
+}
+
+lptr lraise(lptr obj)
+{
+	if( escape_find(ESCAPE_HANDLER, lptr()) ) throw lisp_error{obj};
+
+	// no guard to hand it to, so it's an error for whoever runs the program,
+	// and those only take a message
+	static thread_local std::string msg;
+	if( error_objectp(obj).nilp() )
+	{
+		msg = "raise: " + written(obj);
+	} else {
+		lptr m = error_object_message(obj);
+		msg = m.type() == LTYPE_STR ? m.string()->text() : written(m);
+		for(lptr i = error_object_irritants(obj); i.type() == LTYPE_CONS; i = i.as_cons()->b) msg += " " + written(i.as_cons()->a);
+	}
+	throw msg.c_str();
+}
+
+lptr guard(const MultiArg& args)
+{
+	if( args.size() < 1 || args[0].type() != LTYPE_CONS || args[0].as_cons()->a.type() != LTYPE_SYM ) throw "guard: expected (guard (var handler...) body...)";
+
+	lptr raised;
+	{
+		escape_frame frame(ESCAPE_HANDLER, lptr());
+		fscope* scope = global_scope;
+		try {
+			return eval_from(args, 1);
+		} catch(const lisp_error& e) {
+			raised = e.condition;
+		} catch(const char* e) {
+			raised = lnew<cons>(error_object_sym(), lnew<cons>(lnew<lstr>(e), lptr()));
+		}
+		global_scope = scope;
+		error_site_clear();
+	}
+
+	// out of the frame, so the handler raising again goes to the next guard
+	cons* spec = args[0].as_cons();
+	return begin_bind_c(spec->a, raised, spec->b);
+}
+
+lptr error_objectp(lptr obj)
+{
+	if( obj.type() == LTYPE_CONS && obj.as_cons()->a == error_object_sym() ) return global_T;
+	return lptr();
+}
+
+lptr error_object_message(lptr obj)
+{
+	if( error_objectp(obj).nilp() || obj.as_cons()->b.type() != LTYPE_CONS ) return lptr();
+	return obj.as_cons()->b.as_cons()->a;
+}
+
+lptr error_object_irritants(lptr obj)
+{
+	if( error_objectp(obj).nilp() || obj.as_cons()->b.type() != LTYPE_CONS ) return lptr();
+	return obj.as_cons()->b.as_cons()->b;
+}
@@ -1,41 +1,255 @@
 #include <iostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <mutex>
+#include <cstring>
+#include <dlfcn.h>
 #include <ffi.h>
 #include "types.h"
 #include "funcs.h"
+#include "isolate.h"
+
+// (foreign-function "lib.so" "symbol" ret-type arg-types...) makes a func that
+// calls a C function through libffi. Types are given as symbols or strings:
+//   void int long float double string pointer
+// An empty or nil library name looks the symbol up in the running program.
+// A pointer argument takes an address as a fixnum, nil for NULL, a bytevector,
+// whose data C then works on in place, or a string.
+//
+// C is given a string's own characters, which it must only read: strings never
+// change once made, and the text can be a small string's inline buffer, shared
+// with slices of it, or frozen and shared with other isolates. A buffer for C
+// to write into is a bytevector.
+//
+// The call interface for a signature is prepared once and shared by every
+// foreign function with that signature; the func keeps a pointer to it, so a
+// call only has to marshal the arguments. Fixnums, floats and strings go
+// straight into a stack buffer. Most strings already end in a zero byte and are
+// passed as they are; a slice or rope gets a flat copy made the first time.
+
+const int FOREIGN_MAX_ARGS = 16;
+
+enum foreign_kind : u8
+{
+	FOREIGN_VOID,
+	FOREIGN_INT,
+	FOREIGN_LONG,
+	FOREIGN_FLOAT,
+	FOREIGN_DOUBLE,
+	FOREIGN_STRING,
+	FOREIGN_POINTER,
+};
+
+struct foreign_sig
+{
+	ffi_cif cif;
+	u8 ret;
+	u8 nargs;
+	u8 args[FOREIGN_MAX_ARGS];
+	ffi_type* types[FOREIGN_MAX_ARGS];
+};
+
+// what an LFUNC_FFI func's ptr points at
+struct foreign_fn
+{
+	void* fn;
+	foreign_sig* sig;
+};
+
+// libraries and signatures are process wide and kept for good; isolates on
+// other threads share them
+static std::mutex foreign_lock;
+static std::unordered_map<std::string, void*> foreign_libs;
+static std::unordered_map<std::string, foreign_sig*> foreign_sigs;
+
+static ffi_type* foreign_ffi_type(u8 k)
+{
+	switch( k )
+	{
+	case FOREIGN_VOID: return &ffi_type_void;
+	case FOREIGN_INT: return &ffi_type_sint;
+	case FOREIGN_LONG: return &ffi_type_slong;
+	case FOREIGN_FLOAT: return &ffi_type_float;
+	case FOREIGN_DOUBLE: return &ffi_type_double;
+	}
+	return &ffi_type_pointer;
+}
+
+static int foreign_parse_kind(lptr t)
+{
+	std::string name;
+	if( t.type() == LTYPE_SYM )
+	{
+		name = t.sym()->str();
+	} else if( t.type() == LTYPE_STR ) {
+		name = t.string()->text();
+	} else {
+		return -1;
+	}
+	for(char& c : name) c = toupper(c);
+
+	if( name == "VOID" ) return FOREIGN_VOID;
+	if( name == "INT" ) return FOREIGN_INT;
+	if( name == "LONG" ) return FOREIGN_LONG;
+	if( name == "FLOAT" ) return FOREIGN_FLOAT;
+	if( name == "DOUBLE" ) return FOREIGN_DOUBLE;
+	if( name == "STRING" ) return FOREIGN_STRING;
+	if( name == "POINTER" ) return FOREIGN_POINTER;
+	return -1;
+}
+
+// the shared call interface for ret(args...)
+static foreign_sig* foreign_sig_get(u8 ret, const u8* args, int nargs)
+{
+	std::string key(1, (char)ret);
+	key.append((const char*)args, nargs);
+
+	std::lock_guard<std::mutex> guard(foreign_lock);
+	foreign_sig*& S = foreign_sigs[key];
+	if( S ) return S;
+
+	S = new foreign_sig;
+	S->ret = ret;
+	S->nargs = nargs;
+	for(int i = 0; i < nargs; ++i)
+	{
+		S->args[i] = args[i];
+		S->types[i] = foreign_ffi_type(args[i]);
+	}
+	if( ffi_prep_cif(&S->cif, FFI_DEFAULT_ABI, nargs, foreign_ffi_type(ret), S->types) != FFI_OK )
+	{
+		delete S;
+		S = nullptr;
+	}
+	return S;
+}
+
+static void* foreign_lookup(lptr lib, const std::string& sym)
+{
+	std::string path;
+	if( lib.type() == LTYPE_STR ) path = lib.string()->text();
+
+	std::lock_guard<std::mutex> guard(foreign_lock);
+	void*& handle = foreign_libs[path];
+	if( !handle ) handle = dlopen(path.empty() ? nullptr : path.c_str(), RTLD_NOW|RTLD_LOCAL);
+	if( !handle ) return nullptr;
+	return dlsym(handle, sym.c_str());
+}
 
 lptr create_ffi_func(const MultiArg& args)
 {
+	if( args.size() < 3 || args[1].type() != LTYPE_STR ) return lptr();
+	if( args.size() - 3 > FOREIGN_MAX_ARGS ) throw "foreign-function: too many arguments";
 
+	int ret = foreign_parse_kind(args[2]);
+	if( ret < 0 ) throw "foreign-function: unknown return type";
 
-	return lptr();
+	u8 kinds[FOREIGN_MAX_ARGS];
+	int nargs = args.size() - 3;
+	for(int i = 0; i < nargs; ++i)
+	{
+		int k = foreign_parse_kind(args[i+3]);
+		if( k < 0 || k == FOREIGN_VOID ) throw "foreign-function: unknown argument type";
+		kinds[i] = k;
+	}
+
+	void* fn = foreign_lookup(args[0], args[1].string()->text());
+	if( !fn ) return lptr();
+
+	foreign_sig* S = foreign_sig_get(ret, kinds, nargs);
+	if( !S ) return lptr();
+
+	func* F = lnew<func>((void*)new foreign_fn{fn, S}, LFUNC_FFI, nargs);
+	return F;
+}
+
+// (foreign-symbol "lib.so" "symbol") is the symbol's address, eg. to give to
+// bytes-wrap as a finalizer
+lptr foreign_symbol(const MultiArg& args)
+{
+	if( args.size() < 2 || args[1].type() != LTYPE_STR ) return lptr();
+
+	void* p = foreign_lookup(args[0], args[1].string()->text());
+	if( !p ) return lptr();
+	return (u64) p;
+}
+
+void foreign_release(func* F)
+{
+	delete (foreign_fn*)F->ptr;
+	return;
+}
+
+static s64 foreign_int_arg(lptr a)
+{
+	switch( a.type() )
+	{
+	case LTYPE_INT: return (s64) a.as_int();
+	case LTYPE_FLOAT: return (s64) a.as_float();
+	case LTYPE_CHAR: return (u8) a.as_char();
+	}
+	if( a.nilp() ) return 0;
+	throw "foreign function: expected a number";
+}
+
+static double foreign_float_arg(lptr a)
+{
+	if( a.type() == LTYPE_FLOAT ) return a.as_float();
+	if( a.type() == LTYPE_INT ) return (double)(s64) a.as_int();
+	throw "foreign function: expected a number";
+}
+
+static void* foreign_pointer_arg(lptr a)
+{
+	if( a.nilp() ) return nullptr;
+	if( a.type() == LTYPE_BYTES ) return (void*) a.bytes()->data;
+	if( a.type() == LTYPE_STR ) return (void*) a.string()->c_str();
+	if( a.type() == LTYPE_INT ) return (void*) a.as_int();
+	throw "foreign function: expected a pointer";
 }
 
+lptr foreign_call(func* F, const MultiArg& args)
+{
+	foreign_fn* FF = (foreign_fn*) F->ptr;
+	foreign_sig* S = FF->sig;
+	if( args.size() != S->nargs ) throw "foreign function: wrong number of arguments";
+
+	// every argument gets a slot big enough for any kind, values[] points at them
+	union slot { int i; long l; float f; double d; void* p; };
+	slot slots[FOREIGN_MAX_ARGS];
+	void* values[FOREIGN_MAX_ARGS];
 
-/*
-ffi_cif cif;
-  ffi_type *args[1];
-  void *values[1];
-  char *s;
-  ffi_arg rc;
-  
-  // Initialize the argument info vectors    
-  args[0] = &ffi_type_pointer;
-  values[0] = &s;
-  
-  // Initialize the cif
-  if (ffi_prep_cif(&cif, FFI_DEFAULT_ABI, 1, 
-		       &ffi_type_sint, args) == FFI_OK)
-    {
-      s = "Hello World!";
-      ffi_call(&cif, puts, &rc, values);
-      // rc now holds the result of the call to puts
-      
-      // values holds a pointer to the function's arg, so to 
-       //  call puts() again all we need to do is change the 
-       //  value of s 
-      s = "This is cool!";
-      ffi_call(&cif, puts, &rc, values);
-    }
-*/
+	for(int i = 0; i < S->nargs; ++i)
+	{
+		lptr a = args[i];
+		switch( S->args[i] )
+		{
+		case FOREIGN_INT: slots[i].i = (int) foreign_int_arg(a); break;
+		case FOREIGN_LONG: slots[i].l = (long) foreign_int_arg(a); break;
+		case FOREIGN_FLOAT: slots[i].f = (float) foreign_float_arg(a); break;
+		case FOREIGN_DOUBLE: slots[i].d = foreign_float_arg(a); break;
+		case FOREIGN_STRING:
+			if( !a.nilp() && a.type() != LTYPE_STR ) throw "foreign function: expected a string";
+			slots[i].p = a.nilp() ? nullptr : (void*) a.string()->c_str();
+			break;
+		default: slots[i].p = foreign_pointer_arg(a); break;
+		}
+		values[i] = &slots[i];
+	}
 
+	// integer results come back widened to a whole ffi_arg
+	union { ffi_arg a; ffi_sarg s; float f; double d; void* p; } res;
+	ffi_call(&S->cif, FFI_FN(FF->fn), &res, values);
 
+	switch( S->ret )
+	{
+	case FOREIGN_INT: return (u64)(s64)(int) res.s;
+	case FOREIGN_LONG: return (u64)(s64)(long) res.s;
+	case FOREIGN_FLOAT: return res.f;
+	case FOREIGN_DOUBLE: return (float) res.d;
+	case FOREIGN_STRING: return res.p ? lptr(lnew<lstr>((const char*) res.p)) : lptr();
+	case FOREIGN_POINTER: return (u64) res.p;
+	}
+	return lptr();
+}
@@ -2,31 +2,169 @@
 #include <string>
 #include <iostream>
 #include <stdlib.h>
+#include <stddef.h>
 #include <unordered_map>
 #include <algorithm>
+#include <mutex>
+#include <atomic>
 #include "types.h"
 #include "funcs.h"
+#include "isolate.h"
 
+// symbols are shared by every isolate, so these are set once and never change
 lptr global_T;
 lptr QUOTE;
-lptr lisp_out_stream;
-lptr lisp_in_stream;
 
-std::unordered_map<std::string, symbol*> symbols_by_name;
-fscope first_fscope;
-thread_local fscope* global_scope = &first_fscope;
+// lock-free, case-insensitive intern table shared by every thread. buckets are
+// chained through symbol::next; a new symbol is pushed on the head of its chain
+// with a CAS and symbols are never removed, so readers never block and a chain
+// only ever grows at the head. the bucket count is fixed so nothing ever has to
+// be rehashed under a reader's feet.
+struct symbol_table
+{
+	static const size_t NUM_BUCKETS = 1<<15;
 
-lptr apply(const MultiArg& args)
+	std::atomic<symbol*>& bucket(u32 h) { return buckets[h & (NUM_BUCKETS-1)]; }
+	static symbol* find(symbol* from, symbol* to, std::string_view name, u32 h);
+	symbol* intern(std::string_view name, u32 h);
+
+	std::atomic<symbol*> buckets[NUM_BUCKETS];
+};
+
+symbol_table symbols_by_name;
+thread_local fscope* global_scope = nullptr;
+
+// frames that a closure captured outlive the call, so they're handed to the heap.
+// so is any frame let go of during an incremental cycle, since the cycle's
+// start may have grayed it and it has to stay readable until it's traced
+static void release_env(fscope* env)
 {
-	if( args.size() == 0 ) return lptr();
+	if( env->captured || current_isolate->gc.marking.load(std::memory_order_relaxed) )
+		heap_track((lobj*)env);
+	else
+		delete env;
+	return;
+}
+
+// makes a fresh scope current for the guard's lifetime. the scope is released
+// even when the body throws, so no frame is ever left unowned.
+struct env_frame
+{
+	env_frame(fscope* parent) : env(new fscope(parent)), prev(global_scope), roots(env)
+	{
+		// linked before it's current, the profiler walks these from a signal handler
+		env->caller = prev;
+		std::atomic_signal_fence(std::memory_order_release);
+		global_scope = env;
+		current_allocs->count(LTYPE_ENV, sizeof(fscope));
+	}
+	~env_frame() { global_scope = prev; release_env(env); }
+
+	fscope* env;
+	fscope* prev;
+	local_roots roots;
+};
+
+static void bind_params(fscope* env, lptr params, const MultiArg& args)
+{
+	size_t i = 0;
+	while( params.type() == LTYPE_CONS )
+	{
+		env->symbols.push_back(std::make_pair(params.as_cons()->a.sym(), i < args.size() ? args[i] : lptr()));
+		params = params.as_cons()->b;
+		++i;
+	}
+
+	if( params.type() == LTYPE_SYM )
+	{
+		// (lambda (a . rest) ...) collects the remaining args in a list
+		lptr rest;
+		for(size_t j = args.size(); j > i; --j)
+		{
+			rest = lnew<cons>(args[j-1], rest);
+		}
+		env->symbols.push_back(std::make_pair(params.sym(), rest));
+	}
+	return;
+}
+
+static lptr call_func(func* F, const MultiArg& args)
+{
+	//todo: check expected arg number, eventually types as well
+	if( F->flags & LFUNC_FFI ) return foreign_call(F, args);
+	if( F->flags & LFUNC_ESCAPE ) return escape_call(F, args);
+	if( F->flags & LFUNC_RECORD )
+	{
+		if( args.size() != (size_t)F->num_args ) throw "record procedure: wrong number of arguments";
+		return ((record_proc*)F->ptr)(F, args);
+	}
+
+	// if the native pointer exists, must use that
+	if( F->ptr )
+	{
+		if( F->num_args == 0 )
+			return ((zero_arg_func*)(F->ptr))();
+		if( F->num_args == 1 )
+			return ((one_arg_func*)(F->ptr))(args.size() ? args[0] : lptr());
+		return ((multiarg_func*)(F->ptr))(args);
+	}
+
+	trace_span span(TRACE_CALL, (uintptr_t)F);
+
+	// hot funcs get compiled, and then run as machine code for as long as
+	// their arguments let them
+	if( jit_enabled && !(F->flags & LFUNC_NOJIT) )
+	{
+		lptr res;
+		jit_frame frame(F);
+		if( jit_call(F, args, res) ) return res;
+	}
 
-	if( args[0].type() != LTYPE_SYM )
+	// now we're really out in the grapes implementing a fully S-expression function with arguments
+	try {
+		env_frame frame(F->closure);
+		frame.env->F = F;
+		bind_params(frame.env, F->params, args);
+
+		// run begin on the body
+		return begin_c(func_body(F));
+	} catch(const lisp_return& r) {
+		// the frame put global_scope back on the way out
+		return r.value;
+	} catch(const char*) {
+		error_site_note(F);
+		throw;
+	} catch(const lisp_error&) {
+		error_site_note(F);
+		throw;
+	}
+}
+
+lptr funcall(lptr f, const MultiArg& args)
+{
+	if( f.type() != LTYPE_FUNC )
 	{
 		//todo: error out
 		return lptr();
 	}
 
-	lptr val = symbol_value(global_scope, args[0]);
+	return call_func(f.as_func(), args);
+}
+
+// form is the (f args...) being evaluated, if there is one. a macro use is
+// replaced by its expansion there, see macro.cpp
+static lptr apply_form(const MultiArg& args, lptr form)
+{
+	if( args.size() == 0 ) return lptr();
+
+	lptr val = args[0];
+	if( val.type() == LTYPE_SYM )
+	{
+		val = symbol_value(global_scope, val);
+	} else if( val.type() == LTYPE_CONS ) {
+		val = eval({val});
+	}
+
 	if( val.type() != LTYPE_FUNC )
 	{
 		//todo: error out
@@ -34,24 +172,17 @@ lptr apply(const MultiArg& args)
 	}
 
 	func* F = val.as_func();
+	if( F->flags & LFUNC_MACRO ) return macro_use(F, args, form);
 
 	if( args.size() == 1 )
 	{
 		// having no arguments makes things easier
-		if( F->ptr )
-		{
-			if( F->num_args == 0 )
-				return ( (zero_arg_func*)(F->ptr) ) ();
-			else
-				return ( (multiarg_func*)(F->ptr) )({});
-		}
-
-		// running a lisp function with no args
-		return begin_new_env_c(F->body);
+		return call_func(F, {});
 	}
 
 	std::vector<lptr> applargs(args.size()-1);
 	for(int i = 1; i < args.size(); ++i) applargs[i-1] = args[i];
+	local_roots roots(nullptr, applargs.data(), applargs.size());
 
 	// if it isn't a special form, need to eval the args	
 	if( ! (F->flags & LFUNC_SPECIAL) )
@@ -59,32 +190,53 @@ lptr apply(const MultiArg& args)
 		for_each(std::begin(applargs), std::end(applargs), [&](lptr &a) { a = eval({a, global_scope}); });
 	}
 
-	//todo: check expected arg number, eventually types as well
-	// if the native pointer exists, must use that
-	if( F->ptr )
+	return call_func(F, applargs);
+}
+
+lptr apply(const MultiArg& args)
+{
+	return apply_form(args, lptr());
+}
+
+lptr lambda(const MultiArg& args)
+{
+	if( args.size() < 1 ) return lptr();
+
+	func* F = lnew<func>();
+	F->params = args[0];
+	for(lptr p = F->params; p.type() == LTYPE_CONS; p = p.as_cons()->b) F->num_args++;
+
+	cons* tail = nullptr;
+	for(size_t i = 1; i < args.size(); ++i)
 	{
-		if( F->num_args == 1 )
-		{
-			return ((one_arg_func*)(F->ptr))(applargs[0]);
-		} else {
-			return ((multiarg_func*)(F->ptr))(applargs);
-		}
+		cons* c = lnew<cons>(args[i], lptr());
+		if( tail ) tail->b = c; else F->body = c;
+		tail = c;
 	}
 
-	// now we're really out in the grapes implementing a fully S-expression function with arguments
-	fscope* envnew = new fscope(global_scope);
-	global_scope = envnew;
-
-	//todo: set up arguments in the global_scope
+	// where it was written: the parameter list, or the first body form that
+	// was read from source
+	for(size_t i = 0; i < args.size() && F->pos.nilp(); ++i)
+	{
+		if( u64 pos = source_pos(args[i]) ) F->pos = lptr(pos);
+	}
 
-	// run begin on the body
-	lptr retval = begin_c(F->body);
+	if( global_scope != &current_isolate->first_fscope )
+	{
+		F->closure = global_scope;
+		capture_env(global_scope);
+	} else {
+		optimize_func(F);
+	}
 
-	// restore previous global_scope
-	global_scope = global_scope->parent;
-	delete envnew; // for now, but might eventually implement call/cc
+	return F;
+}
 
-	return retval;
+// closing over a local scope keeps the whole chain alive
+void capture_env(fscope* env)
+{
+	for(fscope* e = env; e && e != &current_isolate->first_fscope; e = e->parent) e->captured = true;
+	return;
 }
 
 lptr eval(const MultiArg& args)
@@ -111,6 +263,38 @@ lptr eval(const MultiArg& args)
 		return lptr();
 	}
 
+	// (prim x) where the optimizer already put a one-argument builtin in
+	// place of its name: no argument vectors, and the simplest ones inline
+	lptr head = i.as_cons()->a;
+	lptr rest = i.as_cons()->b;
+	if( head.type() == LTYPE_FUNC && rest.type() == LTYPE_CONS && rest.as_cons()->b.nilp() )
+	{
+		func* F = head.as_func();
+		if( F->ptr && F->num_args == 1 && !(F->flags & (LFUNC_SPECIAL|LFUNC_FFI)) )
+		{
+			fscope* temp = global_scope;
+			global_scope = env;
+			lptr a = eval({rest.as_cons()->a});
+			lptr retval;
+			if( F->ptr == (void*)&car )
+				retval = a.type() == LTYPE_CONS ? a.as_cons()->a : lptr();
+			else if( F->ptr == (void*)&cdr )
+				retval = a.type() == LTYPE_CONS ? a.as_cons()->b : lptr();
+			else if( F->ptr == (void*)&nullp )
+				retval = a.nilp() ? global_T : lptr();
+			else if( F->ptr == (void*)&pairp )
+				retval = a.type() == LTYPE_CONS ? global_T : lptr();
+			else if( F->ptr == (void*)&record_get )
+				retval = record_get_c(F, a);
+			else if( F->flags & LFUNC_RECORD )
+				retval = ((record_proc*)F->ptr)(F, {a});
+			else
+				retval = ((one_arg_func*)F->ptr)(a);
+			global_scope = temp;
+			return retval;
+		}
+	}
+
 	std::vector<lptr> applargs;
 
 	do {
@@ -121,28 +305,23 @@ lptr eval(const MultiArg& args)
 	
 	fscope* temp = global_scope;
 	global_scope = env;
-	lptr retval = apply(applargs);
+	lptr retval = apply_form(applargs, args[0]);
 	global_scope = temp;
 	return retval;
 }
 
-lptr lreturn(lptr arg)
+lptr begin_new_env_c(lptr arg)
 {
-	global_scope->need_return = true;
-	global_scope->retval = arg;
-	return arg;
+	env_frame frame(global_scope);
+	return begin_c(arg);
 }
 
-lptr begin_new_env_c(lptr arg)
+// body run in a fresh scope with var bound to val
+lptr begin_bind_c(lptr var, lptr val, lptr body)
 {
-	fscope* env = new fscope(global_scope);
-	global_scope = env;
-
-	lptr retval = begin_c(arg);
-
-	global_scope = global_scope->parent;
-	delete env;
-	return retval;
+	env_frame frame(global_scope);
+	frame.env->symbols.push_back(std::make_pair(var.sym(), val));
+	return begin_c(body);
 }
 
 lptr begin_c(lptr arg)
@@ -155,21 +334,15 @@ lptr begin_c(lptr arg)
 		res = eval({temp->a});
 		if( temp->b.type() != LTYPE_CONS ) break;
 		arg = temp->b;
-	} while( !arg.nilp() && !global_scope->need_return );
+	} while( !arg.nilp() );
 
-	return global_scope->need_return ? global_scope->retval : res;
+	return res;
 }
 
 lptr begin_new_env(const MultiArg& arg)
 {
-	fscope* env = new fscope(global_scope);
-	global_scope = env;
-
-	lptr retval = begin(arg);
-
-	global_scope = global_scope->parent;
-	delete env;
-	return retval;
+	env_frame frame(global_scope);
+	return begin(arg);
 }
 
 lptr begin(const MultiArg& args)
@@ -177,56 +350,151 @@ lptr begin(const MultiArg& args)
 	if( args.size() == 0 ) return lptr();
 
 	lptr res;
-	for(int i = 0; i < args.size() && !global_scope->need_return; ++i)
+	for(int i = 0; i < args.size(); ++i)
 	{
 		res = eval({args[i]});
 	}
 
-	return global_scope->need_return ? global_scope->retval : res;
+	return res;
 }
 
-lptr intern_c(const std::string& name)
+static u32 symbol_hash(std::string_view name)
 {
-	std::string temp;
-	for_each(std::begin(name), std::end(name), [&](char c) { temp += toupper(c); });
-	if( temp == "NIL" ) return lptr();
-	
-	auto iter = symbols_by_name.find(temp);
-	if( iter != symbols_by_name.end() )
+	u32 h = 2166136261u;
+	for(char c : name)
 	{
-		return iter->second;
+		h ^= (u8) toupper(c);
+		h *= 16777619u;
 	}
-	
-	symbol* sym = new symbol(temp);
-	symbols_by_name.insert(std::make_pair(temp, sym));
+	return h;
+}
+
+static bool symbol_name_eq(const symbol* s, std::string_view name)
+{
+	if( s->len != name.size() ) return false;
+	for(size_t i = 0; i < name.size(); ++i)
+	{
+		if( s->name[i] != (char) toupper(name[i]) ) return false;
+	}
+	return true;
+}
+
+symbol* symbol::create(std::string_view n, u32 h)
+{
+	void* mem = ::operator new(offsetof(symbol, name) + n.size() + 1);
+	symbol* s = new(mem) symbol();
+	s->hash = h;
+	s->next = nullptr;
+	s->len = n.size();
+	for(size_t i = 0; i < n.size(); ++i) s->name[i] = toupper(n[i]);
+	s->name[n.size()] = 0;
+	return s;
+}
+
+// searches the part of a chain from 'from' up to (not including) 'to'
+symbol* symbol_table::find(symbol* from, symbol* to, std::string_view name, u32 h)
+{
+	for(symbol* s = from; s != to; s = s->next)
+	{
+		if( s->hash == h && symbol_name_eq(s, name) ) return s;
+	}
+	return nullptr;
+}
+
+symbol* symbol_table::intern(std::string_view name, u32 h)
+{
+	std::atomic<symbol*>& head = bucket(h);
+	symbol* first = head.load(std::memory_order_acquire);
+	symbol* sym = find(first, nullptr, name, h);
+	if( sym ) return sym;
+
+	sym = symbol::create(name, h);
+	sym->next = first;
+	while( !head.compare_exchange_weak(sym->next, sym, std::memory_order_release, std::memory_order_acquire) )
+	{
+		// somebody else pushed first, and might have interned the same name
+		symbol* other = find(sym->next, first, name, h);
+		if( other )
+		{
+			::operator delete(sym);
+			return other;
+		}
+		first = sym->next;
+	}
+
 	return sym;
 }
 
-lptr intern(lptr str)
+// how many symbols there are and what they take, for heap-snapshot
+void symbol_stats(u64& count, u64& bytes)
 {
-	return lptr();
+	count = bytes = 0;
+	for(auto& b : symbols_by_name.buckets)
+	{
+		for(symbol* s = b.load(std::memory_order_acquire); s; s = s->next)
+		{
+			count++;
+			bytes += offsetof(symbol, name) + s->len + 1;
+		}
+	}
+	return;
 }
 
-lptr symbol_value(fscope* env, lptr s)
+lptr intern_c(std::string_view name)
 {
-	if( s.type() != LTYPE_SYM )
+	if( name.size() == 3 && toupper(name[0]) == 'N' && toupper(name[1]) == 'I' && toupper(name[2]) == 'L' )
 		return lptr();
 
-	// function scope
-	auto iter = std::find_if(env->symbols.rbegin(), env->symbols.rend(), [&](const auto& p) { return p.first == s.sym(); });
-	if( iter != env->symbols.rend() )
+	return symbols_by_name.intern(name, symbol_hash(name));
+}
+
+lptr intern(lptr str)
+{
+	if( str.type() != LTYPE_STR ) return lptr();
+	return intern_c(str.string()->str());
+}
+
+// innermost binding of s visible from env, not counting the global scope
+static lptr* local_binding_c(fscope* env, symbol* s)
+{
+	fscope* top = &current_isolate->first_fscope;
+	for(; env && env != top; env = env->parent)
 	{
-		return iter->second;
+		auto iter = std::find_if(env->symbols.rbegin(), env->symbols.rend(), [&](const auto& p) { return p.first == s; });
+		if( iter != env->symbols.rend() )
+		{
+			return &iter->second;
+		}
 	}
+	return nullptr;
+}
 
-	// global scope
-	auto iter2 = std::find_if(first_fscope.symbols.rbegin(), first_fscope.symbols.rend(), [&](const auto& p) { return p.first == s.sym(); });
-	if( iter2 != first_fscope.symbols.rend() )
+// the global binding of s. futures define from the pool's threads as well as
+// the isolate's, so once there's a pool the caller holds globals_lock
+static lptr* global_binding_c(symbol* s)
+{
+	fscope* top = &current_isolate->first_fscope;
+	auto iter = std::find_if(top->symbols.rbegin(), top->symbols.rend(), [&](const auto& p) { return p.first == s; });
+	if( iter != top->symbols.rend() )
 	{
-		return iter2->second;
+		return &iter->second;
 	}
+	return nullptr;
+}
 
-	return lptr();
+lptr symbol_value(fscope* env, lptr s)
+{
+	if( s.type() != LTYPE_SYM )
+		return lptr();
+
+	lptr* b = local_binding_c(env, s.sym());
+	if( b ) return *b;
+
+	Isolate* I = current_isolate;
+	std::shared_lock<std::shared_mutex> guard(I->globals_lock, std::defer_lock);
+	if( I->pool ) guard.lock();
+	b = global_binding_c(s.sym());
+	return b ? *b : lptr();
 }
 
 lptr ldefine(const MultiArg& args)
@@ -241,12 +509,20 @@ lptr ldefine(const MultiArg& args)
 		val = eval({args[1]});
 	}
 
-	auto iter2 = std::find_if(first_fscope.symbols.begin(), first_fscope.symbols.end(), [&](const auto& p) { return p.first == sym.sym(); });
-	if( iter2 != first_fscope.symbols.end() )
+	// named for the profiler
+	if( val.type() == LTYPE_FUNC && val.as_func()->name.nilp() && !(val.as_func()->type & LGC_FROZEN) ) val.as_func()->name = sym;
+
+	Isolate* I = current_isolate;
+	std::unique_lock<std::shared_mutex> guard(I->globals_lock, std::defer_lock);
+	if( I->pool ) guard.lock();
+	lptr* b = global_binding_c(sym.sym());
+	if( b )
 	{
-		iter2->second = val;
+		if( b->type() == LTYPE_FUNC ) I->define_epoch++;
+		gc_write_barrier(*b);
+		*b = val;
 	} else {
-		first_fscope.symbols.push_back(std::make_pair(sym.sym(), val));
+		I->first_fscope.symbols.push_back(std::make_pair(sym.sym(), val));
 	}
 
 	return val;
@@ -257,22 +533,23 @@ lptr setf(const MultiArg& args)
 	if( args.size() < 2 ) return lptr();
 	lptr sym = args[0];
 	if( sym.type() != LTYPE_SYM ) return lptr();
-	
-	// function scope
-	auto iter = std::find_if(global_scope->symbols.rbegin(), global_scope->symbols.rend(), [&](const auto& p) { return p.first == sym.sym(); });
-	if( iter != global_scope->symbols.rend() )
+
+	// evaluated first, since a define in it can move the global bindings
+	lptr val = eval({args[1]});
+
+	Isolate* I = current_isolate;
+	std::unique_lock<std::shared_mutex> guard(I->globals_lock, std::defer_lock);
+	lptr* b = local_binding_c(global_scope, sym.sym());
+	if( !b )
 	{
-		lptr val = eval({args[1]});
-		iter->second = val;
-		return val;
+		if( I->pool ) guard.lock();
+		b = global_binding_c(sym.sym());
 	}
-
-	// global scope
-	auto iter2 = std::find_if(first_fscope.symbols.rbegin(), first_fscope.symbols.rend(), [&](const auto& p) { return p.first == sym.sym(); });
-	if( iter2 != first_fscope.symbols.rend() )
+	if( b )
 	{
-		lptr val = eval({args[1]});
-		iter2->second = val;
+		if( b->type() == LTYPE_FUNC ) I->define_epoch++;
+		gc_write_barrier(*b);
+		*b = val;
 		return val;
 	}
 
@@ -309,7 +586,375 @@ lptr lcons(const MultiArg& args)
 		//todo: error out
 		return lptr();
 	}
-	return new cons(args[0], args[1]);
+	return lnew<cons>(args[0], args[1]);
+}
+
+// list library. every function walks lists with a loop instead of recursing,
+// so no list is too long for the C++ stack, and new lists are built front to
+// back through a tail pointer. the ones that call back into lisp keep what
+// they've built in local_roots, as a callback may park a green thread and let
+// the collector run; the ones that relink cells go through the write barrier.
+
+// a list being built front to back
+struct list_builder
+{
+	list_builder() : tail(nullptr), roots(nullptr, &head, 1) {}
+
+	void push(lptr v)
+	{
+		cons* c = lnew<cons>(v, lptr());
+		if( tail ) tail->b = c; else head = c;
+		tail = c;
+		return;
+	}
+
+	lptr head;
+	cons* tail;
+	local_roots roots;
+};
+
+static func* func_arg(lptr f, const char* err)
+{
+	if( f.type() != LTYPE_FUNC ) throw err;
+	return f.as_func();
+}
+
+lptr list(const MultiArg& args)
+{
+	lptr res;
+	for(size_t i = args.size(); i > 0; --i) res = lnew<cons>(args[i-1], res);
+	return res;
+}
+
+lptr length(lptr l)
+{
+	u64 n = 0;
+	for(; l.type() == LTYPE_CONS; l = l.as_cons()->b) ++n;
+	return n;
+}
+
+lptr eqp(const MultiArg& args)
+{
+	return args[0] == args[1] ? global_T : lptr();
+}
+
+static bool equal_c(lptr a, lptr b)
+{
+	// down the cars by recursion, along the cdrs by looping
+	while( true )
+	{
+		if( a == b ) return true;
+		if( a.type() != b.type() ) return false;
+
+		switch( a.type() )
+		{
+		case LTYPE_FLOAT: return a.as_float() == b.as_float();
+		case LTYPE_STR: return a.string()->str() == b.string()->str();
+		case LTYPE_CONS:
+			if( !equal_c(a.as_cons()->a, b.as_cons()->a) ) return false;
+			a = a.as_cons()->b;
+			b = b.as_cons()->b;
+			continue;
+		}
+		return false;
+	}
+}
+
+lptr equalp(const MultiArg& args)
+{
+	return equal_c(args[0], args[1]) ? global_T : lptr();
+}
+
+// (append l... last) copies every list but the last, which the result shares
+lptr append(const MultiArg& args)
+{
+	if( args.size() == 0 ) return lptr();
+
+	list_builder res;
+	for(size_t i = 0; i+1 < args.size(); ++i)
+	{
+		for(lptr p = args[i]; p.type() == LTYPE_CONS; p = p.as_cons()->b) res.push(p.as_cons()->a);
+	}
+
+	lptr last = args[args.size()-1];
+	if( !res.tail ) return last;
+	res.tail->b = last;
+	return res.head;
+}
+
+lptr reverse(lptr l)
+{
+	lptr res;
+	for(; l.type() == LTYPE_CONS; l = l.as_cons()->b) res = lnew<cons>(l.as_cons()->a, res);
+	return res;
+}
+
+// reverses the list by turning its cells around, allocating nothing
+lptr reverse_inplace(lptr l)
+{
+	lptr res;
+	while( l.type() == LTYPE_CONS )
+	{
+		cons* c = l.as_cons();
+		if( c->type & LGC_FROZEN ) throw "reverse!: list is frozen";
+		l = c->b;
+		gc_write_barrier(c->b);
+		c->b = res;
+		res = c;
+	}
+	return res;
+}
+
+lptr list_tail(const MultiArg& args)
+{
+	lptr l = args[0];
+	for(s64 k = args[1].as_int(); k > 0; --k)
+	{
+		if( l.type() != LTYPE_CONS ) throw "list-tail: list too short";
+		l = l.as_cons()->b;
+	}
+	return l;
+}
+
+lptr list_ref(const MultiArg& args)
+{
+	lptr l = args[0];
+	for(s64 k = args[1].as_int(); ; --k)
+	{
+		if( l.type() != LTYPE_CONS ) throw "list-ref: index out of range";
+		if( k <= 0 ) return l.as_cons()->a;
+		l = l.as_cons()->b;
+	}
+}
+
+// (map f l...) stops at the end of the shortest list
+lptr map(const MultiArg& args)
+{
+	lptr f = args[0];
+	func_arg(f, "map: not a function");
+	if( args.size() < 2 ) return lptr();
+	list_builder res;
+
+	if( args.size() == 2 )
+	{
+		for(lptr p = args[1]; p.type() == LTYPE_CONS; p = p.as_cons()->b) res.push(funcall(f, {p.as_cons()->a}));
+		return res.head;
+	}
+
+	std::vector<lptr> lists(args.size()-1), elems(args.size()-1);
+	for(size_t i = 1; i < args.size(); ++i) lists[i-1] = args[i];
+	local_roots roots(nullptr, elems.data(), elems.size());
+	while( true )
+	{
+		for(size_t i = 0; i < lists.size(); ++i)
+		{
+			if( lists[i].type() != LTYPE_CONS ) return res.head;
+			elems[i] = lists[i].as_cons()->a;
+			lists[i] = lists[i].as_cons()->b;
+		}
+		res.push(funcall(f, elems));
+	}
+}
+
+lptr for_each(const MultiArg& args)
+{
+	lptr f = args[0];
+	func_arg(f, "for-each: not a function");
+	if( args.size() < 2 ) return lptr();
+
+	if( args.size() == 2 )
+	{
+		for(lptr p = args[1]; p.type() == LTYPE_CONS; p = p.as_cons()->b) funcall(f, {p.as_cons()->a});
+		return lptr();
+	}
+
+	std::vector<lptr> lists(args.size()-1), elems(args.size()-1);
+	for(size_t i = 1; i < args.size(); ++i) lists[i-1] = args[i];
+	while( true )
+	{
+		for(size_t i = 0; i < lists.size(); ++i)
+		{
+			if( lists[i].type() != LTYPE_CONS ) return lptr();
+			elems[i] = lists[i].as_cons()->a;
+			lists[i] = lists[i].as_cons()->b;
+		}
+		funcall(f, elems);
+	}
+}
+
+lptr filter(const MultiArg& args)
+{
+	lptr f = args[0];
+	func_arg(f, "filter: not a function");
+
+	list_builder res;
+	for(lptr p = args[1]; p.type() == LTYPE_CONS; p = p.as_cons()->b)
+	{
+		if( !funcall(f, {p.as_cons()->a}).nilp() ) res.push(p.as_cons()->a);
+	}
+	return res.head;
+}
+
+// (fold f init l) is (f ln ... (f l2 (f l1 init)))
+lptr fold(const MultiArg& args)
+{
+	lptr f = args[0];
+	func_arg(f, "fold: not a function");
+
+	lptr acc = args[1];
+	local_roots roots(nullptr, &acc, 1);
+	for(lptr p = args[2]; p.type() == LTYPE_CONS; p = p.as_cons()->b) acc = funcall(f, {p.as_cons()->a, acc});
+	return acc;
+}
+
+lptr assq(const MultiArg& args)
+{
+	for(lptr p = args[1]; p.type() == LTYPE_CONS; p = p.as_cons()->b)
+	{
+		lptr e = p.as_cons()->a;
+		if( e.type() == LTYPE_CONS && e.as_cons()->a == args[0] ) return e;
+	}
+	return lptr();
+}
+
+lptr assoc(const MultiArg& args)
+{
+	for(lptr p = args[1]; p.type() == LTYPE_CONS; p = p.as_cons()->b)
+	{
+		lptr e = p.as_cons()->a;
+		if( e.type() == LTYPE_CONS && equal_c(e.as_cons()->a, args[0]) ) return e;
+	}
+	return lptr();
+}
+
+lptr memq(const MultiArg& args)
+{
+	for(lptr p = args[1]; p.type() == LTYPE_CONS; p = p.as_cons()->b)
+	{
+		if( p.as_cons()->a == args[0] ) return p;
+	}
+	return lptr();
+}
+
+lptr member(const MultiArg& args)
+{
+	for(lptr p = args[1]; p.type() == LTYPE_CONS; p = p.as_cons()->b)
+	{
+		if( equal_c(p.as_cons()->a, args[0]) ) return p;
+	}
+	return lptr();
+}
+
+// the comparison a sort makes between each pair of elements. < and > on
+// fixnums are done here rather than called
+struct sort_less
+{
+	sort_less(lptr f) : less(f), op(nullptr)
+	{
+		func* F = func_arg(f, "sort: not a function");
+		if( F->ptr == (void*)&num_lt || F->ptr == (void*)&num_gt ) op = F->ptr;
+	}
+
+	bool operator()(lptr a, lptr b) const
+	{
+		if( op && a.type() == LTYPE_INT && b.type() == LTYPE_INT )
+		{
+			return op == (void*)&num_lt ? (s64)a.as_int() < (s64)b.as_int() : (s64)a.as_int() > (s64)b.as_int();
+		}
+		return !funcall(less, {a, b}).nilp();
+	}
+
+	lptr less;
+	void* op;
+};
+
+// merges two sorted lists by relinking their cells. on a tie a's element
+// comes first, which is what keeps the sort stable
+static lptr sort_merge(lptr a_in, lptr b_in, const sort_less& less)
+{
+	if( a_in.nilp() ) return b_in;
+	if( b_in.nilp() ) return a_in;
+
+	// cells cut off from the runs are only reachable from here, and the
+	// comparison can park a green thread and let the collector run
+	lptr live[3] = {a_in, b_in, lptr()};
+	local_roots roots(nullptr, live, 3);
+	lptr& a = live[0];
+	lptr& b = live[1];
+	lptr& head = live[2];
+	cons* tail = nullptr;
+	while( !a.nilp() && !b.nilp() )
+	{
+		lptr next;
+		if( less(b.as_cons()->a, a.as_cons()->a) )
+		{
+			next = b;
+			b = b.as_cons()->b;
+		} else {
+			next = a;
+			a = a.as_cons()->b;
+		}
+		if( tail )
+		{
+			gc_write_barrier(tail->b);
+			tail->b = next;
+		} else {
+			head = next;
+		}
+		tail = next.as_cons();
+	}
+	gc_write_barrier(tail->b);
+	tail->b = a.nilp() ? b : a;
+	return head;
+}
+
+// bottom up merge sort over the cells: runs[i] holds a sorted run of 2^i cells
+// taken from the front of what's been seen, each new cell is carried up
+// through them like a binary counter. no recursion, nothing allocated.
+lptr sort_inplace(const MultiArg& args)
+{
+	const int MAX_RUNS = 64;
+	sort_less less(args[1]);
+
+	// the runs are only reachable from here while they're being merged
+	lptr runs[MAX_RUNS+3];
+	local_roots roots(nullptr, runs, MAX_RUNS+3);
+	lptr& carry = runs[MAX_RUNS];
+	lptr& rest = runs[MAX_RUNS+1];
+	lptr& res = runs[MAX_RUNS+2];
+
+	int used = 0;
+	rest = args[0];
+	while( rest.type() == LTYPE_CONS )
+	{
+		cons* c = rest.as_cons();
+		if( c->type & LGC_FROZEN ) throw "sort!: list is frozen";
+		rest = c->b;
+		gc_write_barrier(c->b);
+		c->b = lptr();
+		carry = c;
+
+		int i = 0;
+		for(; i < used && !runs[i].nilp(); ++i)
+		{
+			carry = sort_merge(runs[i], carry, less);
+			runs[i] = lptr();
+		}
+		runs[i] = carry;
+		if( i == used ) ++used;
+	}
+
+	// higher runs hold earlier elements
+	for(int i = 0; i < used; ++i) res = sort_merge(runs[i], res, less);
+	return res;
+}
+
+// (sort l less?) is a sorted copy, (sort! l less?) sorts l's own cells
+lptr sort(const MultiArg& args)
+{
+	list_builder copy;
+	for(lptr p = args[0]; p.type() == LTYPE_CONS; p = p.as_cons()->b) copy.push(p.as_cons()->a);
+	return sort_inplace({copy.head, args[1]});
 }
 
 lptr lquote(lptr a)
@@ -526,6 +1171,54 @@ lptr l_div(const MultiArg& arg)
 	return lptr();
 }
 
+// (< a b ...) and friends hold when every neighbouring pair compares so.
+// fixnums compare exactly, anything with a float in it as floats.
+template<typename Cmp>
+static lptr num_compare(const MultiArg& arg, Cmp cmp)
+{
+	for(size_t i = 0; i < arg.size(); ++i)
+	{
+		if( arg[i].type() != LTYPE_INT && arg[i].type() != LTYPE_FLOAT ) return lptr();
+	}
+
+	for(size_t i = 1; i < arg.size(); ++i)
+	{
+		lptr a = arg[i-1], b = arg[i];
+		bool res;
+		if( a.type() == LTYPE_INT && b.type() == LTYPE_INT )
+			res = cmp((s64)a.as_int(), (s64)b.as_int());
+		else
+			res = cmp(to_float_c(a), to_float_c(b));
+		if( !res ) return lptr();
+	}
+	return global_T;
+}
+
+lptr num_lt(const MultiArg& arg)
+{
+	return num_compare(arg, [](auto a, auto b) { return a < b; });
+}
+
+lptr num_gt(const MultiArg& arg)
+{
+	return num_compare(arg, [](auto a, auto b) { return a > b; });
+}
+
+lptr num_le(const MultiArg& arg)
+{
+	return num_compare(arg, [](auto a, auto b) { return a <= b; });
+}
+
+lptr num_ge(const MultiArg& arg)
+{
+	return num_compare(arg, [](auto a, auto b) { return a >= b; });
+}
+
+lptr num_eq(const MultiArg& arg)
+{
+	return num_compare(arg, [](auto a, auto b) { return a == b; });
+}
+
 lptr l_if(const MultiArg& args)
 {
 	if( args.size() < 1 ) return lptr();
@@ -543,10 +1236,26 @@ lptr l_if(const MultiArg& args)
 	return eval({args[1]});
 }
 
+// (while test body...) evaluates body for as long as test is non-nil
+lptr lwhile(const MultiArg& args)
+{
+	if( args.size() == 0 ) return lptr();
+
+	lptr res;
+	while( !eval({args[0]}).nilp() )
+	{
+		for(size_t i = 1; i < args.size(); ++i) res = eval({args[i]});
+	}
+
+	return res;
+}
+
 lptr set_car(const MultiArg& args)
 {
 	if( args.size() != 2 ) return lptr();
 	if( args[0].type() != LTYPE_CONS ) return lptr();
+	if( args[0].as_cons()->type & LGC_FROZEN ) throw "set-car!: object is frozen";
+	gc_write_barrier(args[0].as_cons()->a);
 	args[0].as_cons()->a = args[1];
 	return args[1];
 }
@@ -555,6 +1264,8 @@ lptr set_cdr(const MultiArg& args)
 {
 	if( args.size() != 2 ) return lptr();
 	if( args[0].type() != LTYPE_CONS ) return lptr();
+	if( args[0].as_cons()->type & LGC_FROZEN ) throw "set-cdr!: object is frozen";
+	gc_write_barrier(args[0].as_cons()->b);
 	args[0].as_cons()->b = args[1];
 	return args[1];
 }
@@ -595,42 +1306,145 @@ lptr stringp(lptr a)
 	return lptr();
 }
 
-void lisp_init()
+static void symbols_init()
 {
 	global_T = intern_c("T");
-	first_fscope.symbols.push_back(std::make_pair(global_T.sym(), global_T));
-
 	QUOTE = intern_c("QUOTE");
+	return;
+}
 
-	lisp_in_stream = new lstream(&std::cin);
-	lisp_out_stream = new lstream(&std::cout);
-
-	ldefine({intern_c("string?"), new func((void*)&stringp,0,1)});
-	ldefine({intern_c("symbol?"), new func((void*)&symbolp,0,1)});
-	ldefine({intern_c("integer?"), new func((void*)&integerp,0,1)});
-	ldefine({intern_c("number?"), new func((void*)&numberp, 0, 1)});
-	ldefine({intern_c("null?"), new func((void*)&nullp, 0, 1)});
-	ldefine({intern_c("pair?"), new func((void*)&pairp, 0, 1)});
-	ldefine({intern_c("if"), new func((void*)&l_if, LFUNC_SPECIAL, -1)});
-	ldefine({intern_c("*"), new func((void*)&mult, 0, -1)});
-	ldefine({intern_c("/"), new func((void*)&l_div, 0, -1)});
-	ldefine({intern_c("+"), new func((void*)&plus, 0, -1)});
-	ldefine({intern_c("-"), new func((void*)&minus,0, -1)});
-	ldefine({intern_c("exit"), new func((void*)&lexit, 0, 1)});
-	ldefine({intern_c("newline"), new func((void*)&newline, 0, -1)});
-	ldefine({intern_c("display"), new func((void*)&ldisplay, 0, -1)});
-	ldefine({intern_c("setf"), ldefine({intern_c("set!"), new func((void*)&setf, LFUNC_SPECIAL, 2)})});
-	ldefine({intern_c("set-car!"), new func((void*)&set_car, 0, 2)});
-	ldefine({intern_c("set-cdr!"), new func((void*)&set_cdr, 0, 2)});
-	ldefine({intern_c("eval"), new func((void*)&eval, 0, -1)});
-	ldefine({intern_c("apply"), new func((void*)&apply, 0, -1)});
-	ldefine({intern_c("begin"), new func((void*)&begin_new_env, LFUNC_SPECIAL, -1)});
-	ldefine({intern_c("return"), new func((void*)&lreturn, 0, 1)});
-	ldefine({intern_c("car"), new func((void*)&car, 0, 1)});
-	ldefine({intern_c("cdr"), new func((void*)&cdr, 0, 1)});
-	ldefine({intern_c("cons"), new func((void*)&lcons, 0, 2)});
-	ldefine({intern_c("define"), new func((void*)&ldefine, LFUNC_SPECIAL, -1)});
-	ldefine({QUOTE, new func((void*)&lquote, LFUNC_SPECIAL, 1)});
+void lisp_init()
+{
+	static std::once_flag symbols_once;
+	std::call_once(symbols_once, symbols_init);
+
+	current_isolate->first_fscope.symbols.push_back(std::make_pair(global_T.sym(), global_T));
+
+	ldefine({intern_c("string?"), lnew<func>((void*)&stringp,0,1)});
+	ldefine({intern_c("symbol?"), lnew<func>((void*)&symbolp,0,1)});
+	ldefine({intern_c("integer?"), lnew<func>((void*)&integerp,0,1)});
+	ldefine({intern_c("number?"), lnew<func>((void*)&numberp, 0, 1)});
+	ldefine({intern_c("null?"), lnew<func>((void*)&nullp, 0, 1)});
+	ldefine({intern_c("pair?"), lnew<func>((void*)&pairp, 0, 1)});
+	ldefine({intern_c("if"), lnew<func>((void*)&l_if, LFUNC_SPECIAL, -1)});
+	ldefine({intern_c("while"), lnew<func>((void*)&lwhile, LFUNC_SPECIAL, -1)});
+	ldefine({intern_c("*"), lnew<func>((void*)&mult, 0, -1)});
+	ldefine({intern_c("/"), lnew<func>((void*)&l_div, 0, -1)});
+	ldefine({intern_c("+"), lnew<func>((void*)&plus, 0, -1)});
+	ldefine({intern_c("-"), lnew<func>((void*)&minus,0, -1)});
+	ldefine({intern_c("<"), lnew<func>((void*)&num_lt, 0, -1)});
+	ldefine({intern_c(">"), lnew<func>((void*)&num_gt, 0, -1)});
+	ldefine({intern_c("<="), lnew<func>((void*)&num_le, 0, -1)});
+	ldefine({intern_c(">="), lnew<func>((void*)&num_ge, 0, -1)});
+	ldefine({intern_c("="), lnew<func>((void*)&num_eq, 0, -1)});
+	ldefine({intern_c("exit"), lnew<func>((void*)&lexit, 0, 1)});
+	ldefine({intern_c("newline"), lnew<func>((void*)&newline, 0, -1)});
+	ldefine({intern_c("display"), lnew<func>((void*)&ldisplay, 0, -1)});
+	ldefine({intern_c("setf"), ldefine({intern_c("set!"), lnew<func>((void*)&setf, LFUNC_SPECIAL, 2)})});
+	ldefine({intern_c("set-car!"), lnew<func>((void*)&set_car, 0, 2)});
+	ldefine({intern_c("set-cdr!"), lnew<func>((void*)&set_cdr, 0, 2)});
+	ldefine({intern_c("eval"), lnew<func>((void*)&eval, 0, -1)});
+	ldefine({intern_c("apply"), lnew<func>((void*)&apply, 0, -1)});
+	ldefine({intern_c("begin"), lnew<func>((void*)&begin_new_env, LFUNC_SPECIAL, -1)});
+	ldefine({intern_c("return"), lnew<func>((void*)&lreturn, 0, 1)});
+	ldefine({intern_c("catch"), lnew<func>((void*)&lcatch, LFUNC_SPECIAL, -1)});
+	ldefine({intern_c("throw"), lnew<func>((void*)&lthrow, 0, -1)});
+	ldefine({intern_c("block"), lnew<func>((void*)&lblock, LFUNC_SPECIAL, -1)});
+	ldefine({intern_c("return-from"), lnew<func>((void*)&return_from, LFUNC_SPECIAL, -1)});
+	ldefine({intern_c("call/ec"), lnew<func>((void*)&call_ec, 0, 1)});
+	ldefine({intern_c("error"), lnew<func>((void*)&lerror, 0, -1)});
+	ldefine({intern_c("raise"), lnew<func>((void*)&lraise, 0, 1)});
+	ldefine({intern_c("guard"), lnew<func>((void*)&guard, LFUNC_SPECIAL, -1)});
+	ldefine({intern_c("error-object?"), lnew<func>((void*)&error_objectp, 0, 1)});
+	ldefine({intern_c("error-object-message"), lnew<func>((void*)&error_object_message, 0, 1)});
+	ldefine({intern_c("error-object-irritants"), lnew<func>((void*)&error_object_irritants, 0, 1)});
+	ldefine({intern_c("quasiquote"), lnew<func>((void*)&quasiquote, LFUNC_SPECIAL, 1)});
+	ldefine({intern_c("defmacro"), lnew<func>((void*)&defmacro, LFUNC_SPECIAL, -1)});
+	ldefine({intern_c("define-syntax"), lnew<func>((void*)&define_syntax, LFUNC_SPECIAL, -1)});
+	ldefine({intern_c("macroexpand-1"), lnew<func>((void*)&macroexpand_1, 0, 1)});
+	ldefine({intern_c("define-record-type"), lnew<func>((void*)&define_record_type, LFUNC_SPECIAL, -1)});
+	ldefine({intern_c("car"), lnew<func>((void*)&car, 0, 1)});
+	ldefine({intern_c("cdr"), lnew<func>((void*)&cdr, 0, 1)});
+	ldefine({intern_c("cons"), lnew<func>((void*)&lcons, 0, 2)});
+	ldefine({intern_c("list"), lnew<func>((void*)&list, 0, -1)});
+	ldefine({intern_c("length"), lnew<func>((void*)&length, 0, 1)});
+	ldefine({intern_c("eq?"), lnew<func>((void*)&eqp, 0, 2)});
+	ldefine({intern_c("equal?"), lnew<func>((void*)&equalp, 0, 2)});
+	ldefine({intern_c("append"), lnew<func>((void*)&append, 0, -1)});
+	ldefine({intern_c("reverse"), lnew<func>((void*)&reverse, 0, 1)});
+	ldefine({intern_c("reverse!"), lnew<func>((void*)&reverse_inplace, 0, 1)});
+	ldefine({intern_c("list-tail"), lnew<func>((void*)&list_tail, 0, 2)});
+	ldefine({intern_c("list-ref"), lnew<func>((void*)&list_ref, 0, 2)});
+	ldefine({intern_c("map"), lnew<func>((void*)&map, 0, -1)});
+	ldefine({intern_c("for-each"), lnew<func>((void*)&for_each, 0, -1)});
+	ldefine({intern_c("filter"), lnew<func>((void*)&filter, 0, 2)});
+	ldefine({intern_c("fold"), lnew<func>((void*)&fold, 0, 3)});
+	ldefine({intern_c("assq"), lnew<func>((void*)&assq, 0, 2)});
+	ldefine({intern_c("assoc"), lnew<func>((void*)&assoc, 0, 2)});
+	ldefine({intern_c("memq"), lnew<func>((void*)&memq, 0, 2)});
+	ldefine({intern_c("member"), lnew<func>((void*)&member, 0, 2)});
+	ldefine({intern_c("sort"), lnew<func>((void*)&sort, 0, 2)});
+	ldefine({intern_c("sort!"), lnew<func>((void*)&sort_inplace, 0, 2)});
+	ldefine({intern_c("define"), lnew<func>((void*)&ldefine, LFUNC_SPECIAL, -1)});
+	ldefine({intern_c("lambda"), lnew<func>((void*)&lambda, LFUNC_SPECIAL, -1)});
+	ldefine({intern_c("future"), lnew<func>((void*)&future, LFUNC_SPECIAL, -1)});
+	ldefine({intern_c("touch"), lnew<func>((void*)&touch, 0, 1)});
+	ldefine({intern_c("pmap"), lnew<func>((void*)&pmap, 0, 2)});
+	ldefine({intern_c("gc"), lnew<func>((void*)&lgc, 0, 0)});
+	ldefine({intern_c("gc-stats"), lnew<func>((void*)&gc_stats, 0, 0)});
+	ldefine({intern_c("gc-incremental"), lnew<func>((void*)&gc_incremental, 0, 1)});
+	ldefine({intern_c("time"), lnew<func>((void*)&ltime, LFUNC_SPECIAL, -1)});
+	ldefine({intern_c("runtime-stats"), lnew<func>((void*)&runtime_stats, 0, 0)});
+	ldefine({intern_c("profile-start"), lnew<func>((void*)&profile_start, 0, -1)});
+	ldefine({intern_c("profile-stop"), lnew<func>((void*)&profile_stop, 0, -1)});
+	ldefine({intern_c("trace-start"), lnew<func>((void*)&trace_start, 0, -1)});
+	ldefine({intern_c("trace-stop"), lnew<func>((void*)&trace_stop, 0, -1)});
+	ldefine({intern_c("trace-mark"), lnew<func>((void*)&trace_mark, 0, 1)});
+	ldefine({intern_c("string-length"), lnew<func>((void*)&string_length, 0, 1)});
+	ldefine({intern_c("string-ref"), lnew<func>((void*)&string_ref, 0, 2)});
+	ldefine({intern_c("substring"), lnew<func>((void*)&substring, 0, -1)});
+	ldefine({intern_c("string-append"), lnew<func>((void*)&string_append, 0, -1)});
+	ldefine({intern_c("heap-snapshot"), lnew<func>((void*)&heap_snapshot, 0, 1)});
+	ldefine({intern_c("heap-track-sites"), lnew<func>((void*)&heap_track_sites, 0, 1)});
+	ldefine({intern_c("source-position"), lnew<func>((void*)&source_position, 0, 1)});
+	ldefine({intern_c("load"), lnew<func>((void*)&lload, 0, 1)});
+	ldefine({intern_c("freeze"), lnew<func>((void*)&freeze, 0, 1)});
+	ldefine({intern_c("frozen?"), lnew<func>((void*)&frozenp, 0, 1)});
+	ldefine({intern_c("make-channel"), lnew<func>((void*)&make_channel, 0, -1)});
+	ldefine({intern_c("channel-send"), lnew<func>((void*)&channel_send, 0, 2)});
+	ldefine({intern_c("channel-receive"), lnew<func>((void*)&channel_receive, 0, 1)});
+	ldefine({intern_c("read"), lnew<func>((void*)&lread, 0, -1)});
+	ldefine({intern_c("write"), lnew<func>((void*)&lwrite, 0, -1)});
+	ldefine({intern_c("read-char"), lnew<func>((void*)&read_char, 0, -1)});
+	ldefine({intern_c("peek-char"), lnew<func>((void*)&peek_char, 0, -1)});
+	ldefine({intern_c("write-char"), lnew<func>((void*)&write_char, 0, -1)});
+	ldefine({intern_c("close"), lnew<func>((void*)&lclose, 0, 1)});
+	ldefine({intern_c("tcp-listen"), lnew<func>((void*)&tcp_listen, 0, -1)});
+	ldefine({intern_c("tcp-connect"), lnew<func>((void*)&tcp_connect, 0, -1)});
+	ldefine({intern_c("unix-listen"), lnew<func>((void*)&unix_listen, 0, 1)});
+	ldefine({intern_c("unix-connect"), lnew<func>((void*)&unix_connect, 0, 1)});
+	ldefine({intern_c("socket-accept"), lnew<func>((void*)&socket_accept, 0, 1)});
+	ldefine({intern_c("socket-read"), lnew<func>((void*)&socket_read, 0, 1)});
+	ldefine({intern_c("socket-write"), lnew<func>((void*)&socket_write, 0, 2)});
+	ldefine({intern_c("on-readable"), lnew<func>((void*)&on_readable, 0, -1)});
+	ldefine({intern_c("run-event-loop"), lnew<func>((void*)&run_event_loop, 0, 0)});
+	ldefine({intern_c("foreign-function"), lnew<func>((void*)&create_ffi_func, 0, -1)});
+	ldefine({intern_c("foreign-symbol"), lnew<func>((void*)&foreign_symbol, 0, -1)});
+	ldefine({intern_c("make-bytes"), lnew<func>((void*)&make_bytes, 0, -1)});
+	ldefine({intern_c("bytes-length"), lnew<func>((void*)&bytes_length, 0, 1)});
+	ldefine({intern_c("bytes-ref"), lnew<func>((void*)&bytes_ref, 0, -1)});
+	ldefine({intern_c("bytes-set!"), lnew<func>((void*)&bytes_set, 0, -1)});
+	ldefine({intern_c("bytes-pointer"), lnew<func>((void*)&bytes_pointer, 0, 1)});
+	ldefine({intern_c("bytes-pin"), lnew<func>((void*)&bytes_pin, 0, 1)});
+	ldefine({intern_c("bytes-unpin"), lnew<func>((void*)&bytes_unpin, 0, 1)});
+	ldefine({intern_c("bytes-wrap"), lnew<func>((void*)&lbytes_wrap, 0, -1)});
+	ldefine({intern_c("string->bytes"), lnew<func>((void*)&string_to_bytes, 0, 1)});
+	ldefine({intern_c("bytes->string"), lnew<func>((void*)&bytes_to_string, 0, 1)});
+	ldefine({intern_c("spawn"), lnew<func>((void*)&spawn, 0, -1)});
+	ldefine({intern_c("yield"), lnew<func>((void*)&yield, 0, 0)});
+	ldefine({intern_c("sleep"), lnew<func>((void*)&lsleep, 0, 1)});
+	ldefine({intern_c("stop-event-loop"), lnew<func>((void*)&stop_event_loop, 0, 0)});
+	ldefine({QUOTE, lnew<func>((void*)&lquote, LFUNC_SPECIAL, 1)});
 
 	return;
 }
@@ -1,20 +1,114 @@
 #pragma once
 #include <vector>
 #include <string>
+#include <string_view>
+#include <utility>
 #include "types.h"
 
 lptr apply(const MultiArg& args);
+lptr funcall(lptr f, const MultiArg& args);
 lptr eval(const MultiArg& args);
 lptr evlis(lptr);
 lptr begin(const MultiArg&);
 lptr begin_new_env(const MultiArg&);
 lptr begin_c(lptr);
 lptr begin_new_env_c(lptr);
-lptr intern_c(const std::string&);
+lptr begin_bind_c(lptr var, lptr val, lptr body);
+lptr intern_c(std::string_view);
 lptr intern(lptr);
 lptr symbol_value(fscope*, lptr);
 
 void lisp_init();
+void capture_env(fscope*);
+
+// arithmetic
+lptr plus(const MultiArg& arg);
+lptr minus(const MultiArg& arg);
+lptr mult(const MultiArg& arg);
+lptr l_div(const MultiArg& arg);
+lptr num_lt(const MultiArg& arg);
+lptr num_gt(const MultiArg& arg);
+lptr num_le(const MultiArg& arg);
+lptr num_ge(const MultiArg& arg);
+lptr num_eq(const MultiArg& arg);
+lptr l_if(const MultiArg& args);
+
+// forms and primitives the optimizer knows
+lptr lwhile(const MultiArg& args);
+lptr lambda(const MultiArg& args);
+lptr ldefine(const MultiArg& args);
+lptr setf(const MultiArg& args);
+lptr car(lptr v);
+lptr cdr(lptr v);
+lptr nullp(lptr a);
+lptr pairp(lptr a);
+lptr numberp(lptr a);
+lptr integerp(lptr a);
+lptr symbolp(lptr a);
+lptr stringp(lptr a);
+
+// optimizer
+void optimize_func(func* F);
+lptr func_body(func* F);
+
+// non-local exits and errors
+lptr lreturn(lptr v);
+lptr lcatch(const MultiArg& args);
+lptr lthrow(const MultiArg& args);
+lptr lblock(const MultiArg& args);
+lptr return_from(const MultiArg& args);
+lptr call_ec(lptr f);
+lptr escape_call(func* k, const MultiArg& args);
+lptr lerror(const MultiArg& args);
+lptr lraise(lptr obj);
+lptr guard(const MultiArg& args);
+lptr error_objectp(lptr obj);
+lptr error_object_message(lptr obj);
+lptr error_object_irritants(lptr obj);
+
+// macros
+lptr quasiquote(lptr x);
+lptr defmacro(const MultiArg& args);
+lptr define_syntax(const MultiArg& args);
+lptr macroexpand_1(lptr form);
+lptr macro_use(func* M, const MultiArg& args, lptr form);
+
+// records
+using record_proc = lptr(func* F, const MultiArg& args);
+lrecord* lrecord_new(lptr rtd, u32 n);
+lptr define_record_type(const MultiArg& args);
+lptr record_get(func* F, const MultiArg& args);
+
+// what a field accessor does, for eval to do inline
+inline lptr record_get_c(func* F, lptr r)
+{
+	if( r.type() != LTYPE_RECORD || !(r.record()->rtd == F->body) ) throw "record accessor: not a record of its type";
+	return r.record()->slots[F->params.as_int()];
+}
+
+// jit
+extern bool jit_enabled;
+bool jit_call(func* F, const MultiArg& args, lptr& res);
+const std::vector<func*>& jit_deps(func* F);
+void jit_release(func* F);
+
+// heap objects are allocated through lnew so the current isolate owns them.
+// heap_new also counts the allocation, heap_track just takes the object on
+void heap_track(lobj*);
+void heap_new(lobj*, size_t bytes);
+
+// bytes an allocation counts for, the object and any buffer it comes with
+template<typename T> inline size_t heap_size(const T*) { return sizeof(T); }
+inline size_t heap_size(const lstr* s) { return sizeof(lstr) + (s->flat_text() ? s->len + 1 : 0); }
+inline size_t heap_size(const lbytes* b) { return sizeof(lbytes) + (b->owned ? b->len : 0); }
+
+template<typename T, typename... Args>
+T* lnew(Args&&... args)
+{
+	T* o = new T(std::forward<Args>(args)...);
+	heap_new((lobj*)o, heap_size(o));
+	return o;
+}
 
 
 // IO
@@ -24,6 +118,103 @@ lptr peek_char(const MultiArg& args);
 lptr read_char(const MultiArg& args);
 lptr lread(const MultiArg& args);
 lptr lwrite(const MultiArg& args);
+bool lstream_at_eof(lptr port);
+lptr lclose(lptr port);
+lptr write_char(const MultiArg& args);
+void lstream_write_string(lptr stream, const std::string_view SV);
+
+// sockets
+int socket_peek(lstream* S);
+int socket_get(lstream* S);
+void socket_send(lstream* S, std::string_view data);
+void socket_close(lstream* S);
+lptr tcp_listen(const MultiArg& args);
+lptr tcp_connect(const MultiArg& args);
+lptr unix_listen(lptr path);
+lptr unix_connect(lptr path);
+lptr socket_accept(lptr listener);
+lptr socket_read(lptr s);
+lptr socket_write(const MultiArg& args);
+lptr on_readable(const MultiArg& args);
+lptr run_event_loop();
+lptr stop_event_loop();
+
+// ffi
+lptr create_ffi_func(const MultiArg& args);
+lptr foreign_call(func* F, const MultiArg& args);
+void foreign_release(func* F);
+lptr foreign_symbol(const MultiArg& args);
+
+// bytevectors
+lptr bytes_wrap(u8* data, size_t len, bytes_finalizer* fin, void* ctx);
+lptr make_bytes(const MultiArg& args);
+lptr bytes_length(lptr b);
+lptr bytes_ref(const MultiArg& args);
+lptr bytes_set(const MultiArg& args);
+lptr bytes_pointer(lptr b);
+lptr bytes_pin(lptr b);
+lptr bytes_unpin(lptr b);
+lptr lbytes_wrap(const MultiArg& args);
+lptr string_to_bytes(lptr s);
+lptr bytes_to_string(lptr b);
+
+// green threads
+lptr spawn(const MultiArg& args);
+lptr yield();
+lptr lsleep(lptr ms);
+
+// parallel
+lptr future(const MultiArg& args);
+lptr touch(lptr f);
+lptr pmap(const MultiArg& args);
+
+// gc
+lptr lgc();
+lptr gc_stats();
+lptr gc_incremental(lptr budget);
+
+// stats
+lptr ltime(const MultiArg& args);
+lptr runtime_stats();
+lptr profile_start(const MultiArg& args);
+lptr profile_stop(const MultiArg& args);
+uintptr_t profile_frame(func* F);
+std::string profile_frame_name(uintptr_t f);
+lptr trace_start(const MultiArg& args);
+lptr trace_stop(const MultiArg& args);
+u64 trace_finish(const char* path);
+lptr trace_mark(lptr what);
+
+// strings
+lptr string_length(lptr s);
+lptr string_ref(const MultiArg& args);
+lptr substring(const MultiArg& args);
+lptr string_append(const MultiArg& args);
+
+// heap snapshots
+void symbol_stats(u64& count, u64& bytes);
+void heap_note_site(lobj* o);
+lptr heap_snapshot(lptr path);
+lptr heap_track_sites(lptr on);
+
+// source positions
+u32 source_file(std::string_view name);
+u64 source_pack(u32 file, u32 line, u32 col);
+std::string source_describe(u64 pos);
+void source_note(lptr x, u64 pos);
+u64 source_pos(lptr x);
+lptr source_position(lptr x);
+lptr lload(lptr path);
+void error_site_note(func* F);
+void error_site_clear();
+std::string error_site();
+
+// channels
+lptr freeze(lptr obj);
+lptr frozenp(lptr obj);
+lptr make_channel(const MultiArg& args);
+lptr channel_send(const MultiArg& args);
+lptr channel_receive(lptr ch);
 
 
 
@@ -0,0 +1,606 @@
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include "types.h"
+#include "funcs.h"
+#include "isolate.h"
+
+// Mark and sweep collector.
+//
+// Marking sets LGC_MARK in each object's header with an atomic or, so several
+// markers can share one heap. Every marker works off its own private stack;
+// when that stack grows past two chunks the oldest chunk is moved to the
+// marker's shared deque, where markers that run dry can steal it.
+//
+// Sweeping is lazy. The collection only marks, then the heap is swept a few
+// objects at a time as the mutator allocates (or all at once when the next
+// collection starts), so the pause is just the mark.
+//
+// In incremental mode the mark itself is spread out too. A cycle starts at a
+// safepoint by graying the roots, then bounded slices of marking run every few
+// hundred allocations until the gray stack is empty. This is snapshot at the
+// beginning marking: gc_write_barrier grays whatever a heap reference pointed
+// at before it's overwritten, and objects allocated during the cycle start out
+// black, so everything reachable when the cycle began gets marked no matter
+// what the mutator does in the meantime.
+
+const size_t GC_MIN_COLLECT = 1<<16;       // never collect a heap smaller than this
+const size_t GC_PARALLEL_MIN = 1<<18;      // heaps smaller than this are marked by one thread
+const size_t GC_MARK_CHUNK = 256;
+
+const u32 GC_SLICE_EVERY = 256;            // allocations between incremental slices
+const size_t GC_RECENT_PAUSES = 1024;      // pauses kept for percentiles
+
+gc_state::gc_state() : next_collect(GC_MIN_COLLECT), requested(false), sweep_pos(0), sweep_end(0), sweep_live(0),
+		marking(false), incremental(false), budget_us(1000), alloc_ticks(0), cycle_marked(0),
+		collections(0), total_pause_us(0), max_pause_us(0), pause_hist{}, recent_pos(0) {}
+
+void lobj_free(lobj* o)
+{
+	switch( o->type & ~LOBJ_FLAGS )
+	{
+	case LTYPE_CONS: delete (cons*)o; break;
+	case LTYPE_FUNC:
+		if( ((func*)o)->flags & LFUNC_FFI ) foreign_release((func*)o);
+		if( ((func*)o)->jit ) jit_release((func*)o);
+		delete (func*)o;
+		break;
+	case LTYPE_STR: delete (lstr*)o; break;
+	case LTYPE_ENV: delete (fscope*)o; break;
+	case LTYPE_STREAM: delete (lstream*)o; break;
+	case LTYPE_FUTURE: delete (lfuture*)o; break;
+	case LTYPE_CHANNEL: delete (lchannel*)o; break;
+	case LTYPE_BYTES: delete (lbytes*)o; break;
+	case LTYPE_RECORD: ::operator delete(o); break; // slots need no destructor
+	}
+	return;
+}
+
+static inline lobj* heap_obj(lobj* o)
+{
+	return o;
+}
+
+static inline lobj* heap_obj(lptr p)
+{
+	u64 t = p.val & 7;
+	if( t != LTYPE_CONS && t != LTYPE_FUNC && t != LTYPE_OBJ ) return nullptr;
+	return (lobj*)(p.val & ~7);
+}
+
+// true if this call is the one that marked o. frozen objects are shared by
+// every isolate and never collected, so they're left alone.
+static inline bool gc_try_mark(lobj* o)
+{
+	if( o->type & LGC_FROZEN ) return false;
+	return !(__atomic_fetch_or(&o->type, (u32)LGC_MARK, __ATOMIC_RELAXED) & (u32)LGC_MARK);
+}
+
+struct gc_marker
+{
+	gc_marker() : marked(0), nshared(0) {}
+
+	std::vector<lobj*> stack;
+	size_t marked;
+	std::mutex lock;
+	std::deque<std::vector<lobj*>> shared;
+	std::atomic<size_t> nshared;
+};
+
+struct gc_mark_job
+{
+	gc_mark_job(int n) : markers(n), idle(n-1) {}
+
+	std::vector<gc_marker> markers;
+	std::atomic<int> idle;
+};
+
+static inline void gc_push(std::vector<lobj*>& stack, lobj* o)
+{
+	if( o && gc_try_mark(o) ) stack.push_back(o);
+	return;
+}
+
+static inline void gc_push(std::vector<lobj*>& stack, lptr p)
+{
+	gc_push(stack, heap_obj(p));
+	return;
+}
+
+// calls f with each heap reference in o, an lptr or an lobj* that may be null
+template<typename Fn>
+static inline void gc_each_child(lobj* o, Fn f)
+{
+	switch( o->type & ~LOBJ_FLAGS )
+	{
+	case LTYPE_CONS:
+		{
+			cons* c = (cons*)o;
+			f(c->a);
+			f(c->b);
+			break;
+		}
+	case LTYPE_FUNC:
+		{
+			func* F = (func*)o;
+			f((lobj*)F->closure);
+			f(F->params);
+			f(F->body);
+			f(F->pos);
+			f(F->opt);
+			// compiled code calls these directly
+			if( F->jit ) for(func* G : jit_deps(F)) f((lobj*)G);
+			break;
+		}
+	case LTYPE_ENV:
+		{
+			fscope* E = (fscope*)o;
+			f((lobj*)E->parent);
+			f((lobj*)E->F);
+			for(auto& p : E->symbols) f(p.second);
+			for(lptr p : E->position) f(p);
+			break;
+		}
+	case LTYPE_STR:
+		{
+			lstr* S = (lstr*)o;
+			// with text of its own it doesn't need them any more
+			if( S->flat_text() ) break;
+			if( S->kind == LSTR_KIND_SLICE ) f((lobj*)S->slice.parent);
+			if( S->kind == LSTR_KIND_ROPE )
+			{
+				f((lobj*)S->rope.left);
+				f((lobj*)S->rope.right);
+			}
+			break;
+		}
+	case LTYPE_RECORD:
+		{
+			lrecord* R = (lrecord*)o;
+			f(R->rtd);
+			for(u32 i = 0; i < R->n; ++i) f(R->slots[i]);
+			break;
+		}
+	case LTYPE_FUTURE:
+		{
+			lfuture* F = (lfuture*)o;
+			f((lobj*)F->env);
+			f(F->expr);
+			f(F->value);
+			break;
+		}
+	}
+	return;
+}
+
+static void gc_trace(std::vector<lobj*>& stack, lobj* o)
+{
+	gc_each_child(o, [&](auto p) { gc_push(stack, p); });
+	return;
+}
+
+static bool gc_take_chunk(gc_marker& M, std::vector<lobj*>& stack)
+{
+	if( M.nshared.load(std::memory_order_relaxed) == 0 ) return false;
+
+	std::lock_guard<std::mutex> guard(M.lock);
+	if( M.shared.empty() ) return false;
+	stack = std::move(M.shared.back());
+	M.shared.pop_back();
+	M.nshared--;
+	return true;
+}
+
+static bool gc_steal(gc_mark_job& J, int self, std::vector<lobj*>& stack)
+{
+	int n = J.markers.size();
+	for(int i = 1; i < n; ++i)
+	{
+		if( gc_take_chunk(J.markers[(self+i)%n], stack) ) return true;
+	}
+	return false;
+}
+
+// the local root chains of every stack of this isolate: the one we're on and
+// any switched out green thread (or the thread itself, if a green thread is
+// running). scopes of calls in progress are only on these chains, not in the
+// heap.
+static void gc_local_chains(Isolate* I, std::vector<local_roots*>& chains, std::vector<lptr>& vals)
+{
+	chains.push_back(local_roots_top);
+	green_suspended_roots(I, chains, vals);
+	return;
+}
+
+// calls f(kind, name, p) with each root: "stack" for whatever calls in
+// progress hold, "global" with the symbol for each global binding, "port" and
+// "event-loop"
+template<typename Fn>
+static void gc_each_root(Isolate* I, Fn f)
+{
+	std::vector<local_roots*> chains;
+	std::vector<lptr> vals;
+	gc_local_chains(I, chains, vals);
+	for(local_roots* r : chains)
+	{
+		for(; r; r = r->up)
+		{
+			f("stack", nullptr, (lobj*)r->env);
+			for(size_t i = 0; i < r->n; ++i) f("stack", nullptr, r->vals[i]);
+		}
+	}
+	for(lptr p : vals) f("stack", nullptr, p);
+
+	// first_fscope lives in the isolate, so it's scanned rather than marked
+	for(auto& p : I->first_fscope.symbols) f("global", p.first, p.second);
+	f("port", nullptr, I->lisp_in_stream);
+	f("port", nullptr, I->lisp_out_stream);
+	// sockets the event loop is watching and their callbacks
+	event_loop_roots(I, [&](lptr p) { f("event-loop", nullptr, p); });
+	return;
+}
+
+static void gc_push_roots(Isolate* I, std::vector<lobj*>& stack)
+{
+	gc_each_root(I, [&](const char*, symbol*, auto p) { gc_push(stack, p); });
+	return;
+}
+
+// the same walk for things that want the heap's shape rather than to mark it,
+// see heap.cpp. frozen objects are skipped, as marking skips them
+void gc_walk_children(lobj* o, const std::function<void(lobj*)>& fn)
+{
+	gc_each_child(o, [&](auto p) {
+		lobj* c = heap_obj(p);
+		if( c && !(c->type & LGC_FROZEN) ) fn(c);
+	});
+	return;
+}
+
+void gc_walk_roots(Isolate* I, const std::function<void(const char*, symbol*, lobj*)>& fn)
+{
+	gc_each_root(I, [&](const char* kind, symbol* name, auto p) {
+		lobj* c = heap_obj(p);
+		if( c && !(c->type & LGC_FROZEN) ) fn(kind, name, c);
+	});
+	return;
+}
+
+static void gc_mark_worker(gc_mark_job& J, int self)
+{
+	gc_marker& M = J.markers[self];
+	int n = J.markers.size();
+
+	// everybody but marker 0, which starts with the roots, starts out idle
+	bool idle = self != 0;
+
+	while( true )
+	{
+		if( !idle )
+		{
+			while( !M.stack.empty() )
+			{
+				lobj* o = M.stack.back();
+				M.stack.pop_back();
+				M.marked++;
+				gc_trace(M.stack, o);
+
+				if( n > 1 && M.stack.size() > 2*GC_MARK_CHUNK )
+				{
+					std::vector<lobj*> chunk(M.stack.begin(), M.stack.begin() + GC_MARK_CHUNK);
+					M.stack.erase(M.stack.begin(), M.stack.begin() + GC_MARK_CHUNK);
+					std::lock_guard<std::mutex> guard(M.lock);
+					M.shared.push_front(std::move(chunk));
+					M.nshared++;
+				}
+			}
+
+			if( gc_take_chunk(M, M.stack) ) continue;
+
+			idle = true;
+			J.idle++;
+		}
+
+		// nobody has work left, and with everyone idle nobody can make more
+		if( J.idle.load() == n ) return;
+
+		J.idle--;
+		if( gc_steal(J, self, M.stack) )
+		{
+			idle = false;
+			continue;
+		}
+		J.idle++;
+		std::this_thread::yield();
+	}
+}
+
+// returns the number of objects marked
+static size_t gc_mark(Isolate* I)
+{
+	int n = 1;
+	if( I->heap.size() >= GC_PARALLEL_MIN ) n = pool_size(I) + 1;
+
+	gc_mark_job J(n);
+	gc_push_roots(I, J.markers[0].stack);
+
+	if( n == 1 )
+		gc_mark_worker(J, 0);
+	else
+		pool_parallel(I, n, [&](int i) { gc_mark_worker(J, i); });
+
+	size_t marked = 0;
+	for(gc_marker& M : J.markers) marked += M.marked;
+	return marked;
+}
+
+void gc_sweep_step(Isolate* I, size_t n)
+{
+	gc_state& G = I->gc;
+	std::vector<lobj*>& H = I->heap;
+
+	size_t end = std::min(G.sweep_end, G.sweep_pos + n);
+	for(; G.sweep_pos < end; ++G.sweep_pos)
+	{
+		lobj* o = H[G.sweep_pos];
+		if( o->type & LGC_TYPE_MASK )
+		{
+			o->type &= ~LGC_MARK;
+			H[G.sweep_live++] = o;
+		} else {
+			if( o->type & LOBJ_HAS_POS ) I->positions.erase(o);
+			if( o->type & LOBJ_HAS_SITE ) I->alloc_sites.erase(o);
+			lobj_free(o);
+		}
+	}
+
+	if( G.sweep_pos == G.sweep_end )
+	{
+		// close the gap; anything allocated since the mark sits past sweep_end
+		H.erase(H.begin() + G.sweep_live, H.begin() + G.sweep_end);
+		G.sweep_pos = G.sweep_end = G.sweep_live = 0;
+	}
+	return;
+}
+
+void gc_finish_sweep(Isolate* I)
+{
+	if( I->gc.sweep_end ) gc_sweep_step(I, I->gc.sweep_end);
+	return;
+}
+
+static u64 gc_elapsed_us(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void gc_record_pause(gc_state& G, u64 us)
+{
+	int bucket = 0;
+	while( bucket < 31 && (1ull<<(bucket+1)) <= us ) bucket++;
+	G.pause_hist[bucket]++;
+	G.total_pause_us += us;
+	G.max_pause_us = std::max(G.max_pause_us, us);
+
+	if( G.recent_pauses.size() < GC_RECENT_PAUSES )
+		G.recent_pauses.push_back(us);
+	else
+		G.recent_pauses[G.recent_pos++ % GC_RECENT_PAUSES] = us;
+	return;
+}
+
+// marking is over; everything in the heap now is either marked or garbage
+static void gc_start_sweep(Isolate* I, size_t live)
+{
+	gc_state& G = I->gc;
+	G.sweep_pos = G.sweep_live = 0;
+	G.sweep_end = I->heap.size();
+	G.requested = false;
+
+	// scopes of calls in progress aren't in the heap, so the sweep won't clear
+	// their mark. they must start the next cycle unmarked like everything else.
+	std::vector<local_roots*> chains;
+	std::vector<lptr> vals;
+	gc_local_chains(I, chains, vals);
+	for(local_roots* r : chains)
+	{
+		for(; r; r = r->up)
+		{
+			if( r->env ) r->env->type &= ~LGC_MARK;
+		}
+	}
+
+	G.next_collect = std::max(GC_MIN_COLLECT, live*2);
+	G.collections++;
+	return;
+}
+
+void gc_log_overwrite(Isolate* I, lptr old)
+{
+	lobj* o = heap_obj(old);
+	if( !o || !gc_try_mark(o) ) return;
+
+	gc_state& G = I->gc;
+	if( current_heap == &I->heap )
+	{
+		G.gray.push_back(o);
+	} else {
+		std::lock_guard<std::mutex> guard(G.log_lock);
+		G.barrier_log.push_back(o);
+	}
+	return;
+}
+
+static void gc_start_cycle(Isolate* I)
+{
+	gc_state& G = I->gc;
+	trace_span span(TRACE_GC, "gc-start-cycle");
+	auto start = std::chrono::steady_clock::now();
+
+	gc_finish_sweep(I);
+	gc_push_roots(I, G.gray);
+	G.cycle_marked = 0;
+	G.alloc_ticks = 0;
+	G.marking = true;
+
+	gc_record_pause(G, gc_elapsed_us(start));
+	return;
+}
+
+// runs one slice of incremental marking, for at most budget_us unless
+// 'finish' is set. pool tasks can be mutating frames we'd trace, so nothing
+// happens while any are running.
+static void gc_mark_slice(Isolate* I, bool finish)
+{
+	gc_state& G = I->gc;
+	if( !pool_idle(I) ) return;
+
+	trace_span span(TRACE_GC, "gc-mark-slice");
+	auto start = std::chrono::steady_clock::now();
+	{
+		std::lock_guard<std::mutex> guard(G.log_lock);
+		G.gray.insert(G.gray.end(), G.barrier_log.begin(), G.barrier_log.end());
+		G.barrier_log.clear();
+	}
+
+	size_t n = 0;
+	while( !G.gray.empty() )
+	{
+		lobj* o = G.gray.back();
+		G.gray.pop_back();
+		gc_trace(G.gray, o);
+		if( (++n & 63) == 0 && !finish && gc_elapsed_us(start) >= G.budget_us ) break;
+	}
+	G.cycle_marked += n;
+
+	if( G.gray.empty() )
+	{
+		// objects workers allocated during the cycle are already black
+		pool_collect_heaps(I);
+		G.marking = false;
+		gc_start_sweep(I, G.cycle_marked);
+	}
+
+	gc_record_pause(G, gc_elapsed_us(start));
+	return;
+}
+
+void gc_alloc_tick(Isolate* I)
+{
+	gc_state& G = I->gc;
+	if( G.sweep_end )
+		gc_sweep_step(I, 16);
+	else if( G.marking && ++G.alloc_ticks % GC_SLICE_EVERY == 0 )
+		gc_mark_slice(I, false);
+	return;
+}
+
+void gc_collect(Isolate* I)
+{
+	gc_state& G = I->gc;
+
+	// an incremental cycle in progress just runs to the end
+	if( G.marking )
+	{
+		gc_mark_slice(I, true);
+		return;
+	}
+
+	trace_span span(TRACE_GC, "gc-collect");
+	auto start = std::chrono::steady_clock::now();
+
+	pool_collect_heaps(I);
+	gc_finish_sweep(I);
+	gc_start_sweep(I, gc_mark(I));
+
+	gc_record_pause(G, gc_elapsed_us(start));
+	return;
+}
+
+void gc_safepoint(Isolate* I)
+{
+	gc_state& G = I->gc;
+	if( !pool_idle(I) ) return;
+
+	if( G.marking )
+	{
+		if( G.requested )
+			gc_collect(I);
+		else
+			gc_mark_slice(I, false);
+		return;
+	}
+
+	pool_collect_heaps(I);
+	// slots between sweep_live and sweep_pos have already been freed
+	size_t size = I->heap.size() - (G.sweep_pos - G.sweep_live);
+	if( !G.requested && size < G.next_collect ) return;
+
+	if( !G.incremental || G.requested )
+	{
+		gc_collect(I);
+		return;
+	}
+
+	// don't let the rest of the last sweep land in the new cycle's first pause
+	if( G.sweep_end )
+	{
+		trace_span span(TRACE_GC, "gc-sweep");
+		auto start = std::chrono::steady_clock::now();
+		while( G.sweep_end && gc_elapsed_us(start) < G.budget_us ) gc_sweep_step(I, 1024);
+		gc_record_pause(G, gc_elapsed_us(start));
+		if( G.sweep_end ) return;
+	}
+
+	gc_start_cycle(I);
+	return;
+}
+
+lptr lgc()
+{
+	current_isolate->gc.requested = true;
+	return lptr();
+}
+
+// (gc-incremental budget-us) switches to incremental marking with slices of
+// at most budget-us; (gc-incremental nil) goes back to stop the world
+lptr gc_incremental(lptr budget)
+{
+	gc_state& G = current_isolate->gc;
+	if( budget.type() == LTYPE_INT )
+	{
+		G.incremental = true;
+		G.budget_us = std::max<s64>(1, (s64)budget.as_int());
+		return budget;
+	}
+
+	G.incremental = false;
+	return lptr();
+}
+
+lptr gc_stats()
+{
+	gc_state& G = current_isolate->gc;
+
+	std::vector<u64> sorted(G.recent_pauses.begin(), G.recent_pauses.end());
+	std::sort(sorted.begin(), sorted.end());
+	u64 p99 = sorted.empty() ? 0 : sorted[(sorted.size()-1) * 99 / 100];
+
+	lptr hist;
+	int last = 31;
+	while( last > 0 && !G.pause_hist[last] ) last--;
+	for(int i = last; i >= 0; --i) hist = lnew<cons>(lptr((u64)G.pause_hist[i]), hist);
+
+	auto entry = [](const char* name, lptr v) { return lptr(lnew<cons>(intern_c(name), v)); };
+	return lnew<cons>(entry("collections", (u64)G.collections),
+		lnew<cons>(entry("heap-objects", (u64)current_isolate->heap.size()),
+		lnew<cons>(entry("total-pause-us", (u64)G.total_pause_us),
+		lnew<cons>(entry("max-pause-us", (u64)G.max_pause_us),
+		lnew<cons>(entry("p99-pause-us", (u64)p99),
+		lnew<cons>(entry("incremental", G.incremental ? lptr((u64)G.budget_us) : lptr()),
+		lnew<cons>(entry("pause-histogram", hist), lptr())))))));
+}
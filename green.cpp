@@ -0,0 +1,372 @@
+#include <vector>
+#include <deque>
+#include <queue>
+#include <unordered_set>
+#include <iostream>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include "types.h"
+#include "funcs.h"
+#include "isolate.h"
+
+// AddressSanitizer has to be told when the stack changes under it, or it takes
+// a green thread's stack for a broken main one and can't unwind across it
+#if defined(__SANITIZE_ADDRESS__)
+#define GREEN_ASAN 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define GREEN_ASAN 1
+#endif
+#endif
+#ifdef GREEN_ASAN
+#include <sanitizer/common_interface_defs.h>
+#define asan_switch_start(save, bottom, size) __sanitizer_start_switch_fiber(save, bottom, size)
+#define asan_switch_finish(save, bottom, size) __sanitizer_finish_switch_fiber(save, bottom, size)
+#else
+#define asan_switch_start(save, bottom, size) ((void)(save), (void)(bottom), (void)(size))
+#define asan_switch_finish(save, bottom, size) ((void)(save), (void)(bottom), (void)(size))
+#endif
+
+// Green threads: (spawn f args...) runs (f args...) on a small stack of its
+// own, switched to and from with ucontext by the isolate's own thread, so a
+// green thread is a one-shot continuation that gets resumed until it returns.
+//
+// A green thread gives up the processor when it yields, sleeps, or when a
+// socket read or write would block; then it's parked and the event loop wakes
+// it once its timer expires or its fd is ready. Stacks are reserved but only
+// touched pages get memory, so an idle connection handler costs a few KB.
+//
+// While a thread is switched out its C++ frames aren't visible to anybody, so
+// global_scope and the local_roots and escape_frame chains are swapped along
+// with the stack, which is what lets the collector run with threads parked.
+
+extern lptr global_T;
+
+const size_t GREEN_STACK_SIZE = 256*1024;
+const size_t GREEN_STACK_CACHE = 256; // stacks of finished threads kept for reuse
+const u32 GREEN_QUANTUM = 16;          // I/O calls that didn't block before a forced yield
+
+struct green_thread
+{
+	ucontext_t ctx;
+	char* stack;
+	lptr fn;
+	std::vector<lptr> args;
+	fscope* scope;      // global_scope while switched out
+	local_roots* roots; // local_roots_top while switched out
+	escape_frame* escapes; // escape_top while switched out
+	u32 ticks;
+	bool done;
+	bool cancel; // unwind instead of carrying on when next resumed
+	void* asan_stack; // the sanitizer's, while switched out
+};
+
+// thrown out of green_park in a cancelled thread, see green_destroy
+struct green_cancel {};
+
+struct green_timer
+{
+	s64 at;
+	u64 seq; // keeps threads sleeping for the same time in order
+	green_thread* T;
+
+	bool operator>(const green_timer& b) const { return at > b.at || (at == b.at && seq > b.seq); }
+};
+
+struct green_sched
+{
+	green_sched() : running(nullptr), main_scope(nullptr), main_roots(nullptr), main_escapes(nullptr), timer_seq(0),
+		main_stack(nullptr), main_stack_size(0) {}
+
+	ucontext_t main_ctx;
+	green_thread* running;
+	fscope* main_scope;
+	local_roots* main_roots;
+	escape_frame* main_escapes;
+	std::deque<green_thread*> ready;
+	std::priority_queue<green_timer, std::vector<green_timer>, std::greater<green_timer>> sleepers;
+	std::unordered_set<green_thread*> threads; // every thread that hasn't finished
+	std::vector<char*> free_stacks;
+	u64 timer_seq;
+	const void* main_stack; // for the sanitizer's benefit
+	size_t main_stack_size;
+};
+
+static green_sched* sched_get(Isolate* I)
+{
+	if( !I->green ) I->green = new green_sched;
+	return I->green;
+}
+
+static char* stack_alloc(green_sched* S)
+{
+	if( !S->free_stacks.empty() )
+	{
+		char* st = S->free_stacks.back();
+		S->free_stacks.pop_back();
+		return st;
+	}
+
+	void* mem = mmap(nullptr, GREEN_STACK_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE|MAP_STACK, -1, 0);
+	if( mem == MAP_FAILED ) throw "spawn: out of memory for stacks";
+	// guard page, so running off the end faults instead of scribbling on a neighbour
+	mprotect(mem, 4096, PROT_NONE);
+	return (char*) mem;
+}
+
+static void stack_free(green_sched* S, char* st)
+{
+	if( S->free_stacks.size() < GREEN_STACK_CACHE )
+	{
+		// give back whatever a deep call touched
+		madvise(st + 4096, GREEN_STACK_SIZE - 4096, MADV_DONTNEED);
+		S->free_stacks.push_back(st);
+		return;
+	}
+	munmap(st, GREEN_STACK_SIZE);
+	return;
+}
+
+static void green_entry()
+{
+	green_sched* S = current_isolate->green;
+	green_thread* T = S->running;
+	asan_switch_finish(nullptr, &S->main_stack, &S->main_stack_size);
+	try {
+		if( !T->cancel ) funcall(T->fn, T->args);
+	} catch(const char* e) {
+		std::cerr << "green thread: " << e << std::endl;
+	} catch(const green_cancel&) {
+	} catch(...) {
+		std::cerr << "green thread: uncaught exception" << std::endl;
+	}
+	T->done = true;
+	// returning resumes main_ctx through uc_link
+	asan_switch_start(nullptr, S->main_stack, S->main_stack_size);
+}
+
+// runs T until it parks or finishes
+static void switch_to(green_sched* S, green_thread* T)
+{
+	S->main_scope = global_scope;
+	S->main_roots = local_roots_top;
+	S->main_escapes = escape_top;
+	global_scope = T->scope;
+	local_roots_top = T->roots;
+	escape_top = T->escapes;
+	S->running = T;
+
+	void* asan_stack = nullptr;
+	asan_switch_start(&asan_stack, T->stack, GREEN_STACK_SIZE);
+	swapcontext(&S->main_ctx, &T->ctx);
+	asan_switch_finish(asan_stack, nullptr, nullptr);
+
+	S->running = nullptr;
+	global_scope = S->main_scope;
+	local_roots_top = S->main_roots;
+	escape_top = S->main_escapes;
+
+	if( T->done )
+	{
+		S->threads.erase(T);
+		stack_free(S, T->stack);
+		delete T;
+	}
+	return;
+}
+
+green_thread* green_self(Isolate* I)
+{
+	return I->green ? I->green->running : nullptr;
+}
+
+// switches back to the scheduler. the caller has arranged for somebody to
+// green_wake it, and returns once that has happened and its turn comes.
+void green_park(Isolate* I)
+{
+	green_sched* S = I->green;
+	green_thread* T = S->running;
+	T->scope = global_scope;
+	T->roots = local_roots_top;
+	T->escapes = escape_top;
+	T->ticks = 0;
+	asan_switch_start(&T->asan_stack, S->main_stack, S->main_stack_size);
+	swapcontext(&T->ctx, &S->main_ctx);
+	asan_switch_finish(T->asan_stack, &S->main_stack, &S->main_stack_size);
+	if( T->cancel ) throw green_cancel();
+	return;
+}
+
+// called when a green thread did I/O without having to wait. a connection whose
+// peer keeps up would otherwise never let the others run.
+void green_tick(Isolate* I)
+{
+	green_thread* T = green_self(I);
+	if( !T || ++T->ticks < GREEN_QUANTUM ) return;
+
+	green_wake(I, T);
+	green_park(I);
+	return;
+}
+
+void green_wake(Isolate* I, green_thread* T)
+{
+	I->green->ready.push_back(T);
+	return;
+}
+
+// runs every thread that's ready, including sleepers whose time has come.
+// threads that become ready meanwhile wait for the next call. returns true if
+// any thread is left waiting for a timer or for another turn.
+bool green_run(Isolate* I)
+{
+	green_sched* S = I->green;
+	if( !S ) return false;
+
+	s64 now = event_loop_now_ms();
+	while( !S->sleepers.empty() && S->sleepers.top().at <= now )
+	{
+		S->ready.push_back(S->sleepers.top().T);
+		S->sleepers.pop();
+	}
+
+	for(size_t n = S->ready.size(); n > 0; --n)
+	{
+		green_thread* T = S->ready.front();
+		S->ready.pop_front();
+		switch_to(S, T);
+	}
+
+	return !S->ready.empty() || !S->sleepers.empty();
+}
+
+// how long the event loop may block before a thread wants to run, -1 if none will
+int green_timeout_ms(Isolate* I)
+{
+	green_sched* S = I->green;
+	if( !S ) return -1;
+	if( !S->ready.empty() ) return 0;
+	if( S->sleepers.empty() ) return -1;
+	return (int) std::max<s64>(0, S->sleepers.top().at - event_loop_now_ms());
+}
+
+void green_destroy(Isolate* I)
+{
+	green_sched* S = I->green;
+	if( !S ) return;
+
+	// threads still parked are resumed to unwind, so the scopes and frames on
+	// their stacks are let go of. the isolate may not be current here
+	{
+		isolate_scope scope(I);
+		std::vector<green_thread*> parked(S->threads.begin(), S->threads.end());
+		for(green_thread* T : parked)
+		{
+			T->cancel = true;
+			switch_to(S, T);
+		}
+	}
+	// anything that parked again on the way out is just dropped
+	for(green_thread* T : S->threads)
+	{
+		munmap(T->stack, GREEN_STACK_SIZE);
+		delete T;
+	}
+	for(char* st : S->free_stacks) munmap(st, GREEN_STACK_SIZE);
+	delete S;
+	I->green = nullptr;
+	return;
+}
+
+void green_suspended_roots(Isolate* I, std::vector<local_roots*>& chains, std::vector<lptr>& vals)
+{
+	green_sched* S = I->green;
+	if( !S ) return;
+
+	// with a green thread running, the isolate's own stack is the one switched out
+	if( S->running )
+	{
+		chains.push_back(S->main_roots);
+		vals.push_back(S->main_scope);
+	}
+
+	for(green_thread* T : S->threads)
+	{
+		vals.push_back(T->fn);
+		for(lptr a : T->args) vals.push_back(a);
+		if( T == S->running ) continue;
+		chains.push_back(T->roots);
+		vals.push_back(T->scope);
+	}
+	return;
+}
+
+// (spawn f args...) starts running (f args...) in a new green thread the next
+// time the event loop gets a turn
+lptr spawn(const MultiArg& args)
+{
+	if( args.size() == 0 || args[0].type() != LTYPE_FUNC ) return lptr();
+
+	Isolate* I = current_isolate;
+	green_sched* S = sched_get(I);
+
+	green_thread* T = new green_thread;
+	T->stack = stack_alloc(S);
+	T->fn = args[0];
+	for(size_t i = 1; i < args.size(); ++i) T->args.push_back(args[i]);
+	T->scope = &I->first_fscope;
+	T->roots = nullptr;
+	T->escapes = nullptr;
+	T->ticks = 0;
+	T->done = false;
+	T->cancel = false;
+	T->asan_stack = nullptr;
+
+	getcontext(&T->ctx);
+	T->ctx.uc_stack.ss_sp = T->stack;
+	T->ctx.uc_stack.ss_size = GREEN_STACK_SIZE;
+	T->ctx.uc_link = &S->main_ctx;
+	makecontext(&T->ctx, green_entry, 0);
+
+	S->threads.insert(T);
+	S->ready.push_back(T);
+	return global_T;
+}
+
+// lets every other ready green thread run. outside a green thread it gives
+// them all one turn.
+lptr yield()
+{
+	Isolate* I = current_isolate;
+	green_thread* T = green_self(I);
+	if( !T )
+	{
+		event_loop_run(I, event_loop_now_ms());
+		return lptr();
+	}
+
+	green_wake(I, T);
+	green_park(I);
+	return lptr();
+}
+
+// (sleep ms). green threads park, the isolate's own thread runs the event loop
+// until the time is up.
+lptr lsleep(lptr ms)
+{
+	if( ms.type() != LTYPE_INT ) return lptr();
+
+	Isolate* I = current_isolate;
+	s64 at = event_loop_now_ms() + (s64) ms.as_int();
+	green_thread* T = green_self(I);
+	if( !T )
+	{
+		event_loop_run(I, at);
+		return lptr();
+	}
+
+	green_sched* S = I->green;
+	S->sleepers.push(green_timer{at, S->timer_seq++, T});
+	green_park(I);
+	return lptr();
+}
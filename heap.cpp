@@ -0,0 +1,303 @@
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <algorithm>
+#include <stdio.h>
+#include "types.h"
+#include "funcs.h"
+#include "isolate.h"
+
+// What the heap is holding on to.
+//   (heap-snapshot "file")          writes a summary of everything reachable to
+//                                   the file and gives (objects bytes)
+//   (heap-track-sites on)           with on true, notes the func that
+//                                   allocates each object from then on
+//
+// The snapshot counts objects and bytes by type, and for each root (every
+// global binding, the stacks of calls in progress, the ports, the event loop)
+// what it retains: the objects that would go if that root did, found from the
+// dominator tree of the object graph. Something two roots both reach is
+// retained by neither. With site tracking on, reachable objects are also
+// counted by the func that allocated them, named as the profiler names them.
+// atlis_heap summarizes a snapshot, or compares two.
+//
+// The file is text, a line per count, names last since they can have spaces:
+//   atlis-heap-snapshot 1
+//   heap <objects>                  the isolate's heap, garbage not yet swept too
+//   reachable <objects> <bytes>
+//   symbols <count> <bytes>         shared by every isolate, never freed
+//   type <objects> <bytes> <type>
+//   root <objects> <bytes> <root>   retained
+//   site <objects> <bytes> <type> <func>
+//
+// Frozen objects belong to every isolate and aren't counted. Sites are only
+// noted for what the isolate's own thread allocates, and the tracking costs a
+// hash table insert per allocation.
+
+static const uintptr_t SITE_TOPLEVEL = 1;
+extern lptr global_T;
+
+void heap_note_site(lobj* o)
+{
+	uintptr_t site = SITE_TOPLEVEL;
+	jit_frame* J = jit_top;
+	if( J && J->scope == global_scope )
+	{
+		site = profile_frame(J->F);
+	} else {
+		for(fscope* s = global_scope; s; s = s->caller)
+		{
+			if( s->F )
+			{
+				site = profile_frame(s->F);
+				break;
+			}
+		}
+	}
+	o->type |= LOBJ_HAS_SITE;
+	current_isolate->alloc_sites[o] = site;
+	return;
+}
+
+lptr heap_track_sites(lptr on)
+{
+	Isolate* I = current_isolate;
+	lptr was = I->track_sites ? global_T : lptr();
+	I->track_sites = !on.nilp();
+	return was;
+}
+
+static size_t object_size(lobj* o)
+{
+	switch( o->type & ~LOBJ_FLAGS )
+	{
+	case LTYPE_CONS: return sizeof(cons);
+	case LTYPE_FUNC: return sizeof(func);
+	case LTYPE_STR: return heap_size((lstr*)o);
+	case LTYPE_ENV:
+		{
+			fscope* E = (fscope*)o;
+			return sizeof(fscope) + E->symbols.capacity() * sizeof(E->symbols[0]) +
+				E->scope.capacity() * sizeof(int) + E->position.capacity() * sizeof(lptr);
+		}
+	case LTYPE_STREAM:
+		{
+			lstream* S = (lstream*)o;
+			return sizeof(lstream) + S->rbuf.capacity() + S->wbuf.capacity();
+		}
+	case LTYPE_FUTURE: return sizeof(lfuture);
+	case LTYPE_CHANNEL: return sizeof(lchannel);
+	case LTYPE_BYTES: return heap_size((lbytes*)o);
+	case LTYPE_RECORD: return lrecord::size(((lrecord*)o)->n);
+	}
+	return sizeof(lobj);
+}
+
+static std::string site_name(uintptr_t site)
+{
+	return site == SITE_TOPLEVEL ? "<toplevel>" : profile_frame_name(site);
+}
+
+// The object graph as successor lists. Node 0 stands for all the roots,
+// nodes 1..roots are the roots, one per global binding and one per other kind,
+// and the objects come after.
+struct heap_graph
+{
+	std::vector<lobj*> node;
+	std::vector<std::string> label;
+	std::vector<u32> first; // node i's successors are edges[first[i]..first[i+1])
+	std::vector<u32> edges;
+	size_t roots = 0;
+};
+
+static void heap_build(Isolate* I, heap_graph& G)
+{
+	std::vector<std::vector<lobj*>> held;
+	std::unordered_map<std::string, size_t> by_label;
+	gc_walk_roots(I, [&](const char* kind, symbol* name, lobj* o) {
+		std::string label = name ? std::string(kind) + " " + std::string(name->str()) : std::string(kind);
+		auto it = by_label.emplace(label, held.size()).first;
+		if( it->second == held.size() )
+		{
+			held.emplace_back();
+			G.label.push_back(label);
+		}
+		held[it->second].push_back(o);
+	});
+	G.roots = held.size();
+	G.node.assign(G.roots + 1, nullptr);
+
+	std::unordered_map<lobj*, u32> index;
+	auto node_of = [&](lobj* o) {
+		auto it = index.emplace(o, (u32)G.node.size());
+		if( it.second ) G.node.push_back(o);
+		return it.first->second;
+	};
+
+	// breadth first, so each node's successors are found in node order
+	for(size_t i = 0; i < G.node.size(); ++i)
+	{
+		G.first.push_back(G.edges.size());
+		if( i == 0 )
+			for(u32 r = 1; r <= G.roots; ++r) G.edges.push_back(r);
+		else if( i <= G.roots )
+			for(lobj* o : held[i-1]) G.edges.push_back(node_of(o));
+		else
+			gc_walk_children(G.node[i], [&](lobj* c) { G.edges.push_back(node_of(c)); });
+	}
+	G.first.push_back(G.edges.size());
+	return;
+}
+
+// immediate dominators, by the iterative algorithm of Cooper, Harvey and
+// Kennedy. also gives the postorder, which has every node after the nodes it
+// dominates
+static void heap_dominators(const heap_graph& G, std::vector<u32>& idom, std::vector<u32>& post)
+{
+	const u32 NONE = ~0u;
+	size_t n = G.node.size();
+
+	std::vector<u32> number(n, NONE); // postorder number
+	post.clear();
+	post.reserve(n);
+	std::vector<std::pair<u32, u32>> stack = {{0, G.first[0]}};
+	std::vector<bool> seen(n, false);
+	seen[0] = true;
+	while( !stack.empty() )
+	{
+		auto& top = stack.back();
+		if( top.second < G.first[top.first+1] )
+		{
+			u32 next = G.edges[top.second++];
+			if( !seen[next] )
+			{
+				seen[next] = true;
+				stack.push_back({next, G.first[next]});
+			}
+			continue;
+		}
+		number[top.first] = post.size();
+		post.push_back(top.first);
+		stack.pop_back();
+	}
+
+	// predecessor lists
+	std::vector<u32> pfirst(n+1, 0), preds(G.edges.size());
+	for(u32 e : G.edges) pfirst[e+1]++;
+	for(size_t i = 0; i < n; ++i) pfirst[i+1] += pfirst[i];
+	std::vector<u32> fill(pfirst.begin(), pfirst.end()-1);
+	for(size_t v = 0; v < n; ++v)
+	{
+		for(u32 e = G.first[v]; e < G.first[v+1]; ++e) preds[fill[G.edges[e]]++] = v;
+	}
+
+	idom.assign(n, NONE);
+	idom[0] = 0;
+	auto intersect = [&](u32 a, u32 b) {
+		while( a != b )
+		{
+			while( number[a] < number[b] ) a = idom[a];
+			while( number[b] < number[a] ) b = idom[b];
+		}
+		return a;
+	};
+	bool changed = true;
+	while( changed )
+	{
+		changed = false;
+		for(size_t i = post.size(); i-- > 0;)
+		{
+			u32 v = post[i];
+			if( v == 0 ) continue;
+			u32 d = NONE;
+			for(u32 p = pfirst[v]; p < pfirst[v+1]; ++p)
+			{
+				u32 u = preds[p];
+				if( idom[u] == NONE ) continue;
+				d = d == NONE ? u : intersect(u, d);
+			}
+			if( idom[v] != d )
+			{
+				idom[v] = d;
+				changed = true;
+			}
+		}
+	}
+	return;
+}
+
+lptr heap_snapshot(lptr path)
+{
+	if( path.type() != LTYPE_STR ) throw "heap-snapshot: expected a file name";
+	Isolate* I = current_isolate;
+
+	// nothing left in the heap that's already been found dead
+	gc_finish_sweep(I);
+
+	heap_graph G;
+	heap_build(I, G);
+	std::vector<u32> idom, post;
+	heap_dominators(G, idom, post);
+
+	size_t n = G.node.size();
+	std::vector<u64> objects(n, 0), bytes(n, 0);
+	u64 type_objects[16] = {}, type_bytes[16] = {};
+	std::map<std::pair<uintptr_t, u32>, std::pair<u64, u64>> sites;
+	for(size_t i = G.roots + 1; i < n; ++i)
+	{
+		lobj* o = G.node[i];
+		u32 t = o->type & ~LOBJ_FLAGS & 15;
+		objects[i] = 1;
+		bytes[i] = object_size(o);
+		type_objects[t]++;
+		type_bytes[t] += bytes[i];
+
+		if( !(o->type & LOBJ_HAS_SITE) ) continue;
+		auto it = I->alloc_sites.find(o);
+		if( it == I->alloc_sites.end() ) continue;
+		auto& s = sites[{it->second, t}];
+		s.first++;
+		s.second += bytes[i];
+	}
+	// what each node retains is itself and everything it dominates
+	for(u32 v : post)
+	{
+		if( v == 0 ) continue;
+		objects[idom[v]] += objects[v];
+		bytes[idom[v]] += bytes[v];
+	}
+
+	FILE* f = fopen(path.string()->c_str(), "w");
+	if( !f ) throw "heap-snapshot: can't write the snapshot";
+
+	u64 nsyms, sym_bytes;
+	symbol_stats(nsyms, sym_bytes);
+	u64 reachable = n - G.roots - 1;
+	u64 reachable_bytes = 0;
+	for(int t = 0; t < 16; ++t) reachable_bytes += type_bytes[t];
+
+	fprintf(f, "atlis-heap-snapshot 1\n");
+	fprintf(f, "heap %llu\n", (unsigned long long)I->heap.size());
+	fprintf(f, "reachable %llu %llu\n", (unsigned long long)reachable, (unsigned long long)reachable_bytes);
+	fprintf(f, "symbols %llu %llu\n", (unsigned long long)nsyms, (unsigned long long)sym_bytes);
+	for(int t = 0; t < 16; ++t)
+	{
+		if( !type_objects[t] ) continue;
+		fprintf(f, "type %llu %llu %s\n", (unsigned long long)type_objects[t], (unsigned long long)type_bytes[t],
+			heap_type_names[t] ? heap_type_names[t] : "other");
+	}
+	for(size_t r = 1; r <= G.roots; ++r)
+	{
+		fprintf(f, "root %llu %llu %s\n", (unsigned long long)objects[r], (unsigned long long)bytes[r], G.label[r-1].c_str());
+	}
+	for(auto& s : sites)
+	{
+		u32 t = s.first.second;
+		fprintf(f, "site %llu %llu %s %s\n", (unsigned long long)s.second.first, (unsigned long long)s.second.second,
+			heap_type_names[t] ? heap_type_names[t] : "other", site_name(s.first.first).c_str());
+	}
+	fclose(f);
+
+	return lnew<cons>(lptr(reachable), lnew<cons>(lptr(reachable_bytes), lptr()));
+}
@@ -4,11 +4,28 @@
 #include <stdio.h>
 #include "types.h"
 #include "funcs.h"
+#include "isolate.h"
 
-extern lptr lisp_out_stream;
-extern lptr lisp_in_stream;
 extern lptr QUOTE;
 
+void lstream_write_string(lptr stream, const std::string_view SV)
+{
+	lstream* SM = stream.stream();
+
+	if( std::holds_alternative<std::fstream*>(SM->strm) )
+	{
+		*std::get<std::fstream*>(SM->strm) << SV;
+	} else if( std::holds_alternative<std::ostream*>(SM->strm) ) {
+		*std::get<std::ostream*>(SM->strm) << SV;
+	} else if( std::holds_alternative<std::stringstream*>(SM->strm) ) {
+		*std::get<std::stringstream*>(SM->strm) << SV;
+	} else if( std::holds_alternative<int>(SM->strm) ) {
+		socket_send(SM, SV);
+	}
+
+	return;
+}
+
 lptr write_char(const MultiArg& args)
 {
 	if( args.size() == 0 ) return lptr();
@@ -23,38 +40,22 @@ lptr write_char(const MultiArg& args)
 	{
 		S = args[1];
 	} else {
-		S = lisp_out_stream;
+		S = current_isolate->lisp_out_stream;
 	}
 
 	if( S.stream()->flags & LSTREAM_OUT )
 	{
 		char c =(char) args[0].as_int();
-		std::get<std::ostream*>(lisp_out_stream.stream()->strm)->put(c);
+		lstream_write_string(S, std::string_view(&c, 1));
 		return args[0];
 	}
 
 	return lptr();
 }
 
-void lstream_write_string(lptr stream, const std::string_view SV)
-{
-	lstream* SM = stream.stream();
-
-	if( std::holds_alternative<std::fstream*>(SM->strm) )
-	{
-		*std::get<std::fstream*>(SM->strm) << SV;
-	} else if( std::holds_alternative<std::ostream*>(SM->strm) ) {
-		*std::get<std::ostream*>(SM->strm) << SV;
-	} else if( std::holds_alternative<std::stringstream*>(SM->strm) ) {
-		*std::get<std::stringstream*>(SM->strm) << SV;
-	}
-
-	return;
-}
-
 lptr newline(const MultiArg& args)
 {
-	lptr ostr = lisp_out_stream;
+	lptr ostr = current_isolate->lisp_out_stream;
 	if( args.size() > 0 && args[0].type() == LTYPE_STREAM )
 	{
 		ostr = args[0];
@@ -69,7 +70,7 @@ lptr lwrite(const MultiArg& args)
 {
 	if( args.size() == 0 ) return lptr();
 
-	lptr ostr = lisp_out_stream;
+	lptr ostr = current_isolate->lisp_out_stream;
 	if( args.size() > 1 && args[1].type() == LTYPE_STREAM )
 	{
 		ostr = args[1];
@@ -92,12 +93,35 @@ lptr lwrite(const MultiArg& args)
 	{
 	case LTYPE_INT: lstream_write_string(ostr, std::to_string((s64)args[0].as_int())); return ostr;
 	case LTYPE_FLOAT: lstream_write_string(ostr, std::to_string(args[0].as_float())); return ostr;
-	case LTYPE_STR: lstream_write_string(ostr, '"' + args[0].string()->txt + '"'); return ostr;
-	case LTYPE_SYM: lstream_write_string(ostr, args[0].sym()->name); break;
+	case LTYPE_STR:
+		lstream_write_string(ostr, "\"");
+		lstream_write_string(ostr, args[0].string()->str());
+		lstream_write_string(ostr, "\"");
+		return ostr;
+	case LTYPE_SYM: lstream_write_string(ostr, args[0].sym()->str()); break;
 	case LTYPE_FUNC: lstream_write_string(ostr, "<#function @" + std::to_string((u64)args[0].as_func()) + ">"); break;
+	case LTYPE_BYTES: lstream_write_string(ostr, "<#bytes " + std::to_string(args[0].bytes()->len) + ">"); break;
 	default: break;
 	}
 
+	if( args[0].type() == LTYPE_RECORD )
+	{
+		// <#record POINT X: 1 Y: 2>
+		lrecord* R = args[0].record();
+		lstream_write_string(ostr, "<#record ");
+		lwrite({R->rtd.as_cons()->a, ostr});
+		u32 i = 0;
+		for(lptr f = R->rtd.as_cons()->b; f.type() == LTYPE_CONS && i < R->n; f = f.as_cons()->b, ++i)
+		{
+			write_char({(u64)' ', ostr});
+			lwrite({f.as_cons()->a, ostr});
+			lstream_write_string(ostr, ": ");
+			lwrite({R->slots[i], ostr});
+		}
+		write_char({(u64)'>', ostr});
+		return ostr;
+	}
+
 	if( args[0].type() == LTYPE_CONS )
 	{
 		cons* cc = args[0].as_cons();
@@ -127,7 +151,7 @@ lptr ldisplay(const MultiArg& args)
 {
 	if( args.size() == 0 ) return lptr();
 
-	lptr ostr = lisp_out_stream;
+	lptr ostr = current_isolate->lisp_out_stream;
 	if( args.size() > 1 && args[1].type() == LTYPE_STREAM )
 	{
 		ostr = args[1];
@@ -148,10 +172,12 @@ lptr ldisplay(const MultiArg& args)
 	{
 	case LTYPE_INT: lstream_write_string(ostr, std::to_string((s64)args[0].as_int())); break;
 	case LTYPE_FLOAT: lstream_write_string(ostr, std::to_string(args[0].as_float())); break;
-	case LTYPE_STR: lstream_write_string(ostr, args[0].string()->txt); break;
+	case LTYPE_STR: lstream_write_string(ostr, args[0].string()->str()); break;
 	case LTYPE_CONS: lwrite(args); break;
-	case LTYPE_SYM: lstream_write_string(ostr, args[0].sym()->name); break;
+	case LTYPE_SYM: lstream_write_string(ostr, args[0].sym()->str()); break;
 	case LTYPE_FUNC: lwrite(args); break;
+	case LTYPE_BYTES: lwrite(args); break;
+	case LTYPE_RECORD: lwrite(args); break;
 	}
 
 	return args[0];
@@ -166,7 +192,7 @@ lptr open_output_file(const MultiArg& args)
 		return lptr();
 	}
 
-	std::fstream* out1 = new std::fstream(args[0].string()->txt, std::ios_base::binary|std::ios_base::out);
+	std::fstream* out1 = new std::fstream(args[0].string()->c_str(), std::ios_base::binary|std::ios_base::out);
 
 	if( !*out1 )
 	{
@@ -174,7 +200,7 @@ lptr open_output_file(const MultiArg& args)
 		return lptr();
 	}
 
-	return new lstream(out1, LSTREAM_FILE|LSTREAM_IN);
+	return lnew<lstream>(out1, LSTREAM_FILE|LSTREAM_IN);
 }
 
 lptr open_input_file(const MultiArg& args)
@@ -186,7 +212,7 @@ lptr open_input_file(const MultiArg& args)
 		return lptr();
 	}
 
-	std::fstream* in1 = new std::fstream(args[0].string()->txt, std::ios_base::binary|std::ios_base::in);
+	std::fstream* in1 = new std::fstream(args[0].string()->c_str(), std::ios_base::binary|std::ios_base::in);
 
 	if( !*in1 )
 	{
@@ -194,7 +220,7 @@ lptr open_input_file(const MultiArg& args)
 		return lptr();
 	}
 
-	return new lstream(in1);
+	return lnew<lstream>(in1);
 }
 
 lptr lclose(lptr port)
@@ -212,15 +238,15 @@ lptr lclose(lptr port)
 	} else if( std::holds_alternative<std::stringstream*>(S->strm) ) {
 		// can't close a stringstream, but nothing happens.
 	} else if( std::holds_alternative<int>(S->strm) ) {
-		//todo: socket close
-	} 
+		socket_close(S);
+	}
 
 	return lptr();
 }
 
 lptr peek_char(const MultiArg& args)
 {
-	lptr port = lisp_in_stream;
+	lptr port = current_isolate->lisp_in_stream;
 	if( args.size() > 0 && args[0].type() == LTYPE_STREAM )
 		port = args[0];
 
@@ -229,55 +255,75 @@ lptr peek_char(const MultiArg& args)
 	lstream* S = port.stream();
 	if( std::holds_alternative<std::fstream*>(S->strm) )
 	{
-		return (u64)(u8) std::get<std::fstream*>(S->strm)->peek();
+		return (u64)(s64) std::get<std::fstream*>(S->strm)->peek();
 	} else if( std::holds_alternative<std::istream*>(S->strm) ) {
-		return (u64)(u8) std::get<std::istream*>(S->strm)->peek();
+		return (u64)(s64) std::get<std::istream*>(S->strm)->peek();
+	} else if( std::holds_alternative<int>(S->strm) ) {
+		return (u64)(s64) socket_peek(S);
 	}
 	
-	return (u64)(u8) std::get<std::stringstream*>(S->strm)->peek();
+	return (u64)(s64) std::get<std::stringstream*>(S->strm)->peek();
 }
 
 lptr read_char(const MultiArg& args)
 {
-	lptr port = lisp_in_stream;
+	lptr port = current_isolate->lisp_in_stream;
 	if( args.size() > 0 && args[0].type() == LTYPE_STREAM )
 		port = args[0];
 
 	if( ! (port.stream()->flags & LSTREAM_IN) ) return lptr();
 
 	lstream* S = port.stream();
+	s64 c;
 	if( std::holds_alternative<std::fstream*>(S->strm) )
 	{
-		return (u64)(u8) std::get<std::fstream*>(S->strm)->get();
+		c = std::get<std::fstream*>(S->strm)->get();
 	} else if( std::holds_alternative<std::istream*>(S->strm) ) {
-		return (u64)(u8) std::get<std::istream*>(S->strm)->get();
+		c = std::get<std::istream*>(S->strm)->get();
+	} else if( std::holds_alternative<int>(S->strm) ) {
+		c = socket_get(S);
+	} else {
+		c = std::get<std::stringstream*>(S->strm)->get();
 	}
-	
-	return (u64)(u8) std::get<std::stringstream*>(S->strm)->get();
+
+	if( (S->flags & LSTREAM_SOURCE) && c != -1 )
+	{
+		if( c == '\n' ) { S->line++; S->col = 1; }
+		else S->col++;
+	}
+	return (u64) c;
 }
 
 void consume_ws(lptr port)
 {
 	int c =(int) peek_char({port}).as_int();
-	while( isspace(c) && c != -1 )
+	while( c != -1 && (isspace(c) || c == ';') )
 	{
-		read_char({port});
-		c =(int) peek_char({port}).as_int();
-		while( c == ';' )
+		if( c == ';' )
 		{
-			while( (c != '\n' && c != -1) || isspace(c) )
+			// comments run to the end of the line
+			while( c != '\n' && c != -1 )
 			{
 				read_char({port});
 				c =(int) peek_char({port}).as_int();
-			}		
+			}
+			continue;
 		}
+		read_char({port});
+		c =(int) peek_char({port}).as_int();
 	}
 	return;
 }
 
+bool lstream_at_eof(lptr port)
+{
+	consume_ws(port);
+	return (int) peek_char({port}).as_int() == -1;
+}
+
 lptr lread(const MultiArg& args)
 {
-	lptr port = lisp_in_stream;
+	lptr port = current_isolate->lisp_in_stream;
 	if( args.size() > 0 && args[0].type() == LTYPE_STREAM )
 		port = args[0];
 
@@ -291,6 +337,8 @@ lptr lread(const MultiArg& args)
 	if( c == '(' )
 	{
 		//printf("about to list\n");
+		lstream* S = port.stream();
+		u64 at = (S->flags & LSTREAM_SOURCE) ? source_pack(S->file, S->line, S->col) : 0;
 		read_char({port});
 		consume_ws(port);
 		c = (int) peek_char({port}).as_int();
@@ -301,8 +349,12 @@ lptr lread(const MultiArg& args)
 		}
 
 		lptr a = lread({port});
-		cons* fin = new cons(a, lptr());
+		cons* fin = lnew<cons>(a, lptr());
+		source_note(fin, at);
 		cons* temp = fin;
+		// reading the rest may park a green thread, keep the list so far alive
+		lptr head = fin;
+		local_roots roots(nullptr, &head, 1);
 		consume_ws(port);
 		c =(int) peek_char({port}).as_int();
 		while( c != ')' )
@@ -320,7 +372,7 @@ lptr lread(const MultiArg& args)
 				}
 				return fin;
 			}
-			cons* n = new cons(lread({port}), lptr());
+			cons* n = lnew<cons>(lread({port}), lptr());
 			temp->b = n;
 			temp = n;
 			consume_ws(port);
@@ -336,7 +388,14 @@ lptr lread(const MultiArg& args)
 	{
 		read_char({port});
 		lptr b = lread({port});
-		return new cons(QUOTE, new cons(b, lptr()));
+		return lnew<cons>(QUOTE, lnew<cons>(b, lptr()));
+	}
+
+	if( c == '`' )
+	{
+		read_char({port});
+		lptr b = lread({port});
+		return lnew<cons>(intern_c("quasiquote"), lnew<cons>(b, lptr()));
 	}
 
 	if( c == ',' )
@@ -347,10 +406,10 @@ lptr lread(const MultiArg& args)
 		{
 			read_char({port});
 			lptr b = lread({port});
-			return new cons(intern_c("unquote-splice"), new cons(b, lptr()));
+			return lnew<cons>(intern_c("unquote-splice"), lnew<cons>(b, lptr()));
 		}
 		lptr b = lread({port});
-		return new cons(intern_c("unquote"), new cons(b, lptr()));
+		return lnew<cons>(intern_c("unquote"), lnew<cons>(b, lptr()));
 	}
 
 	if( c == '\"' )
@@ -359,7 +418,8 @@ lptr lread(const MultiArg& args)
 		c =(int) peek_char({port}).as_int();
 		if( c == '\"' || c == -1 )
 		{
-			return new lstr();
+			read_char({port});
+			return lnew<lstr>();
 		}
 		std::string str;
 		do {
@@ -377,15 +437,18 @@ lptr lread(const MultiArg& args)
 			c =(int) peek_char({port}).as_int();
 		} while( c != '\"' && c != -1 );
 		read_char({port});
-		return new lstr(str);
+		return lnew<lstr>(str);
 	}
 
+	// a local, since a socket read can park this green thread partway through
+	// an atom and let another read on the same OS thread. short atoms fit in
+	// the string's own buffer, so interning one still doesn't allocate
 	std::string atom;
 	do {
 		atom += c;
 		read_char({port});
 		c =(int) peek_char({port}).as_int();
-	} while( !isspace(c) && c != '(' && c != ')' && c != ';' && c != ',' && c != '`' && c != '\'' );
+	} while( c != -1 && !isspace(c) && c != '(' && c != ')' && c != ';' && c != ',' && c != '`' && c != '\'' );
 
 	size_t pos;
 	try {
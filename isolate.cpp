@@ -0,0 +1,136 @@
+#include <sstream>
+#include "types.h"
+#include "funcs.h"
+#include "isolate.h"
+
+thread_local Isolate* current_isolate = nullptr;
+thread_local std::vector<lobj*>* current_heap = nullptr;
+thread_local alloc_stats* current_allocs = nullptr;
+thread_local local_roots* local_roots_top = nullptr;
+thread_local escape_frame* escape_top = nullptr;
+thread_local jit_frame* jit_top = nullptr;
+
+void heap_track(lobj* o)
+{
+	Isolate* I = current_isolate;
+
+	// objects born during an incremental cycle are black
+	if( I->gc.marking.load(std::memory_order_relaxed) ) o->type |= LGC_MARK;
+	current_heap->push_back(o);
+
+	// pay off pending sweeping or marking a little at a time
+	if( current_heap == &I->heap && (I->gc.sweep_end || I->gc.marking) ) gc_alloc_tick(I);
+	return;
+}
+
+void heap_new(lobj* o, size_t bytes)
+{
+	current_allocs->count(o->type, bytes);
+	if( trace_on.load(std::memory_order_relaxed) ) trace_alloc(bytes);
+	if( current_isolate->track_sites && current_heap == &current_isolate->heap ) heap_note_site(o);
+	heap_track(o);
+	return;
+}
+
+Isolate::Isolate(std::istream* in, std::ostream* out) : pool(nullptr), loop(nullptr), green(nullptr), define_epoch(0), track_sites(false)
+{
+	lstream* i = new lstream(in);
+	lstream* o = new lstream(out);
+	i->flags |= LSTREAM_NOCLOSE;
+	o->flags |= LSTREAM_NOCLOSE;
+	heap.push_back((lobj*)i);
+	heap.push_back((lobj*)o);
+	lisp_in_stream = i;
+	lisp_out_stream = o;
+}
+
+Isolate::~Isolate()
+{
+	pool_shutdown(this);
+	green_destroy(this);
+	event_loop_destroy(this);
+	gc_finish_sweep(this);
+	for(lobj* o : heap) lobj_free(o);
+	heap.clear();
+}
+
+isolate_scope::isolate_scope(Isolate* I) : prev_isolate(current_isolate), prev_scope(global_scope), prev_heap(current_heap), prev_allocs(current_allocs), prev_roots(local_roots_top), prev_escapes(escape_top)
+{
+	current_isolate = I;
+	global_scope = &I->first_fscope;
+	current_heap = &I->heap;
+	current_allocs = &I->alloc;
+	local_roots_top = nullptr;
+	escape_top = nullptr; // nothing escapes into another isolate
+}
+
+isolate_scope::~isolate_scope()
+{
+	current_isolate = prev_isolate;
+	global_scope = prev_scope;
+	current_heap = prev_heap;
+	current_allocs = prev_allocs;
+	local_roots_top = prev_roots;
+	escape_top = prev_escapes;
+}
+
+Isolate* isolate_create(std::istream* in, std::ostream* out)
+{
+	Isolate* I = new Isolate(in, out);
+	isolate_scope S(I);
+	lisp_init();
+	return I;
+}
+
+void isolate_destroy(Isolate* I)
+{
+	delete I;
+	return;
+}
+
+lptr isolate_eval(Isolate* I, std::string_view src, std::string_view file)
+{
+	isolate_scope S(I);
+	lstream port(new std::stringstream(std::string(src)));
+	if( !file.empty() )
+	{
+		port.flags |= LSTREAM_SOURCE;
+		port.file = source_file(file);
+	}
+
+	lptr res;
+	while( !lstream_at_eof(&port) )
+	{
+		gc_safepoint(I);
+		error_site_clear();
+		res = eval({ lread({&port}) });
+	}
+
+	return res;
+}
+
+std::string isolate_eval_string(Isolate* I, std::string_view src, std::string_view file)
+{
+	lptr res = isolate_eval(I, src, file);
+
+	isolate_scope S(I);
+	std::stringstream* ss = new std::stringstream;
+	lstream out(ss);
+	lwrite({res, &out});
+	return ss->str();
+}
+
+void isolate_repl(Isolate* I)
+{
+	isolate_scope S(I);
+	lstream* in = I->lisp_in_stream.stream();
+	in->flags |= LSTREAM_SOURCE;
+	in->file = source_file("<stdin>");
+	while( !lstream_at_eof(I->lisp_in_stream) )
+	{
+		gc_safepoint(I);
+		error_site_clear();
+		lwrite({ eval({ lread({}) }) });
+	}
+	return;
+}
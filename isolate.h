@@ -0,0 +1,270 @@
+#pragma once
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include "types.h"
+
+struct task_pool;
+struct event_loop;
+struct green_sched;
+struct green_thread;
+
+// what's been allocated, by the heap object types (cons, func, scope, ...),
+// counted as it's made. see stats.cpp
+struct alloc_stats
+{
+	u64 objects[16] = {};
+	u64 bytes[16] = {};
+
+	void count(u32 type, size_t n)
+	{
+		type &= 15;
+		objects[type]++;
+		bytes[type] += n;
+	}
+};
+
+// what runtime-stats and heap-snapshot call each type, null for the immediates
+extern const char* const heap_type_names[16];
+
+struct gc_state
+{
+	gc_state();
+
+	size_t next_collect; // heap size (in objects) that triggers a collection
+	bool requested;
+
+	// lazy sweep cursor: heap[0, sweep_end) was live or garbage at the last mark
+	size_t sweep_pos, sweep_end, sweep_live;
+
+	// incremental marking
+	std::atomic<bool> marking;
+	bool incremental;
+	u64 budget_us;                  // longest a single marking slice may run
+	u32 alloc_ticks;
+	size_t cycle_marked;
+	std::vector<lobj*> gray;
+	std::mutex log_lock;
+	std::vector<lobj*> barrier_log; // grayed by pool threads, drained by the next slice
+
+	u64 collections;
+	u64 total_pause_us;
+	u64 max_pause_us;
+	u64 pause_hist[32]; // pause counts by log2 of microseconds
+	std::vector<u64> recent_pauses;
+	size_t recent_pos;
+};
+
+// An Isolate owns everything a running interpreter mutates: the global
+// bindings, the standard streams and every heap object it allocated. Separate
+// isolates share nothing but the (immutable, insert-only) symbol table, so
+// each may run on its own thread. A single isolate must only be entered by one
+// thread at a time.
+struct Isolate
+{
+	Isolate(std::istream* in, std::ostream* out);
+	~Isolate();
+
+	fscope first_fscope;
+	std::shared_mutex globals_lock; // first_fscope.symbols, once there's a pool to define from
+	lptr lisp_in_stream;
+	lptr lisp_out_stream;
+	std::vector<lobj*> heap;
+	task_pool* pool; // workers for future/pmap, started on first use
+	event_loop* loop; // epoll set for socket streams, created on first use
+	green_sched* green; // green threads, created by the first spawn
+	u64 define_epoch; // bumped when a binding to a func is replaced, see jit.cpp
+	gc_state gc;
+	alloc_stats alloc;
+	std::unordered_map<const lobj*, u64> positions; // conses the reader noted, see source.cpp
+	bool track_sites; // note which func allocates what, see heap.cpp
+	std::unordered_map<const lobj*, uintptr_t> alloc_sites;
+};
+
+extern thread_local Isolate* current_isolate;
+extern thread_local fscope* global_scope;
+extern thread_local std::vector<lobj*>* current_heap; // where lnew records objects
+extern thread_local alloc_stats* current_allocs; // and where it counts them
+
+// Values and scopes that only a C++ frame refers to: the evaluated arguments of
+// a call in progress and the scope it runs in. Each thread, and each green
+// thread, has its own chain of these, which is how the collector finds them
+// while that stack is switched out.
+struct local_roots;
+extern thread_local local_roots* local_roots_top;
+
+struct local_roots
+{
+	local_roots(fscope* e, const lptr* v = nullptr, size_t len = 0) : env(e), vals(v), n(len), up(local_roots_top) { local_roots_top = this; }
+	~local_roots() { local_roots_top = up; }
+
+	fscope* env;
+	const lptr* vals;
+	size_t n;
+	local_roots* up;
+};
+
+// Where a non-local exit can land: catch, block, call/ec and guard push one for
+// as long as their body runs. The chain is per thread and per green thread,
+// like local_roots, and keeps the frame's tag alive. See escape.cpp.
+enum escape_kind : u8
+{
+	ESCAPE_CATCH,   // catch and call/ec, found by tag with eq
+	ESCAPE_BLOCK,   // block, found by name
+	ESCAPE_HANDLER, // guard
+};
+
+struct escape_frame;
+extern thread_local escape_frame* escape_top;
+
+struct escape_frame
+{
+	escape_frame(escape_kind k, lptr t) : kind(k), tag(t), roots(nullptr, &tag, 1), up(escape_top) { escape_top = this; }
+	~escape_frame() { escape_top = up; }
+
+	escape_kind kind;
+	lptr tag;
+	local_roots roots;
+	escape_frame* up;
+};
+
+// Compiled code runs without scopes of its own, so call_func notes which func
+// it entered for the profiler to find. scope is what was current at the time;
+// once another scope is, the note is older than what the scopes say.
+struct jit_frame;
+extern thread_local jit_frame* jit_top;
+
+struct jit_frame
+{
+	jit_frame(func* f) : F(f), scope(global_scope), up(jit_top) { jit_top = this; }
+	~jit_frame() { jit_top = up; }
+
+	func* F;
+	fscope* scope;
+	jit_frame* up;
+};
+
+// The tracer, see trace.cpp. A span notes when it started and, going out of
+// scope, adds a complete event to the thread's ring; while tracing is off it's
+// a load and a branch.
+enum trace_kind : u32
+{
+	TRACE_CALL,  // what is the func
+	TRACE_GC,    // what is a const char* naming the phase
+	TRACE_WAIT,  // likewise, blocked on I/O, a channel or the pool
+	TRACE_ALLOC, // a counter, what is the bytes the thread has allocated
+	TRACE_MARK,  // an instant, what is a symbol
+};
+
+extern std::atomic<bool> trace_on;
+u64 trace_now();
+void trace_span_end(trace_kind kind, uintptr_t what, u64 start);
+void trace_alloc(size_t bytes);
+
+struct trace_span
+{
+	trace_span(trace_kind k, uintptr_t w) : kind(k), what(w), start(trace_on.load(std::memory_order_relaxed) ? trace_now() : 0) {}
+	trace_span(trace_kind k, const char* name) : trace_span(k, (uintptr_t)name) {}
+	~trace_span() { if( start ) trace_span_end(kind, what, start); }
+
+	trace_kind kind;
+	uintptr_t what;
+	u64 start;
+};
+
+// thrown to unwind to a frame; only that frame catches it
+struct lisp_escape
+{
+	escape_frame* to;
+	lptr value;
+};
+
+// thrown by (return v), caught by the innermost interpreted call
+struct lisp_return
+{
+	lptr value;
+};
+
+// thrown by error and raise while a guard is waiting
+struct lisp_error
+{
+	lptr condition;
+};
+
+void pool_shutdown(Isolate* I);
+bool pool_idle(Isolate* I);
+void pool_collect_heaps(Isolate* I);
+void pool_parallel(Isolate* I, int n, const std::function<void(int)>& fn);
+int pool_size(Isolate* I);
+
+void event_loop_destroy(Isolate* I);
+void event_loop_roots(Isolate* I, const std::function<void(lptr)>& push);
+void event_loop_run(Isolate* I, s64 until_ms);
+s64 event_loop_now_ms();
+
+// green threads. they only run while the isolate's own thread is inside the
+// event loop (run-event-loop, or yield and sleep outside any green thread).
+green_thread* green_self(Isolate* I);
+void green_park(Isolate* I);
+void green_wake(Isolate* I, green_thread* T);
+void green_tick(Isolate* I);
+bool green_run(Isolate* I);
+int green_timeout_ms(Isolate* I);
+void green_destroy(Isolate* I);
+void green_suspended_roots(Isolate* I, std::vector<local_roots*>& chains, std::vector<lptr>& vals);
+
+// collector. objects are only reclaimed at a safepoint, ie. between top level
+// forms when no pool task is running, because that's the only point where
+// every live object is reachable from the isolate's roots.
+void gc_safepoint(Isolate* I);
+void gc_collect(Isolate* I);
+void gc_alloc_tick(Isolate* I);
+void gc_log_overwrite(Isolate* I, lptr old);
+void gc_sweep_step(Isolate* I, size_t n);
+void gc_finish_sweep(Isolate* I);
+void gc_walk_children(lobj* o, const std::function<void(lobj*)>& fn);
+void gc_walk_roots(Isolate* I, const std::function<void(const char*, symbol*, lobj*)>& fn);
+void lobj_free(lobj* o);
+
+// deletion barrier for incremental marking, called with the old value before a
+// heap reference (a cons field or a binding) is overwritten
+inline void gc_write_barrier(lptr old)
+{
+	Isolate* I = current_isolate;
+	if( I->gc.marking.load(std::memory_order_relaxed) ) gc_log_overwrite(I, old);
+	return;
+}
+
+// makes I the current isolate of the calling thread for the scope's lifetime
+struct isolate_scope
+{
+	isolate_scope(Isolate* I);
+	~isolate_scope();
+
+	Isolate* prev_isolate;
+	fscope* prev_scope;
+	std::vector<lobj*>* prev_heap;
+	alloc_stats* prev_allocs;
+	local_roots* prev_roots;
+	escape_frame* prev_escapes;
+};
+
+// embedding API
+Isolate* isolate_create(std::istream* in = &std::cin, std::ostream* out = &std::cout);
+void isolate_destroy(Isolate* I);
+// the returned value stays valid until the isolate is next entered. given a
+// file name, the lists read are noted as coming from there (see source.cpp)
+lptr isolate_eval(Isolate* I, std::string_view src, std::string_view file = {});
+std::string isolate_eval_string(Isolate* I, std::string_view src, std::string_view file = {});
+void isolate_repl(Isolate* I);
+
+// daemon mode: serves eval requests on a Unix-domain socket with a pool of
+// warm isolates, each of which has evaluated the preload files. returns when
+// the process gets SIGINT or SIGTERM.
+int server_run(const std::string& path, int workers, const std::vector<std::string>& preload);
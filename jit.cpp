@@ -0,0 +1,654 @@
+#include <vector>
+#include <mutex>
+#include <algorithm>
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "types.h"
+#include "funcs.h"
+#include "isolate.h"
+
+// Baseline JIT for x86-64.
+//
+// An interpreted func is compiled once it has been called JIT_HOT_CALLS times,
+// provided its body only does fixnum work: parameters, fixnum constants, T and
+// nil, if, + - *, two-argument comparisons, and calls to itself or to funcs
+// that are compiled already. Each form becomes a fixed template of machine
+// code that works on tagged values directly. A fixnum is n<<3 with tag 0, so
+// adding and comparing need no untagging, and overflow wraps exactly the way
+// the interpreter's arithmetic does.
+//
+// Such a body has no side effects, which keeps deoptimizing simple. Every
+// parameter is checked to be a fixnum on entry, and so is every call result
+// that feeds arithmetic. When a check fails the whole compiled call is
+// abandoned by resetting the stack to where jit_call entered it, and the
+// interpreter makes the call again from the start. A func that keeps failing
+// its checks loses its code for good.
+//
+// Compiled code calls +, < and the funcs it depends on without looking them
+// up, so it remembers which func each of those symbols was bound to. Replacing
+// a binding to a func bumps the isolate's define_epoch, and the next jit_call
+// after that checks the bindings again before it trusts the code.
+//
+// Code lives in one region that is mapped twice, once writable and once
+// executable, so no page is ever both. The region is never reclaimed; once
+// it's full the JIT stops compiling.
+
+extern lptr global_T;
+
+bool jit_enabled = true;
+
+const u32 JIT_HOT_CALLS = 1000;
+const u32 JIT_MAX_DEOPTS = 64;
+const int JIT_MAX_ARGS = 6;
+const size_t JIT_CODE_SIZE = 16<<20;
+const u64 JIT_DEOPT = 7; // what the trampoline returns after a failed check, no lptr has tag 7
+
+struct jit_code
+{
+	const u8* entry;
+	u32 nargs;
+	u32 deopts;
+	u64 epoch; // define_epoch the dependencies were last checked at
+	std::vector<symbol*> dep_syms;
+	std::vector<func*> deps; // deps[i] is what dep_syms[i] has to be bound to
+};
+
+typedef u64 jit_entry_fn(const u64* args, const u8* code);
+
+static std::mutex jit_lock;
+static u8* code_rw;
+static const u8* code_rx;
+static size_t code_used;
+static jit_entry_fn* jit_enter;
+static const u8* deopt_stub;
+
+// x86-64 condition codes, a code xor 1 is its negation
+enum
+{
+	CC_E = 0x4,
+	CC_NE = 0x5,
+	CC_L = 0xC,
+	CC_GE = 0xD,
+	CC_LE = 0xE,
+	CC_G = 0xF,
+};
+
+struct jit_asm
+{
+	std::vector<u8> code;
+	std::vector<std::pair<size_t, const u8*>> far; // rel32 at offset to an absolute target, nullptr for our own entry
+
+	size_t here() const { return code.size(); }
+	void emit(std::initializer_list<u8> b) { code.insert(code.end(), b); }
+
+	void imm32(u32 v)
+	{
+		for(int i = 0; i < 4; ++i) code.push_back((u8)(v >> 8*i));
+		return;
+	}
+
+	void imm64(u64 v)
+	{
+		for(int i = 0; i < 8; ++i) code.push_back((u8)(v >> 8*i));
+		return;
+	}
+
+	// forward jumps return the offset of their rel32 for bind()
+	size_t jcc(int cc) { emit({0x0F, (u8)(0x80|cc)}); imm32(0); return here()-4; }
+	size_t jmp() { emit({0xE9}); imm32(0); return here()-4; }
+
+	void bind(size_t fix)
+	{
+		u32 rel = (u32)(here() - (fix+4));
+		memcpy(&code[fix], &rel, 4);
+		return;
+	}
+
+	void jcc_far(int cc, const u8* target) { emit({0x0F, (u8)(0x80|cc)}); imm32(0); far.push_back({here()-4, target}); }
+	void call_far(const u8* target) { emit({0xE8}); imm32(0); far.push_back({here()-4, target}); }
+
+	// rax = v
+	void mov_rax(u64 v)
+	{
+		if( (s64)v == (s32)v )
+		{
+			emit({0x48, 0xC7, 0xC0}); // mov rax, simm32
+			imm32((u32)v);
+		} else {
+			emit({0x48, 0xB8});       // mov rax, imm64
+			imm64(v);
+		}
+		return;
+	}
+
+	void push_rax() { emit({0x50}); }
+
+	// rcx = rax, rax = the value pushed before
+	void pop_operands() { emit({0x48, 0x89, 0xC1, 0x58}); }
+};
+
+static bool imm32_fits(u64 v)
+{
+	return (s64)v == (s32)v;
+}
+
+// places code in the region and resolves its far jumps and calls
+static const u8* code_install(jit_asm& a)
+{
+	std::lock_guard<std::mutex> guard(jit_lock);
+	if( code_used + a.code.size() > JIT_CODE_SIZE ) return nullptr;
+
+	const u8* at = code_rx + code_used;
+	for(auto& f : a.far)
+	{
+		const u8* target = f.second ? f.second : at;
+		u32 rel = (u32)(target - (at + f.first + 4));
+		memcpy(&a.code[f.first], &rel, 4);
+	}
+	memcpy(code_rw + code_used, a.code.data(), a.code.size());
+	code_used += (a.code.size() + 15) & ~(size_t)15;
+	return at;
+}
+
+// maps the region and emits the trampoline every compiled call goes through:
+//   jit_enter(args, code) saves the callee-saved registers, keeps the stack
+//   pointer in r15, loads six arguments and calls code. deopt_stub puts the
+//   stack back from r15 and returns JIT_DEOPT instead.
+static void jit_init()
+{
+	int fd = memfd_create("atlis-jit", MFD_CLOEXEC);
+	if( fd < 0 ) return;
+	void* rw = MAP_FAILED;
+	void* rx = MAP_FAILED;
+	if( ftruncate(fd, JIT_CODE_SIZE) == 0 )
+	{
+		rw = mmap(nullptr, JIT_CODE_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+		rx = mmap(nullptr, JIT_CODE_SIZE, PROT_READ|PROT_EXEC, MAP_SHARED, fd, 0);
+	}
+	::close(fd);
+	if( rw == MAP_FAILED || rx == MAP_FAILED )
+	{
+		if( rw != MAP_FAILED ) munmap(rw, JIT_CODE_SIZE);
+		if( rx != MAP_FAILED ) munmap(rx, JIT_CODE_SIZE);
+		return;
+	}
+	code_rw = (u8*) rw;
+	code_rx = (const u8*) rx;
+
+	jit_asm a;
+	a.emit({0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57}); // push rbx rbp r12 r13 r14 r15
+	a.emit({0x49, 0x89, 0xE7});             // mov r15, rsp
+	a.emit({0x48, 0x89, 0xF0});             // mov rax, rsi
+	a.emit({0x49, 0x89, 0xFA});             // mov r10, rdi
+	a.emit({0x49, 0x8B, 0x7A, 0x00});       // mov rdi, [r10]
+	a.emit({0x49, 0x8B, 0x72, 0x08});       // mov rsi, [r10+8]
+	a.emit({0x49, 0x8B, 0x52, 0x10});       // mov rdx, [r10+16]
+	a.emit({0x49, 0x8B, 0x4A, 0x18});       // mov rcx, [r10+24]
+	a.emit({0x4D, 0x8B, 0x42, 0x20});       // mov r8, [r10+32]
+	a.emit({0x4D, 0x8B, 0x4A, 0x28});       // mov r9, [r10+40]
+	a.emit({0xFF, 0xD0});                   // call rax
+	size_t exit = a.here();
+	a.emit({0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B}); // pop r15 r14 r13 r12 rbp rbx
+	a.emit({0xC3});                         // ret
+	size_t deopt = a.here();
+	a.emit({0x4C, 0x89, 0xFC});             // mov rsp, r15
+	a.emit({0xB8}); a.imm32(JIT_DEOPT);     // mov eax, JIT_DEOPT
+	a.emit({0xEB, (u8)(exit - (a.here()+2))}); // jmp exit
+
+	const u8* at = code_install(a);
+	jit_enter = (jit_entry_fn*) at;
+	deopt_stub = at + deopt;
+	return;
+}
+
+enum jit_kind { JK_INT, JK_BOOL, JK_ANY };
+
+struct jit_compiler
+{
+	jit_compiler(Isolate* i, func* f) : I(i), F(f), nparams(0), retry(false) {}
+
+	bool compile();
+	bool expr(lptr e, int& kind);
+	bool fixnum(lptr e);
+	bool compare(lptr e, int& cc);
+	bool test(lptr e, size_t& false_fix);
+	bool arith(func* op, lptr args);
+	bool call(func* G, lptr args);
+	func* global_func(lptr s);
+	int param_index(lptr s);
+	void depend(symbol* s, func* G);
+
+	Isolate* I;
+	func* F;
+	symbol* params[JIT_MAX_ARGS];
+	int nparams;
+	jit_asm a;
+	std::vector<symbol*> dep_syms;
+	std::vector<func*> deps;
+	bool retry; // failed on a callee that may get compiled later
+};
+
+int jit_compiler::param_index(lptr s)
+{
+	for(int i = nparams-1; i >= 0; --i)
+	{
+		if( params[i] == s.sym() ) return i;
+	}
+	return -1;
+}
+
+void jit_compiler::depend(symbol* s, func* G)
+{
+	if( std::find(dep_syms.begin(), dep_syms.end(), s) != dep_syms.end() ) return;
+	dep_syms.push_back(s);
+	deps.push_back(G);
+	return;
+}
+
+// the func a symbol in operator position calls, recorded as a dependency
+func* jit_compiler::global_func(lptr s)
+{
+	if( s.type() != LTYPE_SYM || param_index(s) >= 0 ) return nullptr;
+
+	lptr v = symbol_value(&I->first_fscope, s);
+	if( v.type() != LTYPE_FUNC ) return nullptr;
+	depend(s.sym(), v.as_func());
+	return v.as_func();
+}
+
+static int compare_cc(func* G)
+{
+	if( G->ptr == (void*)&num_lt ) return CC_L;
+	if( G->ptr == (void*)&num_gt ) return CC_G;
+	if( G->ptr == (void*)&num_le ) return CC_LE;
+	if( G->ptr == (void*)&num_ge ) return CC_GE;
+	if( G->ptr == (void*)&num_eq ) return CC_E;
+	return -1;
+}
+
+static size_t list_length(lptr l)
+{
+	size_t n = 0;
+	for(; l.type() == LTYPE_CONS; l = l.as_cons()->b) ++n;
+	return n;
+}
+
+// rax = e, which must be a fixnum; deoptimizes if it might not be one and isn't
+bool jit_compiler::fixnum(lptr e)
+{
+	int kind;
+	if( !expr(e, kind) || kind == JK_BOOL ) return false;
+	if( kind == JK_ANY )
+	{
+		a.emit({0xA8, 0x07});       // test al, 7
+		a.jcc_far(CC_NE, deopt_stub);
+	}
+	return true;
+}
+
+// sets the flags for a two-argument comparison, cc is the condition that holds
+bool jit_compiler::compare(lptr e, int& cc)
+{
+	if( e.type() != LTYPE_CONS ) return false;
+	func* G = global_func(e.as_cons()->a);
+	if( !G || (cc = compare_cc(G)) < 0 ) return false;
+
+	lptr args = e.as_cons()->b;
+	if( list_length(args) != 2 ) return false;
+	lptr x = args.as_cons()->a;
+	lptr y = args.as_cons()->b.as_cons()->a;
+
+	if( !fixnum(x) ) return false;
+	if( y.type() == LTYPE_INT && imm32_fits(y.val) )
+	{
+		a.emit({0x48, 0x3D});           // cmp rax, simm32
+		a.imm32((u32)y.val);
+		return true;
+	}
+	a.push_rax();
+	if( !fixnum(y) ) return false;
+	a.pop_operands();
+	a.emit({0x48, 0x39, 0xC8});         // cmp rax, rcx
+	return true;
+}
+
+// jumps to the returned fixup when e is nil
+bool jit_compiler::test(lptr e, size_t& false_fix)
+{
+	// a comparison jumps on its own flags instead of making T or nil first
+	if( e.type() == LTYPE_CONS )
+	{
+		func* G = global_func(e.as_cons()->a);
+		int cc;
+		if( G && compare_cc(G) >= 0 )
+		{
+			if( !compare(e, cc) ) return false;
+			false_fix = a.jcc(cc^1);
+			return true;
+		}
+	}
+
+	int kind;
+	if( !expr(e, kind) ) return false;
+	a.emit({0x48, 0x83, 0xF8, (u8)LTYPE_OBJ}); // cmp rax, nil
+	false_fix = a.jcc(CC_E);
+	return true;
+}
+
+bool jit_compiler::arith(func* op, lptr args)
+{
+	size_t n = list_length(args);
+	bool sub = op->ptr == (void*)&minus;
+	bool mul = op->ptr == (void*)&mult;
+
+	if( n == 0 )
+	{
+		a.mov_rax(lptr((u64)(mul ? 1 : 0)).val);
+		return true;
+	}
+
+	if( !fixnum(args.as_cons()->a) ) return false;
+	if( n == 1 )
+	{
+		if( sub ) a.emit({0x48, 0xF7, 0xD8}); // neg rax
+		return true;
+	}
+
+	for(lptr p = args.as_cons()->b; p.type() == LTYPE_CONS; p = p.as_cons()->b)
+	{
+		lptr y = p.as_cons()->a;
+		if( y.type() == LTYPE_INT && imm32_fits(mul ? y.as_int() : y.val) )
+		{
+			if( mul )
+			{
+				a.emit({0x48, 0x69, 0xC0});  // imul rax, rax, simm32
+				a.imm32((u32)y.as_int());
+			} else {
+				a.emit({0x48, (u8)(sub ? 0x2D : 0x05)}); // sub/add rax, simm32
+				a.imm32((u32)y.val);
+			}
+			continue;
+		}
+
+		a.push_rax();
+		if( !fixnum(y) ) return false;
+		a.pop_operands();
+		if( mul )
+			a.emit({0x48, 0xC1, 0xF9, 0x03, 0x48, 0x0F, 0xAF, 0xC1}); // sar rcx, 3; imul rax, rcx
+		else
+			a.emit({0x48, (u8)(sub ? 0x29 : 0x01), 0xC8});          // sub/add rax, rcx
+	}
+	return true;
+}
+
+bool jit_compiler::call(func* G, lptr args)
+{
+	static const u8 pop_arg[JIT_MAX_ARGS][2] = {
+		{0x5F}, {0x5E}, {0x5A}, {0x59}, {0x41, 0x58}, {0x41, 0x59} // rdi rsi rdx rcx r8 r9
+	};
+
+	size_t n = list_length(args);
+	if( n != G->num_args ) return false;
+
+	const u8* target = nullptr;
+	if( G != F )
+	{
+		jit_code* J = __atomic_load_n(&G->jit, __ATOMIC_ACQUIRE);
+		if( !J || (G->flags & LFUNC_NOJIT) )
+		{
+			if( !(G->flags & LFUNC_NOJIT) ) retry = true;
+			return false;
+		}
+		// G's code is only good while what it calls stays put too
+		for(size_t i = 0; i < J->deps.size(); ++i) depend(J->dep_syms[i], J->deps[i]);
+		target = J->entry;
+	}
+
+	for(lptr p = args; p.type() == LTYPE_CONS; p = p.as_cons()->b)
+	{
+		int kind;
+		if( !expr(p.as_cons()->a, kind) ) return false;
+		a.push_rax();
+	}
+	for(size_t i = n; i > 0; --i)
+	{
+		const u8* op = pop_arg[i-1];
+		if( op[0] == 0x41 ) a.emit({op[0], op[1]}); else a.emit({op[0]});
+	}
+	a.call_far(target);
+	return true;
+}
+
+bool jit_compiler::expr(lptr e, int& kind)
+{
+	if( e.nilp() )
+	{
+		a.mov_rax(e.val);
+		kind = JK_BOOL;
+		return true;
+	}
+	if( e == global_T )
+	{
+		a.mov_rax(e.val);
+		kind = JK_BOOL;
+		return true;
+	}
+
+	switch( e.type() )
+	{
+	case LTYPE_INT:
+		a.mov_rax(e.val);
+		kind = JK_INT;
+		return true;
+	case LTYPE_SYM:
+		{
+			// only parameters; a global variable could change under the code
+			int i = param_index(e);
+			if( i < 0 ) return false;
+			a.emit({0x48, 0x8B, 0x45, (u8)(-8*(i+1))}); // mov rax, [rbp - 8*(i+1)]
+			kind = JK_INT;
+			return true;
+		}
+	case LTYPE_CONS:
+		break;
+	default:
+		return false;
+	}
+
+	func* G = global_func(e.as_cons()->a);
+	if( !G ) return false;
+	lptr args = e.as_cons()->b;
+
+	if( G->ptr == (void*)&l_if )
+	{
+		size_t n = list_length(args);
+		if( n == 0 || n > 3 ) return false;
+		lptr c = args.as_cons()->a;
+		if( n == 1 ) return expr(c, kind);
+
+		size_t else_fix;
+		if( !test(c, else_fix) ) return false;
+		int k1, k2 = JK_BOOL;
+		if( !expr(args.as_cons()->b.as_cons()->a, k1) ) return false;
+		size_t end_fix = a.jmp();
+		a.bind(else_fix);
+		if( n == 3 )
+		{
+			if( !expr(args.as_cons()->b.as_cons()->b.as_cons()->a, k2) ) return false;
+		} else {
+			a.mov_rax(lptr().val);
+		}
+		a.bind(end_fix);
+		kind = k1 == k2 ? k1 : JK_ANY;
+		return true;
+	}
+
+	if( G->ptr == (void*)&plus || G->ptr == (void*)&minus || G->ptr == (void*)&mult )
+	{
+		kind = JK_INT;
+		return arith(G, args);
+	}
+
+	if( compare_cc(G) >= 0 )
+	{
+		int cc;
+		if( !compare(e, cc) ) return false;
+		a.emit({0xB8}); a.imm32(LTYPE_OBJ);     // mov eax, nil
+		a.emit({0x48, 0xB9}); a.imm64(global_T.val); // mov rcx, T
+		a.emit({0x48, 0x0F, (u8)(0x40|cc), 0xC1});  // cmovcc rax, rcx
+		kind = JK_BOOL;
+		return true;
+	}
+
+	// calls to interpreted funcs
+	if( G->ptr || (G->flags & (LFUNC_SPECIAL|LFUNC_FFI)) ) return false;
+	kind = JK_ANY;
+	return call(G, args);
+}
+
+bool jit_compiler::compile()
+{
+	static const u8 push_arg[JIT_MAX_ARGS][2] = {
+		{0x57}, {0x56}, {0x52}, {0x51}, {0x41, 0x50}, {0x41, 0x51} // rdi rsi rdx rcx r8 r9
+	};
+
+	if( F->closure ) return false;
+	lptr p = F->params;
+	for(; p.type() == LTYPE_CONS; p = p.as_cons()->b)
+	{
+		if( nparams == JIT_MAX_ARGS || p.as_cons()->a.type() != LTYPE_SYM ) return false;
+		params[nparams++] = p.as_cons()->a.sym();
+	}
+	if( !p.nilp() || F->body.type() != LTYPE_CONS ) return false;
+
+	// parameters live in the frame, at rbp-8, rbp-16, ...
+	a.emit({0x55, 0x48, 0x89, 0xE5});  // push rbp; mov rbp, rsp
+	for(int i = 0; i < nparams; ++i)
+	{
+		const u8* op = push_arg[i];
+		if( op[0] == 0x41 ) a.emit({op[0], op[1]}); else a.emit({op[0]});
+	}
+	for(int i = 0; i < nparams; ++i)
+	{
+		a.emit({0x48, 0xF7, 0x45, (u8)(-8*(i+1))}); // test qword [rbp - 8*(i+1)], 7
+		a.imm32(7);
+		a.jcc_far(CC_NE, deopt_stub);
+	}
+
+	for(lptr b = F->body; b.type() == LTYPE_CONS; b = b.as_cons()->b)
+	{
+		int kind;
+		if( !expr(b.as_cons()->a, kind) ) return false;
+	}
+
+	a.emit({0xC9, 0xC3});  // leave; ret
+	return true;
+}
+
+static void jit_give_up(func* F)
+{
+	__atomic_or_fetch(&F->flags, (u32)LFUNC_NOJIT, __ATOMIC_RELAXED);
+	return;
+}
+
+static jit_code* jit_compile(Isolate* I, func* F)
+{
+	static std::once_flag init_once;
+	std::call_once(init_once, jit_init);
+	if( !jit_enter )
+	{
+		jit_give_up(F);
+		return nullptr;
+	}
+
+	jit_compiler C(I, F);
+	if( !C.compile() )
+	{
+		if( C.retry )
+			__atomic_store_n(&F->calls, 0, __ATOMIC_RELAXED);
+		else
+			jit_give_up(F);
+		return nullptr;
+	}
+
+	const u8* entry = code_install(C.a);
+	if( !entry )
+	{
+		jit_give_up(F);
+		return nullptr;
+	}
+
+	jit_code* J = new jit_code;
+	J->entry = entry;
+	J->nargs = C.nparams;
+	J->deopts = 0;
+	J->epoch = I->define_epoch;
+	J->dep_syms = std::move(C.dep_syms);
+	J->deps = std::move(C.deps);
+	__atomic_store_n(&F->jit, J, __ATOMIC_RELEASE);
+	return J;
+}
+
+// true if every symbol the code calls through is still bound to the same func
+static bool jit_still_valid(Isolate* I, jit_code* J)
+{
+	for(size_t i = 0; i < J->deps.size(); ++i)
+	{
+		lptr v = symbol_value(&I->first_fscope, J->dep_syms[i]);
+		if( v.type() != LTYPE_FUNC || v.as_func() != J->deps[i] ) return false;
+	}
+	return true;
+}
+
+// counts a call to F, compiling it when it gets hot, and runs the compiled
+// code if there is some. false means the interpreter has to make the call.
+bool jit_call(func* F, const MultiArg& args, lptr& res)
+{
+	Isolate* I = current_isolate;
+	jit_code* J = __atomic_load_n(&F->jit, __ATOMIC_ACQUIRE);
+	if( !J )
+	{
+		if( __atomic_add_fetch(&F->calls, 1, __ATOMIC_RELAXED) != JIT_HOT_CALLS ) return false;
+		J = jit_compile(I, F);
+		if( !J ) return false;
+	}
+
+	if( args.size() != J->nargs ) return false;
+
+	u64 epoch = __atomic_load_n(&I->define_epoch, __ATOMIC_RELAXED);
+	if( __atomic_load_n(&J->epoch, __ATOMIC_RELAXED) != epoch )
+	{
+		if( !jit_still_valid(I, J) )
+		{
+			jit_give_up(F);
+			return false;
+		}
+		__atomic_store_n(&J->epoch, epoch, __ATOMIC_RELAXED);
+	}
+
+	u64 regs[JIT_MAX_ARGS] = {};
+	for(size_t i = 0; i < J->nargs; ++i) regs[i] = args[i].val;
+
+	u64 v = jit_enter(regs, J->entry);
+	if( v == JIT_DEOPT )
+	{
+		if( __atomic_add_fetch(&J->deopts, 1, __ATOMIC_RELAXED) == JIT_MAX_DEOPTS ) jit_give_up(F);
+		return false;
+	}
+
+	res.val = v;
+	return true;
+}
+
+const std::vector<func*>& jit_deps(func* F)
+{
+	return F->jit->deps;
+}
+
+void jit_release(func* F)
+{
+	// code space isn't reclaimed, the bytes just go unused
+	delete F->jit;
+	return;
+}
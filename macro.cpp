@@ -0,0 +1,188 @@
+#include <vector>
+#include "types.h"
+#include "funcs.h"
+#include "isolate.h"
+
+// Non-hygienic macros.
+//   (defmacro name (params...) body...)  body gets the unevaluated arguments
+//                                        bound to params and gives the code
+//                                        to run in place of the use
+//   (define-syntax name transformer)     transformer is a lambda given the
+//                                        whole use, (name args...)
+//   (macroexpand-1 form)                 one expansion of form, if it's a use
+//
+// A macro is a func flagged LFUNC_MACRO. apply expands a use the first time
+// it's evaluated and overwrites the use's cons with the expansion, so the
+// next time round the expansion is all there is and the macro costs nothing.
+// That also means redefining a macro doesn't change uses that have already
+// run.
+//
+// `x reads as (quasiquote x); within it ,x and ,@x are evaluated, the latter
+// spliced into the list around it, and nested quasiquotes take one more
+// unquote to get at. The parts without unquotes are shared with the template,
+// not copied.
+
+static lptr quasiquote_sym() { static lptr s = intern_c("quasiquote"); return s; }
+static lptr unquote_sym() { static lptr s = intern_c("unquote"); return s; }
+static lptr unquote_splice_sym() { static lptr s = intern_c("unquote-splice"); return s; }
+
+// (op x) -> x
+static lptr second(lptr x)
+{
+	lptr r = x.as_cons()->b;
+	return r.type() == LTYPE_CONS ? r.as_cons()->a : lptr();
+}
+
+static bool tagged(lptr x, lptr tag)
+{
+	return x.type() == LTYPE_CONS && x.as_cons()->a == tag && x.as_cons()->b.type() == LTYPE_CONS;
+}
+
+static lptr qq(lptr x, int depth)
+{
+	if( x.type() != LTYPE_CONS ) return x;
+
+	if( tagged(x, unquote_sym()) )
+	{
+		if( depth == 1 ) return eval({second(x)});
+		lptr in = qq(second(x), depth-1);
+		return in == second(x) ? x : lptr(lnew<cons>(unquote_sym(), lnew<cons>(in, lptr())));
+	}
+	if( tagged(x, quasiquote_sym()) )
+	{
+		lptr in = qq(second(x), depth+1);
+		return in == second(x) ? x : lptr(lnew<cons>(quasiquote_sym(), lnew<cons>(in, lptr())));
+	}
+
+	// evaluating may park a green thread, so what's been made so far is kept
+	lptr keep[3];
+	local_roots roots(nullptr, keep, 3);
+
+	lptr a = x.as_cons()->a;
+	if( depth == 1 && tagged(a, unquote_splice_sym()) )
+	{
+		keep[0] = eval({second(a)});
+		keep[1] = qq(x.as_cons()->b, depth);
+		if( keep[0].type() != LTYPE_CONS ) return keep[1];
+
+		// the spliced list is copied, the rest goes on the end of the copy
+		cons* tail = lnew<cons>(keep[0].as_cons()->a, lptr());
+		keep[2] = tail;
+		for(lptr p = keep[0].as_cons()->b; p.type() == LTYPE_CONS; p = p.as_cons()->b)
+		{
+			cons* c = lnew<cons>(p.as_cons()->a, lptr());
+			tail->b = c;
+			tail = c;
+		}
+		tail->b = keep[1];
+		return keep[2];
+	}
+
+	keep[0] = qq(a, depth);
+	keep[1] = qq(x.as_cons()->b, depth);
+	if( keep[0] == a && keep[1] == x.as_cons()->b ) return x;
+	return lnew<cons>(keep[0], keep[1]);
+}
+
+lptr quasiquote(lptr x)
+{
+	return qq(x, 1);
+}
+
+lptr defmacro(const MultiArg& args)
+{
+	if( args.size() < 2 || args[0].type() != LTYPE_SYM ) throw "defmacro: expected (defmacro name (params...) body...)";
+
+	std::vector<lptr> rest(args.size()-1);
+	for(size_t i = 1; i < args.size(); ++i) rest[i-1] = args[i];
+	lptr M = lambda(rest);
+	// expanders only run once per use, not worth compiling
+	M.as_func()->flags |= LFUNC_MACRO|LFUNC_NOJIT;
+
+	ldefine({args[0], M});
+	return args[0];
+}
+
+lptr define_syntax(const MultiArg& args)
+{
+	if( args.size() < 2 || args[0].type() != LTYPE_SYM ) throw "define-syntax: expected (define-syntax name transformer)";
+
+	lptr t = eval({args[1]});
+	if( t.type() != LTYPE_FUNC ) throw "define-syntax: transformer isn't a function";
+	func* T = t.as_func();
+	if( T->ptr || (T->flags & (LFUNC_SPECIAL|LFUNC_MACRO|LFUNC_ESCAPE)) ) throw "define-syntax: transformer must be a lambda";
+
+	// a macro of its own, the transformer stays an ordinary function
+	func* M = lnew<func>();
+	M->flags = LFUNC_MACRO|LFUNC_MACRO_FORM|LFUNC_NOJIT;
+	M->num_args = T->num_args;
+	M->params = T->params;
+	M->body = T->body;
+	M->pos = T->pos;
+	M->closure = T->closure;
+	M->opt = T->opt;
+	M->opt_epoch = T->opt_epoch;
+
+	ldefine({args[0], M});
+	return args[0];
+}
+
+// args is the use as apply has it, the macro's name (or whatever named it)
+// first; form is the use itself, if there is one
+static lptr expand(func* M, const MultiArg& args, lptr form)
+{
+	if( M->flags & LFUNC_MACRO_FORM )
+	{
+		if( form.type() != LTYPE_CONS )
+		{
+			for(size_t i = args.size(); i > 0; --i) form = lnew<cons>(args[i-1], form);
+		}
+		return funcall(M, {form});
+	}
+
+	std::vector<lptr> margs(args.size()-1);
+	for(size_t i = 1; i < args.size(); ++i) margs[i-1] = args[i];
+	return funcall(M, margs);
+}
+
+// stands in for begin around an expansion that isn't a list, so the use can
+// still be overwritten with a list. it's shared by every isolate and never
+// changes, which frozen says
+static lptr expansion_begin()
+{
+	static func* F = []() {
+		func* f = new func((void*)&begin, LFUNC_SPECIAL, -1);
+		f->type |= LGC_FROZEN;
+		return f;
+	}();
+	return F;
+}
+
+lptr macro_use(func* M, const MultiArg& args, lptr form)
+{
+	lptr x = expand(M, args, form);
+	if( form.type() != LTYPE_CONS || (form.as_cons()->type & LGC_FROZEN) ) return eval({x});
+
+	if( x.type() != LTYPE_CONS ) x = lnew<cons>(expansion_begin(), lnew<cons>(x, lptr()));
+
+	cons* use = form.as_cons();
+	gc_write_barrier(use->a);
+	gc_write_barrier(use->b);
+	use->a = x.as_cons()->a;
+	use->b = x.as_cons()->b;
+	return eval({form});
+}
+
+lptr macroexpand_1(lptr form)
+{
+	if( form.type() != LTYPE_CONS ) return form;
+
+	lptr head = form.as_cons()->a;
+	if( head.type() == LTYPE_SYM ) head = symbol_value(global_scope, head);
+	if( head.type() != LTYPE_FUNC || !(head.as_func()->flags & LFUNC_MACRO) ) return form;
+
+	std::vector<lptr> args;
+	for(lptr p = form; p.type() == LTYPE_CONS; p = p.as_cons()->b) args.push_back(p.as_cons()->a);
+	local_roots roots(nullptr, args.data(), args.size());
+	return expand(head.as_func(), args, form);
+}
@@ -1,19 +1,47 @@
 #include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <stdlib.h>
+#include <string.h>
 #include "types.h"
 #include "funcs.h"
+#include "isolate.h"
 
+static int usage()
+{
+	std::cerr << "usage: atlis [--no-jit] [--serve socket-path [--workers n] [--load file]...]" << std::endl;
+	return 1;
+}
 
-int main()
+int main(int argc, char** argv)
 {
-try {
-	lisp_init();
-	while(1)
+	std::string serve;
+	int workers = std::thread::hardware_concurrency();
+	std::vector<std::string> preload;
+
+	for(int i = 1; i < argc; ++i)
 	{
-		lwrite({ eval({ lread({}) }) });
+		if( !strcmp(argv[i], "--serve") && i+1 < argc )
+			serve = argv[++i];
+		else if( !strcmp(argv[i], "--workers") && i+1 < argc )
+			workers = atoi(argv[++i]);
+		else if( !strcmp(argv[i], "--load") && i+1 < argc )
+			preload.push_back(argv[++i]);
+		else if( !strcmp(argv[i], "--no-jit") )
+			jit_enabled = false;
+		else
+			return usage();
 	}
+
+	if( !serve.empty() ) return server_run(serve, workers, preload);
+
+	Isolate* I = isolate_create();
+try {
+	isolate_repl(I);
 } catch(const char* e) {
-	std::cout << e << std::endl;
+	std::cout << e << error_site() << std::endl;
 }
+	isolate_destroy(I);
 	return 0;
 }
-
@@ -0,0 +1,593 @@
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "types.h"
+#include "funcs.h"
+#include "isolate.h"
+
+// Socket ports are lstreams over a non-blocking fd. Reads go through rbuf so
+// read-char and peek-char work on them like on any other port, and output the
+// kernel won't take yet waits in wbuf until the event loop sees the fd become
+// writable.
+//
+// Each isolate has one epoll set. A socket is in it while it has an
+// on-readable callback or unsent output, and for that long the loop holds it
+// (and the callback) as a gc root, so a server doesn't need to keep its
+// connections reachable itself.
+//
+// Inside a green thread a read or write that would block parks the thread on
+// the fd instead, and the loop wakes it when the fd is ready.
+
+struct io_watch
+{
+	lptr stream;
+	lptr on_read;
+	green_thread* reader; // parked until the fd is readable
+	green_thread* writer; // parked until wbuf has drained
+	u32 events; // what the fd is registered for, 0 if it isn't
+};
+
+struct event_loop
+{
+	int epfd;
+	bool stop;
+	std::unordered_map<int, io_watch> watches;
+};
+
+static event_loop* loop_get(Isolate* I)
+{
+	if( !I->loop )
+	{
+		I->loop = new event_loop;
+		I->loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+		I->loop->stop = false;
+	}
+	return I->loop;
+}
+
+void event_loop_destroy(Isolate* I)
+{
+	if( !I->loop ) return;
+	::close(I->loop->epfd);
+	delete I->loop;
+	I->loop = nullptr;
+	return;
+}
+
+void event_loop_roots(Isolate* I, const std::function<void(lptr)>& push)
+{
+	if( !I->loop ) return;
+	for(auto& w : I->loop->watches)
+	{
+		push(w.second.stream);
+		push(w.second.on_read);
+	}
+	return;
+}
+
+static int socket_fd(lstream* S)
+{
+	return std::get<int>(S->strm);
+}
+
+// brings the epoll registration of S's fd in line with its callback and
+// pending output, dropping the watch once neither is left
+static void watch_update(lstream* S)
+{
+	int fd = socket_fd(S);
+	if( fd < 0 ) return;
+
+	event_loop* L = loop_get(current_isolate);
+	auto it = L->watches.find(fd);
+	bool found = it != L->watches.end();
+	bool reading = found && (!it->second.on_read.nilp() || it->second.reader);
+	bool writing = !S->wbuf.empty() || (found && it->second.writer);
+	u32 want = (reading ? (u32)EPOLLIN : 0) | (writing ? (u32)EPOLLOUT : 0);
+
+	if( !found )
+	{
+		if( !want ) return;
+		it = L->watches.emplace(fd, io_watch{S, lptr(), nullptr, nullptr, 0}).first;
+	}
+
+	io_watch& W = it->second;
+	if( want == W.events )
+	{
+		if( !want ) L->watches.erase(it);
+		return;
+	}
+
+	epoll_event ev;
+	ev.events = want;
+	ev.data.fd = fd;
+	if( !want )
+	{
+		epoll_ctl(L->epfd, EPOLL_CTL_DEL, fd, &ev);
+		L->watches.erase(it);
+		return;
+	}
+
+	epoll_ctl(L->epfd, W.events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev);
+	W.events = want;
+	return;
+}
+
+// writes as much of wbuf as the fd will take without blocking
+static void socket_flush(lstream* S)
+{
+	int fd = socket_fd(S);
+	size_t done = 0;
+	while( fd >= 0 && done < S->wbuf.size() )
+	{
+		ssize_t n = ::send(fd, S->wbuf.data()+done, S->wbuf.size()-done, MSG_NOSIGNAL);
+		if( n > 0 )
+		{
+			done += n;
+			continue;
+		}
+		if( n < 0 && errno == EINTR ) continue;
+		if( n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ) break;
+		// the peer is gone, so is whatever we had for it
+		done = S->wbuf.size();
+	}
+	S->wbuf.erase(0, done);
+	return;
+}
+
+static void wait_for(int fd, short events)
+{
+	pollfd p{fd, events, 0};
+	trace_span span(TRACE_WAIT, "socket-wait");
+	while( ::poll(&p, 1, -1) < 0 && errno == EINTR );
+	return;
+}
+
+// parks the running green thread until S's fd is readable (EPOLLIN) or its
+// output has drained (EPOLLOUT)
+static void park_on(lstream* S, u32 events)
+{
+	Isolate* I = current_isolate;
+	event_loop* L = loop_get(I);
+	int fd = socket_fd(S);
+
+	auto it = L->watches.find(fd);
+	if( it == L->watches.end() ) it = L->watches.emplace(fd, io_watch{S, lptr(), nullptr, nullptr, 0}).first;
+	if( events & EPOLLIN )
+		it->second.reader = green_self(I);
+	else
+		it->second.writer = green_self(I);
+	watch_update(S);
+
+	green_park(I);
+	return;
+}
+
+// blocks the caller until S's fd is ready; only a green thread can wait
+// without stalling the whole isolate
+static void socket_wait(lstream* S, u32 events)
+{
+	if( green_self(current_isolate) )
+		park_on(S, events);
+	else
+		wait_for(socket_fd(S), events & EPOLLIN ? POLLIN : POLLOUT);
+	return;
+}
+
+// reads whatever is available into rbuf. returns false at end of stream, and
+// with block set waits for data rather than returning with rbuf still empty.
+static bool socket_fill(lstream* S, bool block)
+{
+	int fd = socket_fd(S);
+	if( fd < 0 ) return false;
+
+	if( S->rpos == S->rbuf.size() )
+	{
+		S->rbuf.clear();
+		S->rpos = 0;
+	}
+
+	char buf[16384];
+	while( true )
+	{
+		ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+		if( n > 0 )
+		{
+			S->rbuf.append(buf, n);
+			if( block ) green_tick(current_isolate);
+			return true;
+		}
+		if( n == 0 ) return false;
+		if( errno == EINTR ) continue;
+		if( errno != EAGAIN && errno != EWOULDBLOCK ) return false;
+		if( !block ) return true;
+		socket_wait(S, EPOLLIN);
+		fd = socket_fd(S);
+		if( fd < 0 ) return false;
+	}
+}
+
+int socket_peek(lstream* S)
+{
+	if( S->rpos == S->rbuf.size() && !socket_fill(S, true) ) return -1;
+	return (u8) S->rbuf[S->rpos];
+}
+
+int socket_get(lstream* S)
+{
+	int c = socket_peek(S);
+	if( c != -1 ) S->rpos++;
+	return c;
+}
+
+void socket_send(lstream* S, std::string_view data)
+{
+	if( socket_fd(S) < 0 ) return;
+
+	bool was_empty = S->wbuf.empty();
+	S->wbuf.append(data);
+	socket_flush(S);
+	if( was_empty != S->wbuf.empty() ) watch_update(S);
+
+	// a green thread doesn't get ahead of its peer, it waits for the output to go
+	if( green_self(current_isolate) )
+	{
+		while( !S->wbuf.empty() && socket_fd(S) >= 0 ) park_on(S, EPOLLOUT);
+	}
+	return;
+}
+
+void socket_close(lstream* S)
+{
+	int fd = socket_fd(S);
+	if( fd < 0 ) return;
+
+	// lclose promises the output went out, so this is the one place that waits
+	// outside a green thread
+	while( !S->wbuf.empty() && socket_fd(S) >= 0 )
+	{
+		size_t before = S->wbuf.size();
+		socket_flush(S);
+		if( S->wbuf.size() == before ) socket_wait(S, EPOLLOUT);
+	}
+	// another green thread may have closed it while we waited
+	if( socket_fd(S) < 0 ) return;
+
+	if( current_isolate->loop )
+	{
+		event_loop* L = current_isolate->loop;
+		auto it = L->watches.find(fd);
+		if( it != L->watches.end() )
+		{
+			// whoever is parked on it finds it closed
+			if( it->second.reader ) green_wake(current_isolate, it->second.reader);
+			if( it->second.writer ) green_wake(current_isolate, it->second.writer);
+			if( it->second.events ) epoll_ctl(L->epfd, EPOLL_CTL_DEL, fd, nullptr);
+			L->watches.erase(it);
+		}
+	}
+
+	::close(fd);
+	S->strm = -1;
+	S->rbuf.clear();
+	S->rpos = 0;
+	return;
+}
+
+static lptr socket_stream(int fd, u32 flags)
+{
+	if( fd < 0 ) return lptr();
+	return lnew<lstream>(fd, flags|LSTREAM_SOCKET);
+}
+
+static lptr socket_listen(int family, const sockaddr* addr, socklen_t len)
+{
+	int fd = ::socket(family, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if( fd < 0 ) return lptr();
+
+	int one = 1;
+	if( family != AF_UNIX ) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if( ::bind(fd, addr, len) < 0 || ::listen(fd, SOMAXCONN) < 0 )
+	{
+		::close(fd);
+		return lptr();
+	}
+
+	return socket_stream(fd, LSTREAM_LISTEN);
+}
+
+static lptr socket_connect(int family, const sockaddr* addr, socklen_t len)
+{
+	int fd = ::socket(family, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if( fd < 0 ) return lptr();
+
+	if( family != AF_UNIX )
+	{
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+
+	// the connection finishes in the background, the first read or write
+	// just waits for it like for any other data
+	if( ::connect(fd, addr, len) < 0 && errno != EINPROGRESS )
+	{
+		::close(fd);
+		return lptr();
+	}
+
+	return socket_stream(fd, LSTREAM_IN|LSTREAM_OUT);
+}
+
+// resolves host/port to the first usable TCP address
+static bool tcp_address(const MultiArg& args, int port_arg, const char* def_host, sockaddr_storage& addr, socklen_t& len)
+{
+	if( args.size() <= (size_t)port_arg || args[port_arg].type() != LTYPE_INT ) return false;
+
+	std::string host = def_host ? def_host : "";
+	if( args.size() > (size_t)(1-port_arg) && args[1-port_arg].type() == LTYPE_STR )
+		host = args[1-port_arg].string()->text();
+	std::string port = std::to_string((s64)args[port_arg].as_int());
+
+	addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = host.empty() ? AI_PASSIVE : 0;
+
+	addrinfo* res = nullptr;
+	if( getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &res) != 0 || !res )
+		return false;
+
+	memcpy(&addr, res->ai_addr, res->ai_addrlen);
+	len = res->ai_addrlen;
+	freeaddrinfo(res);
+	return true;
+}
+
+static bool unix_address(lptr path, sockaddr_un& addr)
+{
+	if( path.type() != LTYPE_STR ) return false;
+
+	std::string_view P = path.string()->str();
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if( P.size() >= sizeof(addr.sun_path) ) return false;
+	memcpy(addr.sun_path, P.data(), P.size());
+	return true;
+}
+
+// (tcp-listen port [host])
+lptr tcp_listen(const MultiArg& args)
+{
+	sockaddr_storage addr;
+	socklen_t len;
+	if( !tcp_address(args, 0, nullptr, addr, len) ) return lptr();
+
+	return socket_listen(addr.ss_family, (sockaddr*)&addr, len);
+}
+
+// (tcp-connect host port)
+lptr tcp_connect(const MultiArg& args)
+{
+	sockaddr_storage addr;
+	socklen_t len;
+	if( !tcp_address(args, 1, "localhost", addr, len) ) return lptr();
+
+	return socket_connect(addr.ss_family, (sockaddr*)&addr, len);
+}
+
+lptr unix_listen(lptr path)
+{
+	sockaddr_un addr;
+	if( !unix_address(path, addr) ) return lptr();
+
+	// a socket file left behind by an earlier server would make bind fail
+	::unlink(addr.sun_path);
+	return socket_listen(AF_UNIX, (sockaddr*)&addr, sizeof(addr));
+}
+
+lptr unix_connect(lptr path)
+{
+	sockaddr_un addr;
+	if( !unix_address(path, addr) ) return lptr();
+
+	return socket_connect(AF_UNIX, (sockaddr*)&addr, sizeof(addr));
+}
+
+// a new connection. outside a green thread, nil if none is pending.
+lptr socket_accept(lptr listener)
+{
+	if( listener.type() != LTYPE_STREAM || !(listener.stream()->flags & LSTREAM_LISTEN) )
+		return lptr();
+
+	int lfd = socket_fd(listener.stream());
+	if( lfd < 0 ) return lptr();
+
+	sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	int fd;
+	while( true )
+	{
+		fd = ::accept4(lfd, (sockaddr*)&addr, &len, SOCK_NONBLOCK|SOCK_CLOEXEC);
+		if( fd >= 0 ) break;
+		if( errno == EINTR ) continue;
+		if( errno != EAGAIN || !green_self(current_isolate) ) return lptr();
+
+		park_on(listener.stream(), EPOLLIN);
+		lfd = socket_fd(listener.stream());
+		if( lfd < 0 ) return lptr();
+		len = sizeof(addr);
+	}
+
+	if( addr.ss_family != AF_UNIX )
+	{
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+
+	return socket_stream(fd, LSTREAM_IN|LSTREAM_OUT);
+}
+
+// whatever data has arrived as a string, or nil once the peer has closed the
+// connection and everything has been read. a green thread waits for data,
+// anybody else gets "" if there is none yet.
+lptr socket_read(lptr s)
+{
+	if( s.type() != LTYPE_STREAM || !(s.stream()->flags & LSTREAM_SOCKET) ) return lptr();
+
+	lstream* S = s.stream();
+	bool block = green_self(current_isolate) != nullptr;
+	if( S->rpos == S->rbuf.size() && !socket_fill(S, block) ) return lptr();
+
+	lstr* res = lnew<lstr>(S->rbuf.substr(S->rpos));
+	S->rbuf.clear();
+	S->rpos = 0;
+	return res;
+}
+
+// (socket-write s str) queues str, sending what it can right away
+lptr socket_write(const MultiArg& args)
+{
+	if( args.size() < 2 || args[0].type() != LTYPE_STREAM || !(args[0].stream()->flags & LSTREAM_SOCKET) )
+		return lptr();
+	if( args[1].type() != LTYPE_STR ) return lptr();
+
+	socket_send(args[0].stream(), args[1].string()->str());
+	return args[0];
+}
+
+// (on-readable s fn) has the event loop call (fn s) whenever s has data, a
+// pending connection or has hit end of stream. (on-readable s nil) stops it.
+lptr on_readable(const MultiArg& args)
+{
+	if( args.size() < 1 || args[0].type() != LTYPE_STREAM || !(args[0].stream()->flags & LSTREAM_SOCKET) )
+		return lptr();
+
+	lstream* S = args[0].stream();
+	int fd = socket_fd(S);
+	if( fd < 0 ) return lptr();
+
+	lptr fn = args.size() > 1 ? args[1] : lptr();
+	event_loop* L = loop_get(current_isolate);
+	auto it = L->watches.find(fd);
+	if( it == L->watches.end() )
+	{
+		if( fn.nilp() ) return lptr();
+		it = L->watches.emplace(fd, io_watch{S, lptr(), nullptr, nullptr, 0}).first;
+	}
+	gc_write_barrier(it->second.on_read);
+	it->second.on_read = fn;
+	watch_update(S);
+
+	// data that's already buffered won't wake epoll, so hand it over now
+	if( !fn.nilp() && S->rpos < S->rbuf.size() ) funcall(fn, {args[0]});
+	return args[0];
+}
+
+s64 event_loop_now_ms()
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// runs green threads and dispatches socket events until there's nothing left
+// to wait for, stop-event-loop is called, or the clock reaches until_ms (if
+// it isn't -1)
+void event_loop_run(Isolate* I, s64 until_ms)
+{
+	event_loop* L = loop_get(I);
+
+	// run straight from the top level, no frame above us holds objects the
+	// collector can't see, so the loop can stand in for the repl's safepoint
+	bool safepoint = global_scope == &I->first_fscope;
+
+	L->stop = false;
+	epoll_event events[256];
+	while( !L->stop )
+	{
+		bool threads = green_run(I);
+		if( L->stop ) break;
+		if( !threads && L->watches.empty() && until_ms < 0 ) break;
+		if( safepoint ) gc_safepoint(I);
+
+		int timeout = green_timeout_ms(I);
+		if( until_ms >= 0 )
+		{
+			int left = (int) std::max<s64>(0, until_ms - event_loop_now_ms());
+			timeout = timeout < 0 ? left : std::min(timeout, left);
+		}
+
+		int n;
+		{
+			trace_span span(TRACE_WAIT, "event-loop-wait");
+			n = epoll_wait(L->epfd, events, 256, timeout);
+		}
+		if( n < 0 && errno != EINTR ) break;
+
+		for(int i = 0; i < n && !L->stop; ++i)
+		{
+			// an earlier callback may have closed this fd
+			auto it = L->watches.find(events[i].data.fd);
+			if( it == L->watches.end() ) continue;
+			lstream* S = it->second.stream.stream();
+			u32 ev = events[i].events;
+			bool woke = false;
+
+			if( ev & (EPOLLOUT|EPOLLHUP|EPOLLERR) )
+			{
+				socket_flush(S);
+				// nobody will read this output, don't spin on it
+				if( ev & (EPOLLHUP|EPOLLERR) && it->second.on_read.nilp() && !it->second.reader ) S->wbuf.clear();
+				if( S->wbuf.empty() && it->second.writer )
+				{
+					woke = true;
+					green_wake(I, it->second.writer);
+					it->second.writer = nullptr;
+				}
+			}
+
+			if( ev & (EPOLLIN|EPOLLHUP|EPOLLERR) && it->second.reader )
+			{
+				woke = true;
+				green_wake(I, it->second.reader);
+				it->second.reader = nullptr;
+			}
+
+			// the interest stays registered for a thread that parks again right
+			// away; it's dropped when it fires with nobody left to care
+			lptr stream = it->second.stream;
+			lptr fn = it->second.on_read;
+			if( !woke ) watch_update(S);
+
+			if( ev & (EPOLLIN|EPOLLHUP|EPOLLERR) && !fn.nilp() ) funcall(fn, {stream});
+		}
+
+		if( until_ms >= 0 && event_loop_now_ms() >= until_ms ) break;
+	}
+
+	return;
+}
+
+lptr run_event_loop()
+{
+	if( green_self(current_isolate) ) throw "run-event-loop: called from a green thread";
+	event_loop_run(current_isolate, -1);
+	return lptr();
+}
+
+lptr stop_event_loop()
+{
+	loop_get(current_isolate)->stop = true;
+	return lptr();
+}
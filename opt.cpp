@@ -0,0 +1,225 @@
+#include <vector>
+#include <algorithm>
+#include "types.h"
+#include "funcs.h"
+#include "isolate.h"
+
+// Optimizer for function bodies, run by lambda when it makes a top level func.
+//
+// It works on a copy of the body, leaving func::body as it was read:
+//   - a symbol in operator position that names a global func is replaced by
+//     that func, so calling it skips the symbol lookup. apply takes a func
+//     there as it is, and eval calls one-argument builtins directly, with car,
+//     cdr, null? and pair? done inline;
+//   - a pure builtin whose arguments are all constants is called right away
+//     and the call replaced by its result;
+//   - an if whose test is constant is replaced by the branch it would take.
+//
+// All of that assumes the globals it resolved keep their funcs, so the result
+// is kept together with the list of (symbol . func) pairs it depends on. A
+// replaced binding to a func bumps the isolate's define_epoch; func_body then
+// checks the pairs again and optimizes afresh if any has changed. That's only
+// checked as a call starts, so names the body itself defines or sets, anywhere
+// in it, aren't resolved at all.
+//
+// Closures made inside another function aren't optimized, as that would cost
+// a walk over the body every time one is made.
+
+extern lptr global_T;
+
+struct optimizer
+{
+	optimizer(func* f) : F(f), changed(false) {}
+
+	lptr expr(lptr e);
+	lptr each(lptr l);
+	func* global_func(lptr s);
+	bool local(lptr s);
+	void find_assigned(lptr e);
+
+	func* F;
+	lptr deps;
+	lptr assigned; // names the body defines or sets
+	bool changed;
+};
+
+static bool pure_builtin(func* G)
+{
+	static void* const pure[] = {
+		(void*)&plus, (void*)&minus, (void*)&mult, (void*)&l_div,
+		(void*)&num_lt, (void*)&num_gt, (void*)&num_le, (void*)&num_ge, (void*)&num_eq,
+		(void*)&nullp, (void*)&pairp, (void*)&numberp, (void*)&integerp, (void*)&symbolp, (void*)&stringp,
+	};
+	return std::find(std::begin(pure), std::end(pure), G->ptr) != std::end(pure);
+}
+
+// evaluates to itself
+static bool constantp(lptr e)
+{
+	if( e.nilp() || e == global_T ) return true;
+	switch( e.type() )
+	{
+	case LTYPE_INT:
+	case LTYPE_FLOAT:
+	case LTYPE_CHAR:
+	case LTYPE_STR:
+		return true;
+	}
+	return false;
+}
+
+bool optimizer::local(lptr s)
+{
+	for(lptr p = F->params; ; p = p.as_cons()->b)
+	{
+		if( p == s ) return true; // (a . rest)
+		if( p.type() != LTYPE_CONS ) return false;
+		if( p.as_cons()->a == s ) return true;
+	}
+}
+
+// notes the names of every (define s ...) and (set! s ...) in e, quoted or in
+// nested lambdas too, since telling those apart isn't worth it
+void optimizer::find_assigned(lptr e)
+{
+	for(; e.type() == LTYPE_CONS; e = e.as_cons()->b)
+	{
+		cons* c = e.as_cons();
+		if( c->a.type() == LTYPE_CONS )
+		{
+			cons* form = c->a.as_cons();
+			lptr v = symbol_value(&current_isolate->first_fscope, form->a);
+			if( v.type() == LTYPE_FUNC && (v.as_func()->ptr == (void*)&ldefine || v.as_func()->ptr == (void*)&setf) &&
+				form->b.type() == LTYPE_CONS && form->b.as_cons()->a.type() == LTYPE_SYM )
+			{
+				assigned = lnew<cons>(form->b.as_cons()->a, assigned);
+			}
+			find_assigned(c->a);
+		}
+	}
+	return;
+}
+
+// the func s names, recorded as something the result depends on
+func* optimizer::global_func(lptr s)
+{
+	if( s.type() != LTYPE_SYM || local(s) ) return nullptr;
+	for(lptr a = assigned; a.type() == LTYPE_CONS; a = a.as_cons()->b)
+	{
+		if( a.as_cons()->a == s ) return nullptr;
+	}
+
+	lptr v = symbol_value(&current_isolate->first_fscope, s);
+	if( v.type() != LTYPE_FUNC ) return nullptr;
+
+	for(lptr d = deps; d.type() == LTYPE_CONS; d = d.as_cons()->b)
+	{
+		if( d.as_cons()->a.as_cons()->a == s ) return v.as_func();
+	}
+	deps = lnew<cons>(lnew<cons>(s, v), deps);
+	return v.as_func();
+}
+
+lptr optimizer::each(lptr l)
+{
+	if( l.type() != LTYPE_CONS ) return l;
+	return lnew<cons>(expr(l.as_cons()->a), each(l.as_cons()->b));
+}
+
+lptr optimizer::expr(lptr e)
+{
+	if( e.type() != LTYPE_CONS ) return e;
+
+	lptr head = e.as_cons()->a;
+	lptr args = e.as_cons()->b;
+	func* G = global_func(head);
+	if( !G ) return e; // could turn out to be anything, so its arguments are left alone
+	if( G->flags & LFUNC_MACRO ) return e; // gets replaced by its expansion when it first runs
+
+	if( G->flags & LFUNC_SPECIAL )
+	{
+		if( G->ptr == (void*)&l_if )
+		{
+			args = each(args);
+			lptr test = args.type() == LTYPE_CONS ? args.as_cons()->a : lptr();
+			if( args.type() == LTYPE_CONS && constantp(test) )
+			{
+				changed = true;
+				lptr rest = args.as_cons()->b;
+				if( rest.type() != LTYPE_CONS ) return test;
+				if( !test.nilp() ) return rest.as_cons()->a;
+				rest = rest.as_cons()->b;
+				return rest.type() == LTYPE_CONS ? rest.as_cons()->a : lptr();
+			}
+		} else if( G->ptr == (void*)&lwhile || G->ptr == (void*)&begin_new_env || G->ptr == (void*)&lcatch || G->ptr == (void*)&ltime ) {
+			args = each(args);
+		} else if( G->ptr == (void*)&ldefine || G->ptr == (void*)&setf || G->ptr == (void*)&lblock || G->ptr == (void*)&return_from ) {
+			// the name stays, the rest are expressions
+			if( args.type() != LTYPE_CONS ) return e;
+			args = lnew<cons>(args.as_cons()->a, each(args.as_cons()->b));
+		} else {
+			// quote, lambda and the like don't evaluate their arguments as is
+			return e;
+		}
+		changed = true;
+		return lnew<cons>(G, args);
+	}
+
+	args = each(args);
+	changed = true;
+
+	if( G->ptr && !(G->flags & LFUNC_FFI) && pure_builtin(G) )
+	{
+		std::vector<lptr> vals;
+		for(lptr a = args; a.type() == LTYPE_CONS; a = a.as_cons()->b)
+		{
+			lptr v = a.as_cons()->a;
+			if( !constantp(v) ) return lnew<cons>(G, args);
+			// integer division by zero traps, leave that to run time
+			if( G->ptr == (void*)&l_div && !vals.empty() && v.type() == LTYPE_INT && v.as_int() == 0 ) return lnew<cons>(G, args);
+			vals.push_back(v);
+		}
+
+		lptr res = G->num_args == 1 ? ((one_arg_func*)G->ptr)(vals.size() ? vals[0] : lptr()) : ((multiarg_func*)G->ptr)(vals);
+		if( constantp(res) && res.type() != LTYPE_STR ) return res;
+	}
+
+	return lnew<cons>(G, args);
+}
+
+void optimize_func(func* F)
+{
+	Isolate* I = current_isolate;
+	F->opt_epoch = I->define_epoch;
+
+	optimizer O(F);
+	O.find_assigned(F->body);
+	lptr body = O.each(F->body);
+	gc_write_barrier(F->opt);
+	F->opt = O.changed ? lptr(lnew<cons>(body, O.deps)) : lptr();
+	return;
+}
+
+// the body to run F with: the optimized one, as long as everything it was
+// optimized against is still bound the same
+lptr func_body(func* F)
+{
+	lptr opt = F->opt;
+	if( opt.nilp() ) return F->body;
+
+	Isolate* I = current_isolate;
+	if( F->opt_epoch != I->define_epoch )
+	{
+		for(lptr d = opt.as_cons()->b; d.type() == LTYPE_CONS; d = d.as_cons()->b)
+		{
+			cons* dep = d.as_cons()->a.as_cons();
+			if( !(symbol_value(&I->first_fscope, dep->a) == dep->b) )
+			{
+				optimize_func(F);
+				return F->opt.nilp() ? F->body : F->opt.as_cons()->a;
+			}
+		}
+		F->opt_epoch = I->define_epoch;
+	}
+	return opt.as_cons()->a;
+}
@@ -0,0 +1,318 @@
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <exception>
+#include <algorithm>
+#include <stdlib.h>
+#include "types.h"
+#include "funcs.h"
+#include "isolate.h"
+
+// Each isolate lazily starts a fixed pool of worker threads. A worker pushes
+// and pops its own tasks at the back of its deque, and when that runs dry it
+// steals from the front of the other workers' deques. Threads outside the pool
+// (ie. the isolate's own thread) queue work on a shared injection deque.
+// Every worker allocates into its own heap list, so the shared heap needs no
+// lock on the allocation path.
+
+struct work_queue
+{
+	std::mutex lock;
+	std::deque<std::function<void()>> tasks;
+};
+
+struct worker
+{
+	std::thread thread;
+	work_queue queue;
+	std::vector<lobj*> heap;
+	alloc_stats alloc;
+};
+
+struct task_pool
+{
+	task_pool(Isolate* I, int n);
+	~task_pool();
+
+	void push(std::function<void()> t);
+	bool run_one(int self);
+
+	Isolate* isolate;
+	std::vector<worker*> workers;
+	work_queue injected;
+	std::mutex idle_lock;
+	std::condition_variable idle_cv;
+	std::atomic<int> pending;
+	std::atomic<int> running;
+	std::atomic<bool> quit;
+};
+
+// index of the calling thread in its isolate's pool, -1 if it isn't a worker
+thread_local int worker_index = -1;
+
+static void worker_main(task_pool* P, int idx)
+{
+	worker_index = idx;
+	current_isolate = P->isolate;
+	current_heap = &P->workers[idx]->heap;
+	current_allocs = &P->workers[idx]->alloc;
+
+	while( !P->quit )
+	{
+		if( P->run_one(idx) ) continue;
+
+		std::unique_lock<std::mutex> lk(P->idle_lock);
+		P->idle_cv.wait(lk, [&]() { return P->quit || P->pending > 0; });
+	}
+	return;
+}
+
+task_pool::task_pool(Isolate* I, int n) : isolate(I), pending(0), running(0), quit(false)
+{
+	for(int i = 0; i < n; ++i) workers.push_back(new worker);
+	for(int i = 0; i < n; ++i) workers[i]->thread = std::thread(worker_main, this, i);
+}
+
+task_pool::~task_pool()
+{
+	{
+		std::lock_guard<std::mutex> guard(idle_lock);
+		quit = true;
+	}
+	idle_cv.notify_all();
+
+	for(worker* w : workers)
+	{
+		w->thread.join();
+		// whatever the workers allocated now belongs to the isolate
+		isolate->heap.insert(isolate->heap.end(), w->heap.begin(), w->heap.end());
+		for(int t = 0; t < 16; ++t)
+		{
+			isolate->alloc.objects[t] += w->alloc.objects[t];
+			isolate->alloc.bytes[t] += w->alloc.bytes[t];
+		}
+		delete w;
+	}
+}
+
+void task_pool::push(std::function<void()> t)
+{
+	work_queue& Q = worker_index >= 0 ? workers[worker_index]->queue : injected;
+	{
+		std::lock_guard<std::mutex> guard(Q.lock);
+		Q.tasks.push_back(std::move(t));
+	}
+	pending++;
+
+	// taking the lock orders this with a worker checking pending before sleeping
+	{
+		std::lock_guard<std::mutex> guard(idle_lock);
+	}
+	idle_cv.notify_one();
+	return;
+}
+
+static bool take_task(work_queue& Q, bool back, std::function<void()>& t)
+{
+	std::lock_guard<std::mutex> guard(Q.lock);
+	if( Q.tasks.empty() ) return false;
+	if( back )
+	{
+		t = std::move(Q.tasks.back());
+		Q.tasks.pop_back();
+	} else {
+		t = std::move(Q.tasks.front());
+		Q.tasks.pop_front();
+	}
+	return true;
+}
+
+bool task_pool::run_one(int self)
+{
+	std::function<void()> t;
+	bool found = self >= 0 && take_task(workers[self]->queue, true, t);
+
+	if( !found ) found = take_task(injected, false, t);
+
+	for(size_t i = 1; !found && i <= workers.size(); ++i)
+	{
+		size_t victim = (self + i) % workers.size();
+		if( (int)victim == self ) continue;
+		found = take_task(workers[victim]->queue, false, t);
+	}
+
+	if( !found ) return false;
+
+	// running goes up before pending comes down so pool_idle never sees neither
+	running++;
+	pending--;
+	t();
+	running--;
+
+	// wake anybody in pool_wait whose result this might have been
+	{
+		std::lock_guard<std::mutex> guard(idle_lock);
+	}
+	idle_cv.notify_all();
+	return true;
+}
+
+static task_pool* pool_get(Isolate* I)
+{
+	if( !I->pool )
+	{
+		int n = std::thread::hardware_concurrency() - 1;
+		if( const char* env = getenv("ATLIS_WORKERS") ) n = atoi(env);
+		I->pool = new task_pool(I, std::max(n, 1));
+	}
+	return I->pool;
+}
+
+void pool_shutdown(Isolate* I)
+{
+	delete I->pool;
+	I->pool = nullptr;
+	return;
+}
+
+bool pool_idle(Isolate* I)
+{
+	task_pool* P = I->pool;
+	if( !P ) return true;
+	return P->pending == 0 && P->running == 0;
+}
+
+// only valid while the pool is idle
+void pool_collect_heaps(Isolate* I)
+{
+	if( !I->pool ) return;
+	for(worker* w : I->pool->workers)
+	{
+		I->heap.insert(I->heap.end(), w->heap.begin(), w->heap.end());
+		w->heap.clear();
+	}
+	return;
+}
+
+// help out with queued work until done() holds, sleeping when there's none
+template<typename Pred>
+static void pool_wait(task_pool* P, Pred done)
+{
+	while( !done() )
+	{
+		if( P->run_one(worker_index) ) continue;
+
+		std::unique_lock<std::mutex> lk(P->idle_lock);
+		trace_span span(TRACE_WAIT, "pool-wait");
+		P->idle_cv.wait(lk, [&]() { return done() || P->pending > 0; });
+	}
+	return;
+}
+
+// runs fn(0) on the calling thread and fn(1)..fn(n-1) on the pool, and
+// returns once all of them have
+void pool_parallel(Isolate* I, int n, const std::function<void(int)>& fn)
+{
+	task_pool* P = pool_get(I);
+	std::atomic<int> remaining(n-1);
+	for(int i = 1; i < n; ++i)
+	{
+		P->push([&, i]() {
+			fn(i);
+			remaining.fetch_sub(1, std::memory_order_release);
+		});
+	}
+
+	fn(0);
+	pool_wait(P, [&]() { return remaining.load(std::memory_order_acquire) == 0; });
+	return;
+}
+
+int pool_size(Isolate* I)
+{
+	return pool_get(I)->workers.size();
+}
+
+lptr future(const MultiArg& args)
+{
+	if( args.size() < 1 ) return lptr();
+
+	// the task may outlive the frame that spawned it
+	capture_env(global_scope);
+	lfuture* F = lnew<lfuture>(args[0], global_scope);
+
+	pool_get(current_isolate)->push([F]() {
+		fscope* prev = global_scope;
+		try {
+			F->value = eval({F->expr, F->env});
+		} catch(...) {
+			F->error = std::current_exception();
+		}
+		global_scope = prev;
+		F->done.store(true, std::memory_order_release);
+	});
+
+	return F;
+}
+
+lptr touch(lptr f)
+{
+	if( f.type() != LTYPE_FUTURE ) return f;
+
+	lfuture* F = f.future();
+	pool_wait(current_isolate->pool, [F]() { return F->done.load(std::memory_order_acquire); });
+
+	if( F->error ) std::rethrow_exception(F->error);
+	return F->value;
+}
+
+lptr pmap(const MultiArg& args)
+{
+	if( args.size() < 2 ) return lptr();
+
+	lptr f = args[0];
+	std::vector<lptr> in;
+	for(lptr p = args[1]; p.type() == LTYPE_CONS; p = p.as_cons()->b) in.push_back(p.as_cons()->a);
+	if( in.empty() ) return lptr();
+
+	std::vector<lptr> out(in.size());
+	task_pool* P = pool_get(current_isolate);
+
+	// a few chunks per worker so stealing can even out uneven elements
+	size_t chunk = std::max<size_t>(1, in.size() / (P->workers.size()*4 + 4));
+	size_t nchunks = (in.size() + chunk - 1) / chunk;
+
+	std::atomic<size_t> remaining(nchunks);
+	std::mutex error_lock;
+	std::exception_ptr error;
+	fscope* env = global_scope;
+
+	for(size_t c = 0; c < nchunks; ++c)
+	{
+		size_t lo = c*chunk;
+		size_t hi = std::min(in.size(), lo + chunk);
+		P->push([&, lo, hi]() {
+			fscope* prev = global_scope;
+			global_scope = env;
+			try {
+				for(size_t i = lo; i < hi; ++i) out[i] = funcall(f, {in[i]});
+			} catch(...) {
+				std::lock_guard<std::mutex> guard(error_lock);
+				if( !error ) error = std::current_exception();
+			}
+			global_scope = prev;
+			remaining.fetch_sub(1, std::memory_order_release);
+		});
+	}
+
+	pool_wait(P, [&]() { return remaining.load(std::memory_order_acquire) == 0; });
+	if( error ) std::rethrow_exception(error);
+
+	lptr res;
+	for(size_t i = out.size(); i > 0; --i) res = lnew<cons>(out[i-1], res);
+	return res;
+}
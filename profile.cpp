@@ -0,0 +1,206 @@
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "types.h"
+#include "funcs.h"
+#include "isolate.h"
+
+// A sampling profiler over Lisp functions.
+//   (profile-start [interval-us])   samples the calling thread every interval
+//                                   of its CPU time, 1000us by default
+//   (profile-stop [file])           stops, prints a flat profile to the output
+//                                   stream and, given a file, writes the
+//                                   samples there as folded stacks for
+//                                   flamegraph.pl and the like
+//
+// A timer on the thread's CPU clock sends it SIGPROF, and the handler walks
+// the scopes from global_scope through each one's caller, taking the func of
+// every call on the way. That's all the handler does: it allocates nothing and
+// writes into a buffer set aside by profile-start, dropping samples once
+// that's full. A func is known by the symbol it was first defined as, and
+// symbols live for good, so the samples can still be named after the funcs
+// are gone; a lambda with no name is known by where it was written. Builtins
+// don't get scopes, so their time is their caller's, and neither does
+// compiled code; the func call_func entered it by is counted as one frame for
+// all of it.
+//
+// Only one thread can be profiled at a time.
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+const size_t PROFILE_MAX_DEPTH = 256;  // frames kept per sample, the innermost ones
+const size_t PROFILE_BUFFER = 1<<21;   // words of samples, 16MB
+
+struct profiler
+{
+	// each sample is its depth followed by that many frames, innermost first.
+	// a frame is the func's symbol or, for a lambda that never got a name,
+	// the fixnum of where it was written, 0 if that isn't known
+	std::vector<uintptr_t> buffer;
+	std::atomic<size_t> used;
+	std::atomic<u64> samples, dropped;
+	std::atomic<bool> on;
+	timer_t timer;
+	u64 interval_us;
+};
+
+static profiler prof;
+extern lptr global_T;
+
+// also how the tracer names calls
+uintptr_t profile_frame(func* F)
+{
+	if( F->name.nilp() ) return F->pos.nilp() ? 0 : (uintptr_t)F->pos.val;
+	return (uintptr_t)F->name.val;
+}
+
+static void profile_signal(int, siginfo_t*, void*)
+{
+	if( !prof.on.load(std::memory_order_relaxed) ) return;
+
+	size_t at = prof.used.load(std::memory_order_relaxed);
+	if( at + PROFILE_MAX_DEPTH + 1 > prof.buffer.size() )
+	{
+		prof.dropped++;
+		return;
+	}
+
+	uintptr_t* out = &prof.buffer[at+1];
+	size_t n = 0;
+	jit_frame* J = jit_top;
+	if( J && J->scope == global_scope ) out[n++] = profile_frame(J->F);
+	for(fscope* s = global_scope; s && n < PROFILE_MAX_DEPTH; s = s->caller)
+	{
+		if( s->F ) out[n++] = profile_frame(s->F);
+	}
+	prof.buffer[at] = n;
+	prof.used.store(at + n + 1, std::memory_order_relaxed);
+	prof.samples++;
+	return;
+}
+
+lptr profile_start(const MultiArg& args)
+{
+	if( prof.on ) throw "profile-start: already profiling";
+
+	prof.interval_us = args.size() && args[0].type() == LTYPE_INT && (s64)args[0].as_int() > 0 ? args[0].as_int() : 1000;
+	prof.buffer.assign(PROFILE_BUFFER, 0);
+	prof.used = 0;
+	prof.samples = 0;
+	prof.dropped = 0;
+
+	struct sigaction sa = {};
+	sa.sa_sigaction = &profile_signal;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if( sigaction(SIGPROF, &sa, nullptr) ) throw "profile-start: can't install the SIGPROF handler";
+
+	struct sigevent sev = {};
+	sev.sigev_notify = SIGEV_THREAD_ID;
+	sev.sigev_signo = SIGPROF;
+	sev.sigev_notify_thread_id = syscall(SYS_gettid);
+	if( timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &prof.timer) ) throw "profile-start: can't create the timer";
+
+	prof.on = true;
+	struct itimerspec its = {};
+	its.it_interval.tv_sec = prof.interval_us / 1000000;
+	its.it_interval.tv_nsec = (prof.interval_us % 1000000) * 1000;
+	its.it_value = its.it_interval;
+	timer_settime(prof.timer, 0, &its, nullptr);
+	return global_T;
+}
+
+std::string profile_frame_name(uintptr_t f)
+{
+	if( !f ) return "<lambda>";
+	lptr x;
+	x.val = f;
+	if( x.type() == LTYPE_INT ) return "<lambda " + source_describe(x.as_int()) + ">";
+	return x.sym()->name;
+}
+
+// the flat profile says where named funcs are too, if what they're bound to
+// now was read from source
+static std::string frame_label(uintptr_t f)
+{
+	std::string name = profile_frame_name(f);
+	lptr x;
+	x.val = f;
+	if( !f || x.type() != LTYPE_SYM ) return name;
+	lptr v = symbol_value(&current_isolate->first_fscope, x);
+	if( v.type() != LTYPE_FUNC || v.as_func()->pos.nilp() ) return name;
+	return name + " " + source_describe(v.as_func()->pos.as_int());
+}
+
+lptr profile_stop(const MultiArg& args)
+{
+	if( !prof.on ) throw "profile-stop: not profiling";
+	timer_delete(prof.timer);
+	prof.on = false;
+
+	// stacks root first, as folded output wants them
+	std::map<std::vector<uintptr_t>, u64> stacks;
+	std::unordered_map<uintptr_t, u64> self, total;
+	size_t end = prof.used;
+	for(size_t at = 0; at < end; at += prof.buffer[at] + 1)
+	{
+		size_t n = prof.buffer[at];
+		const uintptr_t* frames = &prof.buffer[at+1];
+		stacks[std::vector<uintptr_t>(std::reverse_iterator<const uintptr_t*>(frames+n), std::reverse_iterator<const uintptr_t*>(frames))]++;
+
+		if( !n ) continue;
+		self[frames[0]]++;
+		// recursion counts once towards a func's total
+		for(size_t i = 0; i < n; ++i)
+		{
+			if( std::find(frames, frames+i, frames[i]) == frames+i ) total[frames[i]]++;
+		}
+	}
+
+	u64 samples = prof.samples;
+	std::vector<std::pair<uintptr_t, u64>> flat(self.begin(), self.end());
+	for(auto& t : total) if( !self.count(t.first) ) flat.push_back({t.first, 0});
+	std::sort(flat.begin(), flat.end(), [&](const auto& a, const auto& b) {
+		return a.second != b.second ? a.second > b.second : total[a.first] > total[b.first];
+	});
+
+	char line[256];
+	std::string out;
+	snprintf(line, sizeof(line), "; %llu samples %llu us apart, %llu dropped\n;  self%%  total%%    self   total  function\n",
+		(unsigned long long)samples, (unsigned long long)prof.interval_us, (unsigned long long)prof.dropped);
+	out += line;
+	for(auto& f : flat)
+	{
+		u64 t = total[f.first];
+		snprintf(line, sizeof(line), "; %5.1f%%  %5.1f%%  %6llu  %6llu  %s\n",
+			samples ? 100.0 * f.second / samples : 0.0, samples ? 100.0 * t / samples : 0.0,
+			(unsigned long long)f.second, (unsigned long long)t, frame_label(f.first).c_str());
+		out += line;
+	}
+	lstream_write_string(current_isolate->lisp_out_stream, out);
+
+	if( args.size() && args[0].type() == LTYPE_STR )
+	{
+		std::ofstream folded(args[0].string()->c_str());
+		if( !folded ) throw "profile-stop: can't write the folded stacks";
+		for(auto& s : stacks)
+		{
+			if( s.first.empty() ) folded << "<toplevel>";
+			for(size_t i = 0; i < s.first.size(); ++i) folded << (i ? ";" : "") << profile_frame_name(s.first[i]);
+			folded << " " << s.second << "\n";
+		}
+	}
+
+	prof.buffer = std::vector<uintptr_t>();
+	return lptr(samples);
+}
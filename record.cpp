@@ -0,0 +1,148 @@
+#include <vector>
+#include "types.h"
+#include "funcs.h"
+#include "isolate.h"
+
+// (define-record-type point (make-point x y) point? (x point-x set-point-x!) (y point-y))
+// defines the type point, a constructor taking the fields it lists (the rest
+// start out nil), a predicate and for each field an accessor and, optionally,
+// a modifier. A bare symbol in place of the constructor spec makes one that
+// takes every field in order.
+//
+// The type is the frozen list (name field...); an instance is an lrecord with
+// that list as its rtd and a slot per field. The procedures are funcs flagged
+// LFUNC_RECORD, whose ptr is one of the record_procs below, body the type and
+// params the slot they work on; the constructor's params is the number of
+// fields consed onto the slots its arguments go to. An
+// accessor checks it was given a record of its type and loads the slot, which
+// eval does inline when the optimizer has put the accessor in place of its
+// name.
+
+extern lptr global_T;
+extern lptr QUOTE;
+
+lrecord* lrecord_new(lptr rtd, u32 n)
+{
+	lrecord* R = new(::operator new(lrecord::size(n))) lrecord(rtd, n);
+	heap_new((lobj*)R, lrecord::size(n));
+	return R;
+}
+
+static lptr record_make(func* F, const MultiArg& args)
+{
+	cons* layout = F->params.as_cons();
+	lrecord* R = lrecord_new(F->body, layout->a.as_int());
+	size_t i = 0;
+	for(lptr s = layout->b; s.type() == LTYPE_CONS; s = s.as_cons()->b, ++i)
+	{
+		R->slots[s.as_cons()->a.as_int()] = args[i];
+	}
+	return R;
+}
+
+static lptr record_is(func* F, const MultiArg& args)
+{
+	lptr r = args[0];
+	return r.type() == LTYPE_RECORD && r.record()->rtd == F->body ? global_T : lptr();
+}
+
+lptr record_get(func* F, const MultiArg& args)
+{
+	return record_get_c(F, args[0]);
+}
+
+static lptr record_set(func* F, const MultiArg& args)
+{
+	lptr r = args[0];
+	if( r.type() != LTYPE_RECORD || !(r.record()->rtd == F->body) ) throw "record modifier: not a record of its type";
+	if( r.record()->type & LGC_FROZEN ) throw "record modifier: record is frozen";
+
+	lptr& slot = r.record()->slots[F->params.as_int()];
+	gc_write_barrier(slot);
+	slot = args[1];
+	return args[1];
+}
+
+static func* record_func(record_proc* p, lptr rtd, lptr data, u32 nargs)
+{
+	func* F = lnew<func>((void*)p, LFUNC_RECORD, nargs);
+	F->body = rtd;
+	F->params = data;
+	return F;
+}
+
+static void define_global(lptr sym, lptr val)
+{
+	// ldefine evaluates the value, and quoted it comes back as it is
+	ldefine({sym, lnew<cons>(QUOTE, lnew<cons>(val, lptr()))});
+	return;
+}
+
+static s64 field_slot(lptr rtd, lptr field)
+{
+	s64 i = 0;
+	for(lptr f = rtd.as_cons()->b; f.type() == LTYPE_CONS; f = f.as_cons()->b, ++i)
+	{
+		if( f.as_cons()->a == field ) return i;
+	}
+	return -1;
+}
+
+lptr define_record_type(const MultiArg& args)
+{
+	if( args.size() < 2 || args[0].type() != LTYPE_SYM ) throw "define-record-type: expected a type name";
+
+	// the type first, so the procedures can refer to it
+	std::vector<lptr> fields;
+	for(size_t i = 3; i < args.size(); ++i)
+	{
+		lptr spec = args[i];
+		lptr name = spec.type() == LTYPE_CONS ? spec.as_cons()->a : spec;
+		if( name.type() != LTYPE_SYM ) throw "define-record-type: bad field spec";
+		fields.push_back(name);
+	}
+	lptr rtd;
+	for(size_t i = fields.size(); i > 0; --i) rtd = lnew<cons>(fields[i-1], rtd);
+	// frozen, so frozen records and ones sent over a channel can point at it
+	// and still be of the type
+	rtd = freeze(lnew<cons>(args[0], rtd));
+	define_global(args[0], rtd);
+
+	lptr ctor = args[1];
+	if( ctor.type() == LTYPE_SYM )
+	{
+		lptr slots;
+		for(size_t i = fields.size(); i > 0; --i) slots = lnew<cons>((u64)(i-1), slots);
+		define_global(ctor, record_func(&record_make, rtd, lnew<cons>((u64)fields.size(), slots), fields.size()));
+	} else if( ctor.type() == LTYPE_CONS ) {
+		std::vector<lptr> slots;
+		for(lptr a = ctor.as_cons()->b; a.type() == LTYPE_CONS; a = a.as_cons()->b)
+		{
+			s64 i = field_slot(rtd, a.as_cons()->a);
+			if( i < 0 ) throw "define-record-type: constructor takes a field the type doesn't have";
+			slots.push_back((u64)i);
+		}
+		lptr list;
+		for(size_t i = slots.size(); i > 0; --i) list = lnew<cons>(slots[i-1], list);
+		define_global(ctor.as_cons()->a, record_func(&record_make, rtd, lnew<cons>((u64)fields.size(), list), slots.size()));
+	}
+
+	if( args.size() > 2 && args[2].type() == LTYPE_SYM ) define_global(args[2], record_func(&record_is, rtd, lptr(), 1));
+
+	for(size_t i = 3; i < args.size(); ++i)
+	{
+		lptr spec = args[i];
+		if( spec.type() != LTYPE_CONS ) continue;
+		lptr slot = (u64)(i-3);
+
+		lptr rest = spec.as_cons()->b;
+		if( rest.type() != LTYPE_CONS ) continue;
+		define_global(rest.as_cons()->a, record_func(&record_get, rtd, slot, 1));
+
+		rest = rest.as_cons()->b;
+		if( rest.type() != LTYPE_CONS ) continue;
+		define_global(rest.as_cons()->a, record_func(&record_set, rtd, slot, 2));
+	}
+
+	return args[0];
+}
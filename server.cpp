@@ -0,0 +1,406 @@
+#include <vector>
+#include <deque>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <unordered_map>
+#include <iostream>
+#include <cstring>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "types.h"
+#include "funcs.h"
+#include "isolate.h"
+
+// Daemon mode: a set of warm worker isolates answering eval requests on a
+// Unix-domain socket, so a job doesn't pay for process startup and loading
+// its prelude every time.
+//
+// Protocol, both ways: a 4 byte big-endian length, then that many bytes.
+// A request is Lisp source. A response starts with a status byte, 'o' when
+// the source evaluated or 'e' when it threw, followed by whatever it
+// displayed and the printed value of its last form (or the error message).
+// A client may send any number of requests without waiting; responses on a
+// connection come back in request order.
+//
+// One I/O thread owns every socket. Each connection is assigned to one worker
+// isolate, which evaluates its requests in order; workers are shared by the
+// connections assigned to them, and so are their global definitions.
+
+const size_t SERVER_MAX_FRAME = 64<<20;
+
+struct server_conn
+{
+	server_conn(int f, int w) : fd(f), worker(w), pending(0), eof(false), registered(true) {}
+
+	int fd;
+	int worker;
+	std::string in;   // bytes read but not yet a whole frame
+	std::string wbuf; // responses the socket hasn't taken yet
+	size_t pending;   // requests not yet moved into wbuf
+	bool eof;         // the client is done sending
+	bool registered;  // in the epoll set
+
+	// filled in by the worker, moved to wbuf by the I/O thread
+	std::mutex lock;
+	std::string done;
+	size_t ndone = 0;
+};
+
+struct server_job
+{
+	std::shared_ptr<server_conn> conn;
+	std::string src;
+};
+
+struct server_worker
+{
+	Isolate* I;
+	std::stringstream out; // the isolate's standard output, sent with each response
+	std::thread thread;
+	std::mutex lock;
+	std::condition_variable cv;
+	std::deque<server_job> jobs;
+};
+
+struct server
+{
+	int listen_fd, epfd, wake_fd;
+	std::vector<server_worker*> workers;
+	std::unordered_map<int, std::shared_ptr<server_conn>> conns;
+	std::atomic<bool> quit{false};
+
+	std::mutex ready_lock;
+	std::vector<std::shared_ptr<server_conn>> ready; // connections with new responses
+	int next_worker = 0;
+};
+
+static void frame_append(std::string& buf, char status, std::string_view body)
+{
+	u32 len = htonl(body.size() + 1);
+	buf.append((const char*)&len, 4);
+	buf += status;
+	buf.append(body);
+	return;
+}
+
+static void server_worker_run(server* SV, server_worker* W)
+{
+	while( true )
+	{
+		server_job job;
+		{
+			std::unique_lock<std::mutex> guard(W->lock);
+			W->cv.wait(guard, [&] { return !W->jobs.empty() || SV->quit; });
+			if( W->jobs.empty() ) return;
+			job = std::move(W->jobs.front());
+			W->jobs.pop_front();
+		}
+
+		char status = 'o';
+		std::string res;
+		try {
+			res = isolate_eval_string(W->I, job.src);
+		} catch(const char* e) {
+			status = 'e';
+			res = e + error_site();
+		} catch(std::exception& e) {
+			status = 'e';
+			res = e.what();
+		}
+		std::string body = W->out.str() + res;
+		W->out.str("");
+
+		{
+			std::lock_guard<std::mutex> guard(job.conn->lock);
+			frame_append(job.conn->done, status, body);
+			job.conn->ndone++;
+		}
+		{
+			std::lock_guard<std::mutex> guard(SV->ready_lock);
+			SV->ready.push_back(job.conn);
+		}
+		u64 one = 1;
+		(void) !::write(SV->wake_fd, &one, 8);
+	}
+}
+
+static void server_watch(server* SV, server_conn* C)
+{
+	epoll_event ev;
+	ev.events = (C->eof ? 0 : (u32)EPOLLIN) | (C->wbuf.empty() ? 0 : (u32)EPOLLOUT);
+	ev.data.fd = C->fd;
+
+	// a client that hung up keeps reporting EPOLLHUP, so while it only waits
+	// for responses it's taken out of the set altogether
+	if( !ev.events )
+	{
+		if( C->registered ) epoll_ctl(SV->epfd, EPOLL_CTL_DEL, C->fd, nullptr);
+		C->registered = false;
+		return;
+	}
+	epoll_ctl(SV->epfd, C->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, C->fd, &ev);
+	C->registered = true;
+	return;
+}
+
+static void server_drop(server* SV, server_conn* C)
+{
+	if( C->registered ) epoll_ctl(SV->epfd, EPOLL_CTL_DEL, C->fd, nullptr);
+	::close(C->fd);
+	// a worker may still hold the connection for a request it's running
+	SV->conns.erase(C->fd);
+	return;
+}
+
+// sends what it can; returns false if the connection is finished with
+static bool server_flush(server_conn* C)
+{
+	size_t done = 0;
+	while( done < C->wbuf.size() )
+	{
+		ssize_t n = ::send(C->fd, C->wbuf.data()+done, C->wbuf.size()-done, MSG_NOSIGNAL);
+		if( n > 0 )
+		{
+			done += n;
+			continue;
+		}
+		if( n < 0 && errno == EINTR ) continue;
+		if( n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ) break;
+		return false;
+	}
+	C->wbuf.erase(0, done);
+	return !(C->eof && C->pending == 0 && C->wbuf.empty());
+}
+
+static void server_dispatch(server* SV, const std::shared_ptr<server_conn>& C, std::string src)
+{
+	server_worker* W = SV->workers[C->worker];
+	C->pending++;
+	{
+		std::lock_guard<std::mutex> guard(W->lock);
+		W->jobs.push_back(server_job{C, std::move(src)});
+	}
+	W->cv.notify_one();
+	return;
+}
+
+// reads whatever arrived and hands every complete frame to the connection's worker
+static bool server_read(server* SV, const std::shared_ptr<server_conn>& C)
+{
+	char buf[65536];
+	while( true )
+	{
+		ssize_t n = ::recv(C->fd, buf, sizeof(buf), 0);
+		if( n > 0 )
+		{
+			C->in.append(buf, n);
+			continue;
+		}
+		if( n < 0 && errno == EINTR ) continue;
+		if( n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ) break;
+		if( n < 0 ) return false;
+		C->eof = true;
+		break;
+	}
+
+	size_t pos = 0;
+	while( C->in.size() - pos >= 4 )
+	{
+		u32 len;
+		memcpy(&len, C->in.data()+pos, 4);
+		len = ntohl(len);
+		if( len > SERVER_MAX_FRAME ) return false;
+		if( C->in.size() - pos - 4 < len ) break;
+		server_dispatch(SV, C, C->in.substr(pos+4, len));
+		pos += 4 + len;
+	}
+	C->in.erase(0, pos);
+
+	server_watch(SV, C.get());
+	return !(C->eof && C->pending == 0 && C->wbuf.empty());
+}
+
+static void server_accept(server* SV)
+{
+	while( true )
+	{
+		int fd = ::accept4(SV->listen_fd, nullptr, nullptr, SOCK_NONBLOCK|SOCK_CLOEXEC);
+		if( fd < 0 ) return;
+
+		auto C = std::make_shared<server_conn>(fd, SV->next_worker++ % SV->workers.size());
+		SV->conns[fd] = C;
+		epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		epoll_ctl(SV->epfd, EPOLL_CTL_ADD, fd, &ev);
+	}
+}
+
+// moves finished responses onto their connections' write buffers
+static void server_collect(server* SV)
+{
+	u64 n;
+	(void) !::read(SV->wake_fd, &n, 8);
+
+	std::vector<std::shared_ptr<server_conn>> ready;
+	{
+		std::lock_guard<std::mutex> guard(SV->ready_lock);
+		ready.swap(SV->ready);
+	}
+
+	for(auto& C : ready)
+	{
+		// already dropped, and maybe queued more than once
+		if( SV->conns.find(C->fd) == SV->conns.end() || SV->conns[C->fd] != C ) continue;
+		{
+			std::lock_guard<std::mutex> guard(C->lock);
+			C->wbuf += C->done;
+			C->pending -= C->ndone;
+			C->done.clear();
+			C->ndone = 0;
+		}
+		if( !server_flush(C.get()) )
+			server_drop(SV, C.get());
+		else
+			server_watch(SV, C.get());
+	}
+	return;
+}
+
+static server* the_server = nullptr;
+
+static void server_stop(int)
+{
+	if( !the_server ) return;
+	the_server->quit = true;
+	u64 one = 1;
+	(void) !::write(the_server->wake_fd, &one, 8);
+	return;
+}
+
+int server_run(const std::string& path, int nworkers, const std::vector<std::string>& preload)
+{
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if( path.size() >= sizeof(addr.sun_path) )
+	{
+		std::cerr << "socket path too long: " << path << std::endl;
+		return 1;
+	}
+	memcpy(addr.sun_path, path.data(), path.size());
+
+	server SV;
+	SV.listen_fd = ::socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	::unlink(path.c_str());
+	if( SV.listen_fd < 0 || ::bind(SV.listen_fd, (sockaddr*)&addr, sizeof(addr)) < 0 || ::listen(SV.listen_fd, SOMAXCONN) < 0 )
+	{
+		std::cerr << "can't listen on " << path << ": " << strerror(errno) << std::endl;
+		return 1;
+	}
+	SV.epfd = epoll_create1(EPOLL_CLOEXEC);
+	SV.wake_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+
+	// load the prelude once per worker, before anybody can connect
+	std::vector<std::string> prelude;
+	for(const std::string& file : preload)
+	{
+		std::ifstream f(file, std::ios_base::binary);
+		if( !f )
+		{
+			std::cerr << "can't read " << file << std::endl;
+			return 1;
+		}
+		prelude.emplace_back(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+	}
+
+	if( nworkers < 1 ) nworkers = 1;
+	for(int i = 0; i < nworkers; ++i)
+	{
+		server_worker* W = new server_worker;
+		W->I = isolate_create(&std::cin, &W->out);
+		try {
+			for(size_t j = 0; j < prelude.size(); ++j) isolate_eval(W->I, prelude[j], preload[j]);
+		} catch(const char* e) {
+			std::cerr << "prelude: " << e << error_site() << std::endl;
+			return 1;
+		}
+		W->out.str("");
+		W->thread = std::thread(server_worker_run, &SV, W);
+		SV.workers.push_back(W);
+	}
+
+	the_server = &SV;
+	signal(SIGINT, server_stop);
+	signal(SIGTERM, server_stop);
+	signal(SIGPIPE, SIG_IGN);
+
+	epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = SV.listen_fd;
+	epoll_ctl(SV.epfd, EPOLL_CTL_ADD, SV.listen_fd, &ev);
+	ev.data.fd = SV.wake_fd;
+	epoll_ctl(SV.epfd, EPOLL_CTL_ADD, SV.wake_fd, &ev);
+
+	epoll_event events[256];
+	while( !SV.quit )
+	{
+		int n = epoll_wait(SV.epfd, events, 256, -1);
+		for(int i = 0; i < n; ++i)
+		{
+			int fd = events[i].data.fd;
+			if( fd == SV.listen_fd )
+			{
+				server_accept(&SV);
+				continue;
+			}
+			if( fd == SV.wake_fd )
+			{
+				server_collect(&SV);
+				continue;
+			}
+
+			auto it = SV.conns.find(fd);
+			if( it == SV.conns.end() ) continue;
+			std::shared_ptr<server_conn> C = it->second;
+
+			bool keep = true;
+			if( events[i].events & EPOLLOUT ) keep = server_flush(C.get());
+			if( keep && events[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR) && !C->eof ) keep = server_read(&SV, C);
+			if( keep )
+				server_watch(&SV, C.get());
+			else
+				server_drop(&SV, C.get());
+		}
+	}
+
+	for(server_worker* W : SV.workers)
+	{
+		{
+			std::lock_guard<std::mutex> guard(W->lock);
+			W->cv.notify_all();
+		}
+		W->thread.join();
+		isolate_destroy(W->I);
+		delete W;
+	}
+	for(auto& c : SV.conns) ::close(c.first);
+	::close(SV.listen_fd);
+	::close(SV.epfd);
+	::close(SV.wake_fd);
+	::unlink(path.c_str());
+	the_server = nullptr;
+	return 0;
+}
@@ -0,0 +1,133 @@
+#include <string>
+#include <vector>
+#include <mutex>
+#include <fstream>
+#include "types.h"
+#include "funcs.h"
+#include "isolate.h"
+
+// Source positions. Reading from a stream flagged LSTREAM_SOURCE (the REPL's
+// input, load, isolate_eval given a file name) notes the file, line and column
+// each list starts at. The position goes in the isolate's side table keyed by
+// the list's first cons, so conses stay two words, and the cons is flagged
+// LOBJ_HAS_POS so the sweep only looks in the table for conses that have an
+// entry. Nothing looks positions up until something asks: a lambda keeps the
+// position of its definition in func::pos, for the profiler and for errors.
+//   (load "file")                 evaluates the file's forms, noting positions
+//   (source-position form)        ("file" line column) of a list read from
+//                                 source, or nil
+//
+// A position is packed into one fixnum: a file number (an index into the
+// process-wide list of file names) << 48, the line << 16 and the column.
+
+static std::mutex files_lock;
+static std::vector<std::string> files = {""}; // 0 is no file
+
+u32 source_file(std::string_view name)
+{
+	std::lock_guard<std::mutex> guard(files_lock);
+	for(size_t i = 1; i < files.size(); ++i)
+	{
+		if( files[i] == name ) return i;
+	}
+	// the file number has 11 bits, so a position is a positive fixnum; past
+	// that positions just have no file
+	if( files.size() >= 2048 ) return 0;
+	files.push_back(std::string(name));
+	return files.size()-1;
+}
+
+u64 source_pack(u32 file, u32 line, u32 col)
+{
+	return ((u64)file << 48) | ((u64)line << 16) | (col > 0xffff ? 0xffff : col);
+}
+
+std::string source_describe(u64 pos)
+{
+	std::string file;
+	{
+		std::lock_guard<std::mutex> guard(files_lock);
+		u32 f = pos >> 48;
+		if( f < files.size() ) file = files[f];
+	}
+	return (file.empty() ? "?" : file) + ":" + std::to_string((pos >> 16) & 0xffffffff) + ":" + std::to_string(pos & 0xffff);
+}
+
+void source_note(lptr x, u64 pos)
+{
+	if( x.type() != LTYPE_CONS || !pos ) return;
+	cons* c = x.as_cons();
+	c->type |= LOBJ_HAS_POS;
+	current_isolate->positions[(lobj*)c] = pos;
+	return;
+}
+
+u64 source_pos(lptr x)
+{
+	if( x.type() != LTYPE_CONS || !(x.as_cons()->type & LOBJ_HAS_POS) ) return 0;
+	auto it = current_isolate->positions.find((lobj*)x.as_cons());
+	return it == current_isolate->positions.end() ? 0 : it->second;
+}
+
+lptr source_position(lptr x)
+{
+	u64 pos = source_pos(x);
+	if( !pos ) return lptr();
+
+	lstr* file;
+	{
+		std::lock_guard<std::mutex> guard(files_lock);
+		file = lnew<lstr>(files[pos >> 48]);
+	}
+	return lnew<cons>(file, lnew<cons>(lptr((pos >> 16) & 0xffffffff), lnew<cons>(lptr(pos & 0xffff), lptr())));
+}
+
+lptr lload(lptr path)
+{
+	if( path.type() != LTYPE_STR ) throw "load: expected a file name";
+
+	std::fstream* f = new std::fstream(path.string()->c_str(), std::ios_base::in);
+	if( !*f )
+	{
+		delete f;
+		throw "load: can't open file";
+	}
+	lptr port = lnew<lstream>(f, LSTREAM_FILE|LSTREAM_IN|LSTREAM_SOURCE);
+	port.stream()->file = source_file(path.string()->str());
+
+	lptr keep[2] = {port};
+	local_roots roots(nullptr, keep, 2);
+	while( !lstream_at_eof(port) ) keep[1] = eval({lread({port})});
+	lclose(port);
+	return keep[1];
+}
+
+// The innermost interpreted call an error left, for the message whoever
+// reports the error prints. call_func notes it as the error passes through.
+static thread_local u64 error_pos;
+static thread_local lptr error_name;
+static thread_local bool error_noted;
+
+void error_site_note(func* F)
+{
+	if( error_noted ) return;
+	error_noted = true;
+	error_pos = F->pos.nilp() ? 0 : F->pos.as_int();
+	error_name = F->name;
+	return;
+}
+
+void error_site_clear()
+{
+	error_noted = false;
+	return;
+}
+
+std::string error_site()
+{
+	if( !error_noted ) return "";
+	std::string s = " (in ";
+	s += error_name.nilp() ? "<lambda>" : error_name.sym()->name;
+	if( error_pos ) s += " at " + source_describe(error_pos);
+	return s + ")";
+}
@@ -0,0 +1,114 @@
+#include <chrono>
+#include <string>
+#include <stdio.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "types.h"
+#include "funcs.h"
+#include "isolate.h"
+
+// (time body...) runs body like begin and prints what it took to the output
+// stream: wall time, cycles, what was allocated by type and the collections
+// that ran meanwhile. (runtime-stats) gives the same counters as an assoc
+// list, running totals for the isolate to take differences of.
+//
+// Cycles are the time stamp counter, which on anything recent ticks at a
+// constant rate whatever the core's clock is doing; without one they're
+// nanoseconds. Allocations are counted as they're made, by lnew and for each
+// call's scope, and bytes are the object plus any buffer it comes with. What
+// future and pmap allocate is counted once the isolate's pool shuts down.
+
+const char* const heap_type_names[16] = {
+	nullptr, nullptr, nullptr, nullptr, "function", "cons", nullptr, "string",
+	"scope", "stream", "future", "channel", "bytes", "record", nullptr, nullptr,
+};
+
+static u64 cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+struct runtime_counters
+{
+	runtime_counters() : wall(std::chrono::steady_clock::now()), cycles(::cycles()), alloc(*current_allocs),
+		collections(current_isolate->gc.collections), pause_us(current_isolate->gc.total_pause_us) {}
+
+	std::chrono::steady_clock::time_point wall;
+	u64 cycles;
+	alloc_stats alloc;
+	u64 collections;
+	u64 pause_us;
+};
+
+static std::string time_report(const runtime_counters& from, const runtime_counters& to)
+{
+	char buf[128];
+	double ms = std::chrono::duration<double, std::milli>(to.wall - from.wall).count();
+	snprintf(buf, sizeof(buf), "; %.3f ms, %llu cycles\n", ms, (unsigned long long)(to.cycles - from.cycles));
+	std::string out = buf;
+
+	u64 objects = 0, bytes = 0;
+	std::string by_type;
+	for(int t = 0; t < 16; ++t)
+	{
+		u64 n = to.alloc.objects[t] - from.alloc.objects[t];
+		if( !n ) continue;
+		u64 b = to.alloc.bytes[t] - from.alloc.bytes[t];
+		objects += n;
+		bytes += b;
+		snprintf(buf, sizeof(buf), "%s %llu %s (%llu bytes)", by_type.empty() ? ":" : ",", (unsigned long long)n,
+			heap_type_names[t] ? heap_type_names[t] : "other", (unsigned long long)b);
+		by_type += buf;
+	}
+	snprintf(buf, sizeof(buf), "; allocated %llu objects, %llu bytes", (unsigned long long)objects, (unsigned long long)bytes);
+	out += buf + by_type + "\n";
+
+	snprintf(buf, sizeof(buf), "; %llu collections, %llu us paused\n",
+		(unsigned long long)(to.collections - from.collections), (unsigned long long)(to.pause_us - from.pause_us));
+	return out + buf;
+}
+
+lptr ltime(const MultiArg& args)
+{
+	runtime_counters from;
+
+	lptr res;
+	local_roots roots(nullptr, &res, 1);
+	for(size_t i = 0; i < args.size(); ++i) res = eval({args[i]});
+
+	runtime_counters to;
+	lstream_write_string(current_isolate->lisp_out_stream, time_report(from, to));
+	return res;
+}
+
+lptr runtime_stats()
+{
+	runtime_counters now;
+	auto entry = [](const char* name, lptr v) { return lptr(lnew<cons>(intern_c(name), v)); };
+
+	// (type objects bytes) for each type there's been any of
+	lptr by_type;
+	u64 objects = 0, bytes = 0;
+	for(int t = 15; t >= 0; --t)
+	{
+		if( !now.alloc.objects[t] ) continue;
+		objects += now.alloc.objects[t];
+		bytes += now.alloc.bytes[t];
+		lptr counts = lnew<cons>(lptr(now.alloc.objects[t]), lnew<cons>(lptr(now.alloc.bytes[t]), lptr()));
+		by_type = lnew<cons>(lnew<cons>(intern_c(heap_type_names[t] ? heap_type_names[t] : "other"), counts), by_type);
+	}
+
+	u64 us = std::chrono::duration_cast<std::chrono::microseconds>(now.wall.time_since_epoch()).count();
+	return lnew<cons>(entry("real-time-us", us),
+		lnew<cons>(entry("cycles", now.cycles),
+		lnew<cons>(entry("allocated-objects", objects),
+		lnew<cons>(entry("allocated-bytes", bytes),
+		lnew<cons>(entry("allocations", by_type),
+		lnew<cons>(entry("collections", now.collections),
+		lnew<cons>(entry("gc-pause-us", now.pause_us), lptr())))))));
+}
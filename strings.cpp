@@ -0,0 +1,191 @@
+#include <string>
+#include <string_view>
+#include <vector>
+#include <mutex>
+#include <stdlib.h>
+#include <string.h>
+#include "types.h"
+#include "funcs.h"
+#include "isolate.h"
+
+// Strings never change once made, which is what lets them share text.
+//   (string-length s)
+//   (string-ref s i)                the character at i, a number as
+//                                   read-char gives
+//   (substring s start [end])       a slice of s's text, not a copy, unless
+//                                   it's short enough to be small
+//   (string-append s...)            short results are copied, longer ones
+//                                   are ropes of the pieces
+//
+// A rope is only made flat when its text is read, by which time it's usually
+// done growing, so building a string up piece by piece copies it once rather
+// than once per piece. A slice keeps the whole of its parent's text alive.
+//
+// Pool threads read the same strings as the isolate's, so flattening a rope,
+// or giving a slice its own text for c_str, happens under a lock and only
+// ever sets flat, with a release store once the text is all there. Nothing
+// else about the string changes, so a reader that found flat empty can still
+// go by kind and the slice or rope fields. Once flat is set the collector
+// stops tracing the parent or the pieces.
+
+const u32 LSTR_ROPE_MIN = 256; // shorter results of string-append are copied
+
+static std::mutex flatten_lock;
+
+lstr::lstr(std::string_view s) : type(LTYPE_STR), len(s.size()), flat(nullptr)
+{
+	if( len <= LSTR_SMALL )
+	{
+		kind = LSTR_KIND_SMALL;
+		memcpy(small, s.data(), len);
+		small[len] = 0;
+		return;
+	}
+	kind = LSTR_KIND_FLAT;
+	flat = (char*) malloc(len + 1);
+	memcpy(flat, s.data(), len);
+	flat[len] = 0;
+	return;
+}
+
+lstr::lstr(lstr* parent, u32 off, u32 n) : type(LTYPE_STR), len(n), flat(nullptr)
+{
+	std::string_view t = parent->str().substr(off, n);
+	if( n <= LSTR_SMALL )
+	{
+		kind = LSTR_KIND_SMALL;
+		memcpy(small, t.data(), n);
+		small[n] = 0;
+		return;
+	}
+	// a slice of a slice is a slice of the original, unless the slice has text
+	// of its own by now. str() gave a rope its own
+	if( parent->kind == LSTR_KIND_SLICE && !parent->flat_text() )
+	{
+		off += parent->slice.off;
+		parent = parent->slice.parent;
+	}
+	kind = LSTR_KIND_SLICE;
+	slice.parent = parent;
+	slice.off = off;
+	return;
+}
+
+lstr::lstr(lstr* left, lstr* right) : type(LTYPE_STR), len(left->len + right->len), flat(nullptr), kind(LSTR_KIND_ROPE)
+{
+	rope.left = left;
+	rope.right = right;
+	return;
+}
+
+lstr::~lstr()
+{
+	free(flat);
+	return;
+}
+
+std::string_view lstr::flatten()
+{
+	std::lock_guard<std::mutex> guard(flatten_lock);
+	if( kind == LSTR_KIND_SMALL ) return std::string_view(small, len);
+	if( flat ) return std::string_view(flat, len);
+
+	char* buf = (char*) malloc(len + 1);
+	if( kind == LSTR_KIND_SLICE )
+	{
+		memcpy(buf, slice.parent->str().data() + slice.off, len);
+		gc_write_barrier(slice.parent);
+	} else {
+		// pieces left to right, without recursing down a rope that was built
+		// one append at a time
+		std::vector<lstr*> todo = {rope.right, rope.left};
+		size_t at = 0;
+		while( !todo.empty() )
+		{
+			lstr* s = todo.back();
+			todo.pop_back();
+			if( s->kind == LSTR_KIND_ROPE && !s->flat )
+			{
+				todo.push_back(s->rope.right);
+				todo.push_back(s->rope.left);
+				continue;
+			}
+			std::string_view t = s->str();
+			memcpy(buf + at, t.data(), t.size());
+			at += t.size();
+		}
+		gc_write_barrier(rope.left);
+		gc_write_barrier(rope.right);
+	}
+	buf[len] = 0;
+
+	__atomic_store_n(&flat, buf, __ATOMIC_RELEASE);
+	return std::string_view(buf, len);
+}
+
+lptr string_length(lptr s)
+{
+	if( s.type() != LTYPE_STR ) throw "string-length: expected a string";
+	return lptr((u64)s.string()->len);
+}
+
+lptr string_ref(const MultiArg& args)
+{
+	if( args.size() < 2 || args[0].type() != LTYPE_STR || args[1].type() != LTYPE_INT ) throw "string-ref: expected a string and an index";
+	lstr* S = args[0].string();
+	s64 i = args[1].as_int();
+	if( i < 0 || i >= S->len ) throw "string-ref: index out of range";
+	return lptr(S->str()[i]);
+}
+
+lptr substring(const MultiArg& args)
+{
+	if( args.size() < 2 || args[0].type() != LTYPE_STR || args[1].type() != LTYPE_INT ) throw "substring: expected a string and a start";
+	lstr* S = args[0].string();
+	s64 start = args[1].as_int();
+	s64 end = S->len;
+	if( args.size() > 2 )
+	{
+		if( args[2].type() != LTYPE_INT ) throw "substring: expected an end";
+		end = args[2].as_int();
+	}
+	if( start < 0 || end < start || end > S->len ) throw "substring: range out of bounds";
+
+	if( start == 0 && end == S->len ) return args[0];
+	return lnew<lstr>(S, (u32)start, (u32)(end - start));
+}
+
+lptr string_append(const MultiArg& args)
+{
+	u64 total = 0;
+	for(size_t i = 0; i < args.size(); ++i)
+	{
+		if( args[i].type() != LTYPE_STR ) throw "string-append: expected strings";
+		total += args[i].string()->len;
+	}
+	if( total > 0xffffffff ) throw "string-append: string too long";
+
+	if( total < LSTR_ROPE_MIN )
+	{
+		char buf[LSTR_ROPE_MIN];
+		size_t at = 0;
+		for(size_t i = 0; i < args.size(); ++i)
+		{
+			std::string_view t = args[i].string()->str();
+			memcpy(buf + at, t.data(), t.size());
+			at += t.size();
+		}
+		return lnew<lstr>(std::string_view(buf, at));
+	}
+
+	// the nodes made so far are only reachable from here
+	lptr res;
+	local_roots roots(nullptr, &res, 1);
+	for(size_t i = 0; i < args.size(); ++i)
+	{
+		lstr* s = args[i].string();
+		if( !s->len ) continue;
+		res = res.nilp() ? lptr(s) : lptr(lnew<lstr>(res.string(), s));
+	}
+	return res;
+}
@@ -0,0 +1,166 @@
+// Evaluates each case's source in a fresh isolate and compares what the last
+// form gives, as write prints it, against the expected text. A case expected
+// to fail gives "error: ", the message and where it was raised. Each case is
+// read as a file named after it. Prints the failures and exits with 1 if there
+// were any.
+//
+//   atlis_tests [name-prefix...]
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <sstream>
+#include "../types.h"
+#include "../funcs.h"
+#include "../isolate.h"
+
+#ifndef ATLIS_TEST_DIR
+#define ATLIS_TEST_DIR "tests"
+#endif
+// where cases can write files
+#ifndef ATLIS_TEST_OUT
+#define ATLIS_TEST_OUT "."
+#endif
+
+struct test_case
+{
+	const char* name;
+	const char* src;
+	const char* expected;
+};
+
+static const test_case cases[] = {
+	// the basics
+	{"arith", "(+ 1 (* 2 3) (- 10 4))", "13"},
+	{"arith-float", "(/ 7.0 2)", "3.500000"},
+	{"compare", "(list (< 1 2) (> 1 2) (= 3 3))", "(T Nil T)"},
+	{"quote", "'(a (b . c) \"s\" #\\x)", "(A (B . C) \"s\" #\\X)"},
+	{"if", "(list (if nil 1 2) (if 0 1 2))", "(2 1)"},
+	{"define-lambda", "(define sq (lambda (x) (* x x))) (sq 12)", "144"},
+	{"closure", "(define adder (lambda (n) (lambda (x) (+ x n)))) ((adder 3) 4)", "7"},
+	{"while", "(define f (lambda (n acc) (while (< 0 n) (set! acc (+ acc n)) (set! n (- n 1))) acc)) (f 100 0)", "5050"},
+	{"recursion", "(define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))) (fib 20)", "6765"},
+	{"apply", "(apply + 1 2 3)", "6"},
+	{"redefine-in-body", "(define f (lambda (x) (define car (lambda (y) 42)) (car x))) (f (cons 1 2))", "42"},
+	{"redefine-global", "(define g (lambda (x) (car x))) (define r (g '(1))) (define car cdr) (list r (g '(1 2)))", "(1 (2))"},
+
+	// lists
+	{"list-length", "(length (list 1 2 3 4))", "4"},
+	{"list-append", "(append '(1 2) '(3) nil '(4 5))", "(1 2 3 4 5)"},
+	{"list-reverse", "(reverse '(1 2 3))", "(3 2 1)"},
+	{"list-reverse!", "(define l (list 1 2 3)) (reverse! l)", "(3 2 1)"},
+	{"list-tail-ref", "(list (list-tail '(1 2 3 4) 2) (list-ref '(1 2 3 4) 3))", "((3 4) 4)"},
+	{"list-ref-range", "(list-ref '(1 2) 5)", "error: list-ref: index out of range"},
+	{"list-map", "(map (lambda (x) (* x x)) '(1 2 3))", "(1 4 9)"},
+	{"list-map2", "(map + '(1 2 3) '(10 20 30))", "(11 22 33)"},
+	{"list-filter", "(filter (lambda (x) (< x 3)) '(1 5 2 4))", "(1 2)"},
+	{"list-fold", "(fold cons nil '(1 2 3))", "(3 2 1)"},
+	{"list-assoc", "(list (assq 'b '((a 1) (b 2))) (assoc '(x) '(((x) 3))) (memq 'c '(a b c d)))", "((B 2) ((X) 3) (C D))"},
+	{"list-equal", "(list (equal? '(1 (2 \"s\")) '(1 (2 \"s\"))) (eq? '(1) '(1)))", "(T Nil)"},
+	{"list-missing-args", "(list (fold +) (eq? 1) (map car) (filter car) (memq 1) (list-tail '(1 2)))", "(Nil Nil Nil Nil Nil (1 2))"},
+	{"sort", "(sort '(5 3 9 1 4) <)", "(1 3 4 5 9)"},
+	{"sort-stable", "(sort '((1 a) (0 b) (1 c) (0 d)) (lambda (x y) (< (car x) (car y))))", "((0 B) (0 D) (1 A) (1 C))"},
+	{"sort-parked-gc", "(define mk (lambda (n l) (while (< 0 n) (set! l (cons n l)) (set! n (- n 1))) l)) (define slow< (lambda (a b) (mk 10000 nil) (sleep 1) (< a b))) (define out nil) (spawn (lambda () (set! out (sort '(5 3 9 1 4 8 2 7 6 0) slow<)))) (while (null? out) (sleep 10)) out", "(0 1 2 3 4 5 6 7 8 9)"},
+	{"sort-long", "(define f (lambda (n l) (while (< 0 n) (set! l (cons n l)) (set! n (- n 1))) l)) (equal? (sort (reverse (f 5000 nil)) <) (f 5000 nil))", "T"},
+
+	// non-local exits and errors
+	{"return", "(define f (lambda (x) (if (< x 0) (return 'neg)) 'pos)) (list (f -1) (f 1))", "(NEG POS)"},
+	{"catch-throw", "(catch 'done (+ 1 (throw 'done 42)))", "42"},
+	{"block", "(block out (return-from out 5) 6)", "5"},
+	{"call/ec", "(+ 1 (call/ec (lambda (k) (k 10) 20)))", "11"},
+	{"throw-no-value", "(list (catch 'a (throw 'a)) (call/ec (lambda (k) (k))))", "(Nil Nil)"},
+	{"throw-no-catch", "(throw 'nobody 1)", "error: throw: no catch for tag"},
+	{"guard", "(guard (e (error-object-message e)) (error \"bad\" 1 2))", "\"bad\""},
+	{"guard-builtin", "(guard (e (error-object? e)) (throw 'nobody 1))", "T"},
+	{"guard-raise", "(guard (e (list 'caught e)) (raise 'oops))", "(CAUGHT OOPS)"},
+	{"error-message", "(error \"bad thing:\" 42)", "error: bad thing: 42"},
+
+	// records
+	{"record", "(define-record-type point (make-point x y) point? (x point-x set-point-x!) (y point-y)) (define p (make-point 1 2)) (set-point-x! p 10) (list (point? p) (point? 5) (point-x p) (point-y p))", "(T Nil 10 2)"},
+	{"record-wrong-type", "(define-record-type a (make-a x) a? (x a-x)) (define-record-type b (make-b x) b? (x b-x)) (a-x (make-b 1))", "error: "},
+
+	{"record-arity", "(define-record-type point (make-point x y) point? (x point-x set-point-x!) (y point-y)) (make-point 1)", "error: record procedure: wrong number of arguments"},
+	// macros
+	{"quasiquote", "(define x 5) (define l '(1 2)) `(a ,x ,@l b)", "(A 5 1 2 B)"},
+	{"defmacro", "(defmacro swap! (a b) `(begin (define tmp ,a) (set! ,a ,b) (set! ,b tmp))) (define p 1) (define q 2) (swap! p q) (list p q)", "(2 1)"},
+	{"macro-expands-once", "(define n 0) (defmacro count-me () (set! n (+ n 1)) 'n) (define f (lambda () (count-me))) (f) (f) (f)", "1"},
+	{"define-syntax", "(define-syntax my-if (lambda (form) `(if ,(car (cdr form)) ,(car (cdr (cdr form))) ,(car (cdr (cdr (cdr form))))))) (my-if nil 1 2)", "2"},
+
+	// the collector and frozen data
+	{"gc-survives", "(define keep (list 1 2 3)) (define f (lambda (n) (while (< 0 n) (list n n n) (set! n (- n 1))))) (f 200000) (gc) keep", "(1 2 3)"},
+	{"gc-incremental-green", "(gc-incremental 1) (define inner (lambda (x) (sleep 20) x)) (define outer (lambda (y) (+ 1 (inner y)))) (define mk (lambda (n l) (while (< 0 n) (set! l (cons n l)) (set! n (- n 1))) l)) (spawn (lambda () (outer 5))) (sleep 1) (define junk (mk 100000 nil)) (sleep 50) (gc) (length junk)", "100000"},
+	{"green-parked-at-exit", "(define inner (lambda (x) (sleep 100000) x)) (spawn (lambda () (catch 'k (+ 1 (inner 5))))) (sleep 1) 'left", "LEFT"},
+	{"freeze", "(define l (freeze (list 1 2))) (list (frozen? l) (frozen? (list 1)))", "(T Nil)"},
+	{"freeze-set", "(define l (freeze (list 1 2))) (set-car! l 5)", "error: "},
+	{"channel", "(define c (make-channel 2)) (channel-send c '(1 2)) (channel-receive c)", "(1 2)"},
+
+	// green threads and sockets
+	{"read-parked", "(define l (unix-listen \"" ATLIS_TEST_OUT "/read.sock\")) (define c1 (unix-connect \"" ATLIS_TEST_OUT "/read.sock\")) (define s1 (socket-accept l)) (define c2 (unix-connect \"" ATLIS_TEST_OUT "/read.sock\")) (define s2 (socket-accept l)) (define r1 nil) (define r2 nil) (socket-write c1 \"abc\") (spawn (lambda () (set! r1 (read s1)))) (sleep 20) (socket-write c2 \"xy \") (spawn (lambda () (set! r2 (read s2)))) (sleep 20) (socket-write c1 \"def \") (sleep 20) (list r1 r2)", "(ABCDEF XY)"},
+
+	// measuring
+	{"time", "(time (+ 1 2) (list 4 5))", "(4 5)"},
+	{"runtime-stats", "(define allocated (lambda () (cdr (assq 'allocated-objects (runtime-stats))))) (define f (lambda (a b) (set! a (allocated)) (set! b (allocated)) (list 1 2 3) (- (+ (allocated) a) (* 2 b)))) (f)", "3"},
+	{"profile", "(profile-start 200) (define f (lambda (n) (while (< 0 n) (set! n (- n 1))))) (f 300000) (< 0 (profile-stop))", "T"},
+	{"profile-twice", "(profile-start) (guard (e (profile-stop) (error-object-message e)) (profile-start))", "\"profile-start: already profiling\""},
+	{"runtime-stats-types", "(define f (lambda (x) (list x x))) (f 1) (list (car (assq 'cons (cdr (assq 'allocations (runtime-stats))))) (< 0 (car (cdr (assq 'scope (cdr (assq 'allocations (runtime-stats))))))))", "(CONS T)"},
+	{"trace", "(trace-start 16) (define f (lambda (n) (if (< n 1) 0 (f (- n 1))))) (f 100) (list (trace-mark 'done) (trace-stop))", "(DONE 16)"},
+	{"trace-stop-twice", "(trace-start) (trace-stop) (guard (e (error-object-message e)) (trace-stop))", "\"trace-stop: not tracing\""},
+	{"heap-snapshot", "(define f (lambda () (car (heap-snapshot \"" ATLIS_TEST_OUT "/test.snap\")))) (define a (f)) (define l (list 1 2 3)) (- (f) a)", "3"},
+	{"heap-track-sites", "(heap-track-sites t) (list (heap-track-sites nil) (heap-track-sites nil))", "(T Nil)"},
+
+	// strings
+	{"string-append", "(list (string-append \"ab\" \"\" \"cd\") (string-append) (string-length \"hello\"))", "(\"abcd\" \"\" 5)"},
+	{"string-rope", "(define f (lambda (s n) (while (< 0 n) (set! s (string-append s \"0123456789\")) (set! n (- n 1))) s)) (define r (f \"\" 40)) (list (string-length r) (string-ref r 395) (substring r 395 400) (equal? r (f \"\" 40)))", "(400 53 \"56789\" T)"},
+	{"string-rope-shared", "(define f (lambda (s n) (while (< 0 n) (set! s (string-append s \"0123456789\")) (set! n (- n 1))) s)) (define r (f \"\" 40)) (define v (substring r 1 300)) (pmap (lambda (i) (list (string-ref r i) (string-ref v i))) '(0 1 2 3))", "((48 49) (49 50) (50 51) (51 52))"},
+	{"substring-view", "(define f (lambda (s n) (while (< 0 n) (set! s (string-append s \"0123456789\")) (set! n (- n 1))) s)) (define long (f \"\" 40)) (define v (substring long 5 100)) (define w (substring v 10 45)) (set! long nil) (set! v nil) (gc) (list (string-length w) (substring w 0 5) (substring w 30))", "(35 \"56789\" \"56789\")"},
+	{"string-ref-range", "(string-ref \"abc\" 3)", "error: string-ref: index out of range"},
+	{"substring-range", "(substring \"abc\" 2 1)", "error: substring: range out of bounds"},
+	{"substring-equal", "(define f (lambda (s n) (while (< 0 n) (set! s (string-append s \"abcdefghij\")) (set! n (- n 1))) s)) (list (equal? (substring (f \"\" 30) 0 40) (f \"\" 4)) (equal? (substring (f \"\" 30) 1 41) (f \"\" 4)))", "(T Nil)"},
+
+	// source positions
+	{"source-position", "(source-position '(a b))", "(\"source-position\" 1 19)"},
+	{"source-position-built", "(source-position (list 1 2))", "Nil"},
+	{"error-site", "(define f (lambda (x) (error \"oops\" x))) (f 1)", "error: oops 1 (in F at error-site:1:19)"},
+	{"error-site-guarded", "(define f (lambda () (car (error \"oops\")))) (guard (e 1) (f)) (error \"late\")", "error: late"},
+	{"load", "(load \"" ATLIS_TEST_DIR "/source.lisp\")", "49"},
+	{"load-error-site", "(load \"" ATLIS_TEST_DIR "/source.lisp\") (loaded-fail)", "error: failed (in LOADED-FAIL at " ATLIS_TEST_DIR "/source.lisp:3:32)"},
+	{"load-missing", "(load \"no/such/file.lisp\")", "error: load: can't open file"},
+};
+
+// "error: " alone matches any error
+static bool matches(const std::string& got, const char* expected)
+{
+	if( !strcmp(expected, "error: ") ) return got.compare(0, 7, "error: ") == 0;
+	return got == expected;
+}
+
+int main(int argc, char** argv)
+{
+	int run = 0, failed = 0;
+	for(const test_case& t : cases)
+	{
+		bool wanted = argc < 2;
+		for(int i = 1; i < argc; ++i) wanted = wanted || !strncmp(t.name, argv[i], strlen(argv[i]));
+		if( !wanted ) continue;
+
+		// anything the case prints is dropped
+		std::string got;
+		std::stringstream out;
+		Isolate* I = isolate_create(&std::cin, &out);
+	try {
+		got = isolate_eval_string(I, t.src, t.name);
+	} catch(const char* e) {
+		got = std::string("error: ") + e + error_site();
+	}
+		isolate_destroy(I);
+
+		run++;
+		if( !matches(got, t.expected) )
+		{
+			failed++;
+			printf("FAIL %s\n  expected: %s\n  got:      %s\n", t.name, t.expected, got.c_str());
+		}
+	}
+
+	printf("%d/%d passed\n", run - failed, run);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,4 @@
+; loaded by the load cases in atlis_tests.cpp
+(define loaded-square (lambda (x) (* x x)))
+(define loaded-fail (lambda () (error "failed")))
+(loaded-square 7)
@@ -0,0 +1,262 @@
+#include <chrono>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <stdio.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "types.h"
+#include "funcs.h"
+#include "isolate.h"
+
+// An event tracer, for seeing where the time went along a timeline rather
+// than in total.
+//   (trace-start [events])          starts tracing, keeping the last 'events'
+//                                   events of each thread, 65536 by default
+//   (trace-mark name)               notes an instant, named by a symbol
+//   (trace-stop [file])             stops and writes what was kept to the
+//                                   file in Chrome's trace format, for
+//                                   Perfetto or chrome://tracing. gives the
+//                                   number of events written
+//
+// What gets traced: calls to interpreted and compiled funcs (as call_func
+// enters them, like the profiler, so builtins are their caller's time), the
+// collector's pauses, waiting on a socket, a channel or the pool, and a
+// counter of what each thread has allocated, bumped every 64KB so bursts show
+// up as steep stretches.
+//
+// Each thread writes into a ring of its own and nothing else touches it until
+// the trace is written, so recording an event takes no lock; once a ring is
+// full the oldest events go. Spans are recorded when they end, as complete
+// events, which keeps green threads that park mid-call from mismatching
+// begins and ends. Times are the time stamp counter, turned into
+// microseconds against the clock at start and stop.
+//
+// Write the trace once the threads are done; events still being recorded as
+// it's written may come out torn.
+
+const size_t TRACE_DEFAULT_EVENTS = 1<<16;
+const size_t TRACE_ALLOC_EVERY = 64<<10;
+
+std::atomic<bool> trace_on(false);
+
+struct trace_event
+{
+	u64 start;
+	u64 end;
+	uintptr_t what;
+	trace_kind kind;
+};
+
+struct trace_ring
+{
+	std::vector<trace_event> events; // size a power of two
+	std::atomic<u64> head;           // events ever recorded this session
+	u64 epoch = 0;
+	int tid;
+	size_t allocated = 0;            // bytes this session
+	size_t alloc_noted = 0;
+};
+
+struct tracer
+{
+	std::mutex lock; // rings being added, trace-start and trace-stop
+	std::vector<trace_ring*> rings;
+	std::atomic<u64> epoch;
+	size_t events = TRACE_DEFAULT_EVENTS;
+	std::chrono::steady_clock::time_point wall0;
+	u64 tsc0;
+};
+
+static tracer tr;
+extern lptr global_T;
+static thread_local trace_ring* my_ring = nullptr;
+
+u64 trace_now()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// the calling thread's ring, emptied the first time it's used in a session.
+// rings stay with the tracer after their threads exit, since their events
+// can still be wanted
+static trace_ring* ring()
+{
+	trace_ring* R = my_ring;
+	u64 epoch = tr.epoch.load(std::memory_order_acquire);
+	if( R && R->epoch == epoch ) return R;
+
+	std::lock_guard<std::mutex> guard(tr.lock);
+	if( !R )
+	{
+		R = my_ring = new trace_ring;
+		R->tid = tr.rings.size() + 1;
+		tr.rings.push_back(R);
+	}
+	if( R->events.size() != tr.events ) R->events.assign(tr.events, trace_event());
+	R->head.store(0, std::memory_order_relaxed);
+	R->allocated = R->alloc_noted = 0;
+	R->epoch = epoch;
+	return R;
+}
+
+static void record(trace_kind kind, uintptr_t what, u64 start, u64 end)
+{
+	trace_ring* R = ring();
+	u64 h = R->head.load(std::memory_order_relaxed);
+	trace_event& e = R->events[h & (R->events.size()-1)];
+	e.start = start;
+	e.end = end;
+	e.what = what;
+	e.kind = kind;
+	R->head.store(h+1, std::memory_order_release);
+	return;
+}
+
+void trace_span_end(trace_kind kind, uintptr_t what, u64 start)
+{
+	// a span that began before this session did
+	if( !trace_on.load(std::memory_order_relaxed) || start < tr.tsc0 ) return;
+	if( kind == TRACE_CALL ) what = profile_frame((func*)what);
+	record(kind, what, start, trace_now());
+	return;
+}
+
+void trace_alloc(size_t bytes)
+{
+	trace_ring* R = ring();
+	R->allocated += bytes;
+	if( R->allocated - R->alloc_noted < TRACE_ALLOC_EVERY ) return;
+	R->alloc_noted = R->allocated;
+	u64 now = trace_now();
+	record(TRACE_ALLOC, R->allocated, now, now);
+	return;
+}
+
+lptr trace_start(const MultiArg& args)
+{
+	std::lock_guard<std::mutex> guard(tr.lock);
+	if( trace_on ) throw "trace-start: already tracing";
+
+	size_t n = TRACE_DEFAULT_EVENTS;
+	if( args.size() && args[0].type() == LTYPE_INT && (s64)args[0].as_int() > 0 )
+	{
+		n = 1;
+		while( n < args[0].as_int() ) n <<= 1;
+	}
+	tr.events = n;
+	tr.wall0 = std::chrono::steady_clock::now();
+	tr.tsc0 = trace_now();
+	tr.epoch++;
+	trace_on = true;
+	return global_T;
+}
+
+lptr trace_mark(lptr what)
+{
+	if( what.type() == LTYPE_STR ) what = intern_c(what.string()->str());
+	if( what.type() != LTYPE_SYM ) throw "trace-mark: expected a symbol";
+	if( !trace_on ) return lptr();
+
+	u64 now = trace_now();
+	record(TRACE_MARK, (uintptr_t)what.val, now, now);
+	return what;
+}
+
+static std::string json_string(const std::string& s)
+{
+	std::string out = "\"";
+	for(char c : s)
+	{
+		if( c == '"' || c == '\\' ) { out += '\\'; out += c; }
+		else if( (unsigned char)c < 0x20 ) { char buf[8]; snprintf(buf, sizeof(buf), "\\u%04x", c); out += buf; }
+		else out += c;
+	}
+	return out + "\"";
+}
+
+// stops tracing and writes the trace to path, if there is one
+u64 trace_finish(const char* path)
+{
+	std::lock_guard<std::mutex> guard(tr.lock);
+	if( !trace_on ) throw "trace-stop: not tracing";
+	trace_on = false;
+
+	// microseconds per tick, from how far both clocks got
+	u64 ticks = trace_now() - tr.tsc0;
+	double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - tr.wall0).count();
+	double scale = ticks ? us / ticks : 0;
+
+	FILE* f = nullptr;
+	if( path )
+	{
+		f = fopen(path, "w");
+		if( !f ) throw "trace-stop: can't write the trace";
+	}
+
+	u64 written = 0, lost = 0;
+	int pid = getpid();
+	u64 epoch = tr.epoch;
+	bool first = true;
+	auto emit = [&](const std::string& ev) {
+		if( f ) fprintf(f, "%s\n  %s", first ? "" : ",", ev.c_str());
+		first = false;
+	};
+
+	if( f ) fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+	for(trace_ring* R : tr.rings)
+	{
+		if( R->epoch != epoch ) continue;
+		u64 head = R->head.load(std::memory_order_acquire);
+		u64 n = std::min<u64>(head, R->events.size());
+		lost += head - n;
+
+		char buf[256];
+		snprintf(buf, sizeof(buf), "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, \"args\": {\"name\": \"thread %d\"}}", pid, R->tid, R->tid);
+		emit(buf);
+		for(u64 i = head - n; i < head; ++i)
+		{
+			const trace_event& e = R->events[i & (R->events.size()-1)];
+			double ts = (e.start - tr.tsc0) * scale;
+			std::string name;
+			const char* cat = "";
+			switch( e.kind )
+			{
+			case TRACE_CALL: name = profile_frame_name(e.what); cat = "call"; break;
+			case TRACE_GC: name = (const char*)e.what; cat = "gc"; break;
+			case TRACE_WAIT: name = (const char*)e.what; cat = "wait"; break;
+			case TRACE_ALLOC: name = "allocated"; cat = "alloc"; break;
+			case TRACE_MARK: name = profile_frame_name(e.what); cat = "mark"; break;
+			}
+
+			if( e.kind == TRACE_ALLOC )
+				snprintf(buf, sizeof(buf), "\"ph\": \"C\", \"ts\": %.3f, \"pid\": %d, \"tid\": %d, \"args\": {\"bytes\": %llu}",
+					ts, pid, R->tid, (unsigned long long)e.what);
+			else if( e.kind == TRACE_MARK )
+				snprintf(buf, sizeof(buf), "\"ph\": \"i\", \"s\": \"t\", \"ts\": %.3f, \"pid\": %d, \"tid\": %d", ts, pid, R->tid);
+			else
+				snprintf(buf, sizeof(buf), "\"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, \"tid\": %d",
+					ts, (e.end - e.start) * scale, pid, R->tid);
+			written++;
+			emit("{\"name\": " + json_string(name) + ", \"cat\": \"" + cat + "\", " + buf + "}");
+		}
+	}
+	if( f )
+	{
+		fprintf(f, "\n], \"otherData\": {\"overwritten\": %llu}}\n", (unsigned long long)lost);
+		fclose(f);
+	}
+	return written;
+}
+
+lptr trace_stop(const MultiArg& args)
+{
+	return lptr(trace_finish(args.size() && args[0].type() == LTYPE_STR ? args[0].string()->c_str() : nullptr));
+}
@@ -5,7 +5,12 @@
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <variant>
+#include <atomic>
+#include <exception>
+#include <new>
+#include <unistd.h>
 
 typedef uint64_t u64;
 typedef uint32_t u32;
@@ -27,10 +32,18 @@ const int LTYPE_OBJ = 6;
 const int LTYPE_STR = 7;
 const int LTYPE_ENV = 8;
 const int LTYPE_STREAM = 9;
+const int LTYPE_FUTURE = 10;
+const int LTYPE_CHANNEL = 11;
+const int LTYPE_BYTES = 12;
+const int LTYPE_RECORD = 13;
 
 const int LGC_MARK = (1<<31);
 const int LGC_NO_FREE = (1<<30);
-const int LGC_TYPE_MASK = (LGC_MARK|LGC_NO_FREE);
+const int LGC_FROZEN = (1<<29); // deeply immutable, lives in the shared frozen region
+const int LGC_TYPE_MASK = (LGC_MARK|LGC_NO_FREE|LGC_FROZEN);
+const int LOBJ_HAS_POS = (1<<28); // a cons the reader noted a source position for, see source.cpp
+const int LOBJ_HAS_SITE = (1<<27); // has an entry in the isolate's alloc_sites, see heap.cpp
+const int LOBJ_FLAGS = (LGC_TYPE_MASK|LOBJ_HAS_POS|LOBJ_HAS_SITE); // the bits of type that aren't the type
 
 struct lobj
 {
@@ -45,6 +58,10 @@ struct fscope;
 struct func;
 struct lstr;
 struct lstream;
+struct lfuture;
+struct lchannel;
+struct lbytes;
+struct lrecord;
 
 class lptr
 {
@@ -65,7 +82,7 @@ public:
 
 	lptr(float v)
 	{
-		val = *(u64*)&v;
+		val = *(u32*)&v;
 		val <<= 3;
 		val |= LTYPE_FLOAT;
 	}
@@ -111,6 +128,34 @@ public:
 		return;
 	}
 
+	lptr(lfuture* f)
+	{
+		val =(u64) f;
+		val |= LTYPE_OBJ;
+		return;
+	}
+
+	lptr(lchannel* c)
+	{
+		val =(u64) c;
+		val |= LTYPE_OBJ;
+		return;
+	}
+
+	lptr(lbytes* b)
+	{
+		val =(u64) b;
+		val |= LTYPE_OBJ;
+		return;
+	}
+
+	lptr(lrecord* r)
+	{
+		val =(u64) r;
+		val |= LTYPE_OBJ;
+		return;
+	}
+
 	lptr(func* f)
 	{
 		val =(u64) f;
@@ -129,8 +174,8 @@ public:
 		}
 
 		val =(u64) p;
-		if( (p->type&~LGC_TYPE_MASK) < LTYPE_OBJ )
-			val |= (p->type&~LGC_TYPE_MASK);
+		if( (p->type&~LOBJ_FLAGS) < LTYPE_OBJ )
+			val |= (p->type&~LOBJ_FLAGS);
 		else
 			val |= 4;
 		return;
@@ -147,6 +192,10 @@ public:
 	symbol* sym() const { return (symbol*)(val&~7); }
 	fscope* env() const { return (fscope*)(val&~7); }
 	lstr* string() const { return (lstr*)(val&~7); }
+	lfuture* future() const { return (lfuture*)(val&~7); }
+	lchannel* channel() const { return (lchannel*)(val&~7); }
+	lbytes* bytes() const { return (lbytes*)(val&~7); }
+	lrecord* record() const { return (lrecord*)(val&~7); }
 	u64 as_int() const { return (u64) ( ((s64)val)>>3 ); }
 	char as_char() const { return (char)(val>>3); }
 	float as_float() const { u64 v = val>>3; return *(float*)&v; }
@@ -157,7 +206,7 @@ public:
 		if( t == LTYPE_OBJ )
 		{
 			lobj* L =(lobj*) (val&~7);
-			if( L ) t = L->type & ~LGC_TYPE_MASK;
+			if( L ) t = L->type & ~LOBJ_FLAGS;
 		}
 		return t;
 	}
@@ -179,25 +228,34 @@ struct cons
 	lptr a, b;
 };
 
+// symbols are interned once and never freed. the (already upper-cased) name is
+// stored inline after the header, so a symbol is a single allocation.
 struct symbol
 {
-	symbol() : type(LTYPE_SYM) {}
-	symbol(const std::string& n) : type(LTYPE_SYM), name(n) { }
+	static symbol* create(std::string_view n, u32 h);
+
+	std::string_view str() const { return std::string_view(name, len); }
 
 	u32 type;
-	std::string name;
+	u32 hash;
+	symbol* next; // chain in the intern table bucket
+	u32 len;
+	char name[1];
+
+private:
+	symbol() : type(LTYPE_SYM) {}
 };
 
 struct fscope
 {
-	fscope(fscope* par = nullptr) : type(LTYPE_ENV), parent(par), need_return(false) {}
+	fscope(fscope* par = nullptr) : type(LTYPE_ENV), F(nullptr), parent(par), caller(nullptr), captured(false) {}
 
 	u32 type;
 	func* F;
 	u32 pc;
 	fscope* parent;
-	bool need_return;
-	lptr retval;
+	fscope* caller; // the scope that was current when this one was entered
+	bool captured; // a closure refers to this scope, so it must outlive the call
 
 	std::vector<std::pair<symbol*, lptr>> symbols;
 	std::vector<int> scope; //nested scopes (LET, etc). number of symbols to pop
@@ -206,36 +264,108 @@ struct fscope
 
 const int LFUNC_SPECIAL = 1;  // function is special form
 const int LFUNC_BYTECODE = 2; // func::ptr is bytecode not native
+const int LFUNC_FFI = 4;      // func::ptr is a foreign_fn, called through libffi
+const int LFUNC_NOJIT = 8;    // the JIT gave up on this func, don't count its calls
+const int LFUNC_ESCAPE = 16;  // the escape procedure call/ec passes, see escape.cpp
+const int LFUNC_RECORD = 32;  // func::ptr is a record_proc, see record.cpp
+const int LFUNC_MACRO = 64;   // called with the unevaluated arguments, gives the expansion; see macro.cpp
+const int LFUNC_MACRO_FORM = 128; // a macro that's given the whole form instead
+
+struct jit_code;
 
 struct func
 {
 	func() : type(LTYPE_FUNC), flags(0), num_args(0), closure(nullptr),
-			ptr(nullptr) {}
+			ptr(nullptr), calls(0), jit(nullptr), opt_epoch(0) {}
 
-	func(void* p, u32 f, u32 numargs) : type(LTYPE_FUNC), ptr(p), flags(f), num_args(numargs), closure(nullptr) {}
+	func(void* p, u32 f, u32 numargs) : type(LTYPE_FUNC), ptr(p), flags(f), num_args(numargs), closure(nullptr), calls(0), jit(nullptr), opt_epoch(0) {}
 
 	u32 type;
 	u32 flags;
 	u32 num_args;
 	fscope* closure;
 	void* ptr;
+	lptr params;
 	lptr body;
 	lptr pos;
+	lptr name;     // the symbol it was first defined as, for the profiler
+	u32 calls;     // interpreted calls, until the JIT takes over
+	jit_code* jit; // machine code for the body, once it's hot
+	lptr opt;      // (optimized-body . dependencies), see opt.cpp
+	u64 opt_epoch;
+};
+
+// A string is one of
+//   small  up to LSTR_SMALL bytes, kept in the object
+//   flat   a buffer of its own
+//   slice  len bytes of another string's text, from off; shares its buffer
+//   rope   the text of left then right, made flat the first time it's read
+// kind never changes once the string is made. A slice or rope that's been
+// given text of its own, a rope when it's read, a slice for c_str, keeps it
+// in flat, and after that its parent or pieces aren't looked at again. The
+// text of small strings and of anything in flat ends with a zero byte. See
+// strings.cpp.
+const u32 LSTR_SMALL = 15;
+
+enum lstr_kind : u8
+{
+	LSTR_KIND_SMALL,
+	LSTR_KIND_FLAT,
+	LSTR_KIND_SLICE,
+	LSTR_KIND_ROPE,
 };
 
 struct lstr
 {
-	lstr() : type(LTYPE_STR) {}
-	lstr(const std::string& s) : type(LTYPE_STR), txt(s) {}
+	lstr() : type(LTYPE_STR), len(0), flat(nullptr), kind(LSTR_KIND_SMALL) { small[0] = 0; }
+	lstr(std::string_view s);
+	lstr(lstr* parent, u32 off, u32 n);
+	lstr(lstr* left, lstr* right);
+	~lstr();
 
 	u32 type;
-	std::string txt;
+	u32 len;
+	char* flat; // set once, see above
+	u8 kind;    // an lstr_kind
+	union
+	{
+		char small[LSTR_SMALL+1];
+		struct { lstr* parent; u32 off; } slice; // parent's str() doesn't have to flatten
+		struct { lstr* left; lstr* right; } rope;
+	};
+
+	// flat, as it has to be read while another thread might be setting it
+	char* flat_text() const { return __atomic_load_n(&flat, __ATOMIC_ACQUIRE); }
+
+	// the text. reading a rope flattens it
+	std::string_view str()
+	{
+		if( kind == LSTR_KIND_SMALL ) return std::string_view(small, len);
+		if( char* f = flat_text() ) return std::string_view(f, len);
+		if( kind == LSTR_KIND_SLICE ) return slice.parent->str().substr(slice.off, len);
+		return flatten();
+	}
+	// the text with a zero byte after it, which a slice has to be copied for
+	const char* c_str()
+	{
+		if( kind == LSTR_KIND_SMALL ) return small;
+		if( char* f = flat_text() ) return f;
+		return flatten().data();
+	}
+	std::string text() { return std::string(str()); }
+
+private:
+	std::string_view flatten();
 };
 
 const int LSTREAM_STRING = 1;
 const int LSTREAM_FILE = 2;
+const int LSTREAM_SOCKET = 4; // strm is a non-blocking fd
+const int LSTREAM_LISTEN = 8; // listening socket, only good for socket-accept
 const int LSTREAM_IN = 32;
 const int LSTREAM_OUT = 16;
+const int LSTREAM_NOCLOSE = 64; // underlying stream is owned elsewhere (eg std::cin)
+const int LSTREAM_SOURCE = 128; // program text, the reader notes where lists start
 
 struct lstream
 {
@@ -243,19 +373,25 @@ struct lstream
 	lstream(std::istream* i) : type(LTYPE_STREAM), flags(LSTREAM_IN), strm(i) {}
 	lstream(std::fstream* f, u32 fl = LSTREAM_FILE|LSTREAM_IN|LSTREAM_OUT) : type(LTYPE_STREAM), flags(fl), strm(f) {}
 	lstream(std::ostream* o) : type(LTYPE_STREAM), flags(LSTREAM_OUT), strm(o) {}
-	lstream(std::stringstream* s): type(LTYPE_STREAM),flags(LSTREAM_STRING), strm(s) {}
+	lstream(std::stringstream* s): type(LTYPE_STREAM),flags(LSTREAM_STRING|LSTREAM_IN|LSTREAM_OUT), strm(s) {}
+	lstream(int fd, u32 fl) : type(LTYPE_STREAM), flags(fl), strm(fd), rpos(0) {}
 
 	~lstream() 
 	{ 
-		if( std::holds_alternative<std::fstream*>(strm) )
+		if( flags & LSTREAM_NOCLOSE )
+		{
+		} else if( std::holds_alternative<std::fstream*>(strm) )
 		{
 			delete std::get<std::fstream*>(strm);
 		} else if( std::holds_alternative<std::istream*>(strm) ) {
 			delete std::get<std::istream*>(strm);
 		} else if( std::holds_alternative<std::ostream*>(strm) ) {
 			delete std::get<std::ostream*>(strm);
+		} else if( std::holds_alternative<std::stringstream*>(strm) ) {
+			delete std::get<std::stringstream*>(strm);
 		} else if( std::holds_alternative<int>(strm) ) {
-			int a = std::get<int>(strm);
+			int fd = std::get<int>(strm);
+			if( fd >= 0 ) ::close(fd);
 		}
 
 		strm = 0;
@@ -265,8 +401,91 @@ struct lstream
 	u32 type;
 	u32 flags;
 	std::variant<std::fstream*, std::istream*, std::ostream*, std::stringstream*, int, std::monostate> strm;
+
+	// socket buffering. bytes rbuf[rpos..] are read but not consumed yet, wbuf
+	// holds output the fd wasn't ready to take.
+	std::string rbuf;
+	size_t rpos;
+	std::string wbuf;
+
+	// where reading is, for LSTREAM_SOURCE streams
+	u32 file = 0;
+	u32 line = 1;
+	u32 col = 1;
+};
+
+// result of (future expr), filled in by whichever pool thread runs it
+struct lfuture
+{
+	lfuture(lptr e, fscope* en) : type(LTYPE_FUTURE), done(false), expr(e), env(en) {}
+
+	u32 type;
+	std::atomic<bool> done;
+	lptr expr;
+	fscope* env;
+	lptr value;
+	std::exception_ptr error;
+};
+
+struct channel;
+
+// an isolate's handle on a channel, which itself is shared by every isolate and
+// lives as long as any handle to it does
+struct lchannel
+{
+	lchannel(channel* c);
+	~lchannel();
+
+	u32 type;
+	channel* ch;
 };
 
+// a bytevector. the bytes live outside the object header at an address that
+// never changes, so C code can be handed data directly; LGC_NO_FREE pins it
+// for as long as C holds on to that pointer. a bytevector can also wrap memory
+// somebody else allocated, with a finalizer to give it back.
+typedef void bytes_finalizer(u8* data, size_t len, void* ctx);
+
+struct lbytes
+{
+	// one zero byte past the end, so C string functions stop there
+	lbytes(size_t n) : type(LTYPE_BYTES), data(new u8[n+1]()), len(n), finalizer(nullptr), ctx(nullptr), owned(true) {}
+	lbytes(u8* p, size_t n, bytes_finalizer* fin, void* c) : type(LTYPE_BYTES), data(p), len(n), finalizer(fin), ctx(c), owned(false) {}
+
+	~lbytes()
+	{
+		if( owned )
+			delete[] data;
+		else if( finalizer )
+			finalizer(data, len, ctx);
+		return;
+	}
+
+	u32 type;
+	u8* data;
+	size_t len;
+	bytes_finalizer* finalizer;
+	void* ctx;
+	bool owned;
+};
+
+// an instance of a define-record-type type. the slots follow the header, so
+// reading a field is an indexed load; the size is fixed by the type, and
+// lrecord_new allocates an instance with room for them.
+struct lrecord
+{
+	static size_t size(u32 n) { return sizeof(lrecord) + n*sizeof(lptr); }
+
+	lrecord(lptr r, u32 count) : type(LTYPE_RECORD), n(count), rtd(r)
+	{
+		for(u32 i = 0; i < n; ++i) new(&slots[i]) lptr();
+	}
+
+	u32 type;
+	u32 n;
+	lptr rtd; // (name field...), the type every instance and procedure of it shares
+	lptr slots[];
+};
 
 struct StaticArgs
 {
@@ -324,6 +543,7 @@ public:
 		if( them.index() == 1 )
 		{
 			const auto *V = std::get_if<1>(&them);
+			if( E >= V->size() ) return lptr();
 			return (*V)[E];
 		} else if( them.index() == 2 ) {
 			const StaticArgs* SA = std::get_if<2>(&them);